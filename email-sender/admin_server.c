@@ -0,0 +1,214 @@
+/**
+ * admin_server.c
+ *
+ * Admin socket declared in admin_server.h.
+ */
+
+#define _GNU_SOURCE            /* accept4() */
+
+#include "admin_server.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define MAX_COMMAND_SIZE 512
+
+/* One admin connection */
+struct admin_client {
+    struct admin_server *server;
+    int fd;
+    struct io_watcher *watcher;
+    char command[MAX_COMMAND_SIZE];
+    size_t received;
+    char *response;               /* Complete reply once the command is read */
+    size_t response_len;
+    size_t sent;
+};
+
+static void close_client(struct admin_client *client) {
+    event_loop_del_fd(client->server->loop, client->watcher);
+    close(client->fd);
+    free(client->response);
+    free(client);
+}
+
+static void set_setting(struct admin_server *server, const char *name, const char *value,
+                        FILE *out) {
+    struct settings changed = *settings_get();
+    const char *error;
+
+    if (!name || !value) {
+        fputs("error usage: set NAME VALUE\n", out);
+    } else if (settings_set(&changed, name, value, &error) < 0) {
+        fprintf(out, "error %s: %s\n", name, error);
+    } else if (server->publish(&changed, server->arg) < 0) {
+        fputs("error failed to publish\n", out);
+    } else {
+        log_info("Admin: set %s %s", name, value);
+        settings_print(settings_get(), name, out);
+        fputs("ok\n", out);
+    }
+}
+
+/**
+ * Runs the command in client->command and renders the reply into
+ * client->response.
+ */
+static int run_command(struct admin_client *client) {
+    struct admin_server *server = client->server;
+    char *save = NULL;
+    char *verb = strtok_r(client->command, " \t\r\n", &save);
+    char *name = verb ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+    char *value = name ? strtok_r(NULL, "\r\n", &save) : NULL;
+    FILE *out = open_memstream(&client->response, &client->response_len);
+
+    if (!out) {
+        return -1;
+    }
+    if (value) {
+        value += strspn(value, " \t");
+    }
+    if (!verb) {
+        fputs("error expected show, get, set or reload\n", out);
+    } else if (strcmp(verb, "show") == 0) {
+        settings_print(settings_get(), NULL, out);
+        fputs("ok\n", out);
+    } else if (strcmp(verb, "get") == 0) {
+        if (!name) {
+            fputs("error usage: get NAME\n", out);
+        } else if (settings_print(settings_get(), name, out) < 0) {
+            fprintf(out, "error %s: unknown setting\n", name);
+        } else {
+            fputs("ok\n", out);
+        }
+    } else if (strcmp(verb, "set") == 0) {
+        set_setting(server, name, value, out);
+    } else if (strcmp(verb, "reload") == 0) {
+        fputs(server->reload(server->arg) < 0 ? "error failed to reload\n" : "ok\n", out);
+    } else {
+        fprintf(out, "error unknown command %s\n", verb);
+    }
+    fclose(out);
+    return 0;
+}
+
+static void on_client_ready(struct event_loop *loop, int fd, uint32_t events, void *arg) {
+    struct admin_client *client = arg;
+    ssize_t n;
+
+    (void)events;
+    if (!client->response) {
+        n = read(fd, client->command + client->received,
+                 sizeof(client->command) - 1 - client->received);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (n < 0 || (n == 0 && client->received == 0)) {
+            close_client(client);
+            return;
+        }
+        client->received += (size_t)n;
+        client->command[client->received] = '\0';
+
+        /* Wait for the end of the line, unless the client already closed */
+        if (n > 0 && !strchr(client->command, '\n') &&
+            client->received < sizeof(client->command) - 1) {
+            return;
+        }
+        if (run_command(client) < 0) {
+            close_client(client);
+            return;
+        }
+        event_loop_mod_fd(loop, client->watcher, EPOLLOUT);
+    }
+
+    while (client->sent < client->response_len) {
+        n = write(fd, client->response + client->sent, client->response_len - client->sent);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return; /* Finished on the next EPOLLOUT */
+        }
+        if (n <= 0) {
+            break;
+        }
+        client->sent += (size_t)n;
+    }
+    close_client(client);
+}
+
+static void on_accept(struct event_loop *loop, int fd, uint32_t events, void *arg) {
+    struct admin_server *server = arg;
+    int client_fd;
+
+    (void)events;
+    while ((client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct admin_client *client = calloc(1, sizeof(*client));
+
+        if (!client) {
+            close(client_fd);
+            continue;
+        }
+        client->server = server;
+        client->fd = client_fd;
+        client->watcher = event_loop_add_fd(loop, client_fd, EPOLLIN, on_client_ready, client);
+        if (!client->watcher) {
+            close(client_fd);
+            free(client);
+        }
+    }
+}
+
+int admin_server_init(struct admin_server *server, struct event_loop *loop, const char *path,
+                      admin_publish_fn publish, admin_reload_fn reload, void *arg) {
+    struct sockaddr_un addr;
+
+    memset(server, 0, sizeof(*server));
+    server->loop = loop;
+    server->publish = publish;
+    server->reload = reload;
+    server->arg = arg;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("Admin socket path too long: %s", path);
+        return -1;
+    }
+    snprintf(server->path, sizeof(server->path), "%s", path);
+
+    server->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, server->path, strlen(server->path));
+    unlink(server->path);
+    if (bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(server->path, S_IRUSR | S_IWUSR) < 0 || listen(server->fd, 16) < 0) {
+        perror("admin listen");
+        close(server->fd);
+        unlink(server->path);
+        return -1;
+    }
+
+    server->watcher = event_loop_add_fd(loop, server->fd, EPOLLIN, on_accept, server);
+    if (!server->watcher) {
+        close(server->fd);
+        unlink(server->path);
+        return -1;
+    }
+    return 0;
+}
+
+void admin_server_destroy(struct admin_server *server) {
+    event_loop_del_fd(server->loop, server->watcher);
+    close(server->fd);
+    unlink(server->path);
+}
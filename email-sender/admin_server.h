@@ -0,0 +1,61 @@
+/**
+ * admin_server.h
+ *
+ * Unix socket for inspecting and changing the live settings, served from
+ * the event loop. Each connection carries one command line and gets the
+ * reply, ending with "ok" or "error <reason>", before it is closed:
+ *
+ *     show              every setting, as NAME=value lines
+ *     get NAME          one setting
+ *     set NAME VALUE    change one setting (the reply shows it as applied)
+ *     reload            read the config file again, as on SIGHUP
+ *
+ * e.g. echo "set CLAIM_BATCH_SIZE 64" | socat - UNIX-CONNECT:/path/to/socket
+ */
+
+#ifndef ADMIN_SERVER_H
+#define ADMIN_SERVER_H
+
+#include "event_loop.h"
+#include "settings.h"
+
+/* Publishes changed settings and applies them; 0 on success, -1 on failure */
+typedef int (*admin_publish_fn)(const struct settings *settings, void *arg);
+
+/* Reloads the config file; 0 on success, -1 on failure */
+typedef int (*admin_reload_fn)(void *arg);
+
+struct admin_server {
+    struct event_loop *loop;
+    int fd;                            /* Listening socket */
+    struct io_watcher *watcher;
+    char path[108];                    /* sun_path */
+    admin_publish_fn publish;
+    admin_reload_fn reload;
+    void *arg;
+};
+
+/**
+ * Starts listening on a Unix socket, replacing a stale one at path. The
+ * socket is only accessible to the owner.
+ *
+ * @param server  Server to initialize
+ * @param loop    Event loop serving connections (the publishing thread's)
+ * @param path    Socket path
+ * @param publish Called with the settings a "set" produced
+ * @param reload  Called for "reload"
+ * @param arg     Opaque pointer passed to both
+ * @return        0 on success, -1 on failure
+ */
+int admin_server_init(struct admin_server *server, struct event_loop *loop, const char *path,
+                      admin_publish_fn publish, admin_reload_fn reload, void *arg);
+
+/**
+ * Stops listening and removes the socket. Commands in progress are
+ * abandoned.
+ *
+ * @param server Server to destroy
+ */
+void admin_server_destroy(struct admin_server *server);
+
+#endif /* ADMIN_SERVER_H */
@@ -0,0 +1,284 @@
+/**
+ * attachment_reader.c
+ *
+ * Asynchronous attachment reader declared in attachment_reader.h.
+ */
+
+#include "attachment_reader.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "ticket_db.h"
+
+struct attachment_request {
+    int attachment_id;
+    long offset;
+    size_t len;
+    attachment_chunk_fn done;     /* NULL once run or cancelled */
+    void *arg;
+    struct attachment_request *next;
+};
+
+/**
+ * Fails every queued request. The list is detached first, since the
+ * callbacks may queue new ones.
+ */
+static void fail_requests(struct attachment_reader *reader) {
+    struct attachment_request *req = reader->head;
+
+    reader->head = reader->tail = NULL;
+    reader->sent = 0;
+    while (req) {
+        struct attachment_request *next = req->next;
+
+        if (req->done) {
+            req->done(NULL, req->arg);
+        }
+        free(req);
+        req = next;
+    }
+}
+
+/**
+ * The connection is gone: close it and fail what was waiting on it. A new
+ * one is opened when the next chunk is asked for.
+ */
+static void fail(struct attachment_reader *reader, const char *what) {
+    log_error("Attachment reader failed to %s: %s", what, PQerrorMessage(reader->conn));
+    event_loop_del_fd(reader->loop, reader->watcher);
+    reader->watcher = NULL;
+    PQfinish(reader->conn);
+    reader->conn = NULL;
+    reader->want_write = 0;
+    fail_requests(reader);
+}
+
+/**
+ * Pushes buffered output to the server, watching for writability while
+ * libpq still holds data the socket could not take.
+ *
+ * @return 0 on success, -1 if the connection failed
+ */
+static int flush_output(struct attachment_reader *reader) {
+    int r = PQflush(reader->conn);
+    int want_write = (r == 1);
+
+    if (r < 0) {
+        return -1;
+    }
+    if (want_write != reader->want_write) {
+        reader->want_write = want_write;
+        event_loop_mod_fd(reader->loop, reader->watcher, EPOLLIN | (want_write ? EPOLLOUT : 0));
+    }
+    return 0;
+}
+
+/**
+ * Sends the request at the head of the queue. Failure is left to the
+ * caller, which decides whose callbacks may run.
+ *
+ * @return 0 on success, -1 if the connection failed
+ */
+static int send_head(struct attachment_reader *reader) {
+    struct attachment_request *req = reader->head;
+
+    if (ticket_db_send_attachment_chunk(reader->conn, req->attachment_id, req->offset,
+                                        (int)req->len) < 0) {
+        return -1;
+    }
+    reader->sent = 1;
+    return flush_output(reader);
+}
+
+/**
+ * Runs the callback of the request in flight with its result.
+ */
+static void deliver(struct attachment_request *req, PGresult *res) {
+    attachment_chunk_fn done = req->done;
+    struct attachment_chunk chunk;
+
+    req->done = NULL;
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        log_error("Failed to read attachment %d: %s", req->attachment_id,
+                  PQresultErrorMessage(res));
+        done(NULL, req->arg);
+    } else if (PQntuples(res) == 0) {
+        log_warn("Attachment %d does not exist", req->attachment_id);
+        done(NULL, req->arg);
+    } else {
+        chunk.filename = PQgetvalue(res, 0, 0);
+        chunk.content_type = PQgetvalue(res, 0, 1);
+        chunk.data = PQgetvalue(res, 0, 2);
+        chunk.len = (size_t)PQgetlength(res, 0, 2);
+        done(&chunk, req->arg);
+    }
+}
+
+static void read_results(struct attachment_reader *reader) {
+    if (!PQconsumeInput(reader->conn)) {
+        fail(reader, "read results");
+        return;
+    }
+
+    while (reader->sent && !PQisBusy(reader->conn)) {
+        struct attachment_request *req = reader->head;
+        PGresult *res = PQgetResult(reader->conn);
+
+        if (!res) {
+            /* The request is complete; send the next one */
+            reader->head = req->next;
+            if (!reader->head) {
+                reader->tail = NULL;
+            }
+            free(req);
+            reader->sent = 0;
+            if (reader->head && send_head(reader) < 0) {
+                fail(reader, "send request");
+                return;
+            }
+            continue;
+        }
+        if (PQstatus(reader->conn) == CONNECTION_BAD) {
+            PQclear(res);
+            fail(reader, "read results");
+            return;
+        }
+        if (req->done) {
+            deliver(req, res);
+        }
+        PQclear(res);
+    }
+}
+
+static void on_socket_ready(struct event_loop *loop, int fd, uint32_t events, void *arg) {
+    struct attachment_reader *reader = arg;
+
+    (void)loop;
+    (void)fd;
+    if ((events & EPOLLOUT) && flush_output(reader) < 0) {
+        fail(reader, "send request");
+        return;
+    }
+    if (reader->conn && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        read_results(reader);
+    }
+}
+
+/**
+ * Connector callback: the connection is up, so the requests queued while
+ * it was opened go out.
+ */
+static int on_connected(PGconn *conn, void *arg) {
+    struct attachment_reader *reader = arg;
+
+    if (PQsetnonblocking(conn, 1) != 0 || ticket_db_prepare(conn) < 0) {
+        return -1;
+    }
+    reader->watcher = event_loop_add_fd(reader->loop, PQsocket(conn), EPOLLIN, on_socket_ready,
+                                        reader);
+    if (!reader->watcher) {
+        return -1;
+    }
+    reader->conn = conn;
+    if (reader->head && send_head(reader) < 0) {
+        fail(reader, "send request");
+    }
+    return 0;
+}
+
+/**
+ * Connector callback: the database cannot be reached for now. Waiting
+ * transfers fail (and are retried later) rather than hold their SMTP
+ * sessions through an outage.
+ */
+static void on_connect_failed(void *arg) {
+    fail_requests(arg);
+}
+
+int attachment_reader_init(struct attachment_reader *reader, struct event_loop *loop,
+                           const char *conninfo) {
+    memset(reader, 0, sizeof(*reader));
+    reader->loop = loop;
+    if (db_connector_init(&reader->connector, loop, conninfo, on_connected, reader) < 0) {
+        return -1;
+    }
+    reader->connector.on_failed = on_connect_failed;
+    return 0;
+}
+
+void attachment_reader_destroy(struct attachment_reader *reader) {
+    while (reader->head) {
+        struct attachment_request *next = reader->head->next;
+
+        free(reader->head);
+        reader->head = next;
+    }
+    reader->tail = NULL;
+    db_connector_destroy(&reader->connector);
+    event_loop_del_fd(reader->loop, reader->watcher);
+    PQfinish(reader->conn);
+    reader->watcher = NULL;
+    reader->conn = NULL;
+}
+
+struct attachment_request *attachment_reader_fetch(struct attachment_reader *reader,
+                                                   int attachment_id, long offset, size_t len,
+                                                   attachment_chunk_fn done, void *arg) {
+    struct attachment_request *req;
+
+    /* While the database is unreachable there is no point in waiting */
+    if (!reader->conn && reader->connector.attempts > 0) {
+        return NULL;
+    }
+    req = calloc(1, sizeof(*req));
+    if (!req) {
+        return NULL;
+    }
+    req->attachment_id = attachment_id;
+    req->offset = offset;
+    req->len = len;
+    req->done = done;
+    req->arg = arg;
+    if (reader->tail) {
+        reader->tail->next = req;
+    } else {
+        reader->head = req;
+    }
+    reader->tail = req;
+
+    /* With a connection up and nothing in flight the queue was empty */
+    if (!reader->conn) {
+        db_connector_start(&reader->connector);
+    } else if (!reader->sent && send_head(reader) < 0) {
+        reader->head = reader->tail = NULL;
+        free(req);
+        fail(reader, "send request");
+        return NULL;
+    }
+    return req;
+}
+
+void attachment_reader_cancel(struct attachment_reader *reader,
+                              struct attachment_request *request) {
+    struct attachment_request **link = &reader->head;
+    struct attachment_request *prev = NULL;
+
+    /* The one in flight stays until its result has been read */
+    if (request == reader->head && reader->sent) {
+        request->done = NULL;
+        return;
+    }
+    while (*link && *link != request) {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = request->next;
+        if (reader->tail == request) {
+            reader->tail = prev;
+        }
+        free(request);
+    }
+}
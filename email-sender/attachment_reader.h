@@ -0,0 +1,89 @@
+/**
+ * attachment_reader.h
+ *
+ * Asynchronous reads of attachment chunks for a sender thread's
+ * transfers. Requests are queued and sent one at a time on a dedicated
+ * connection watched by the thread's event loop, so a transfer waiting
+ * for its next chunk never stalls the others. The connection is only
+ * opened once an attachment is first needed.
+ */
+
+#ifndef ATTACHMENT_READER_H
+#define ATTACHMENT_READER_H
+
+#include <postgresql/libpq-fe.h>
+#include <stddef.h>
+
+#include "db_connect.h"
+#include "event_loop.h"
+
+/* A chunk read, or NULL if the attachment does not exist or could not be
+ * read. Only valid for the duration of the callback. */
+struct attachment_chunk {
+    const char *filename;
+    const char *content_type;
+    const char *data;
+    size_t len;
+};
+
+typedef void (*attachment_chunk_fn)(const struct attachment_chunk *chunk, void *arg);
+
+struct attachment_request;
+
+struct attachment_reader {
+    struct event_loop *loop;
+    PGconn *conn;                       /* NULL until first needed, or while lost */
+    struct db_connector connector;
+    struct io_watcher *watcher;
+    struct attachment_request *head;    /* The first one is in flight once sent */
+    struct attachment_request *tail;
+    int sent;                           /* head has been sent */
+    int want_write;                     /* Output is buffered until the socket is writable */
+};
+
+/**
+ * Sets up an idle reader.
+ *
+ * @param reader   Reader to initialize
+ * @param loop     Event loop driving the connection
+ * @param conninfo libpq connection string (not copied)
+ * @return         0 on success, -1 on failure
+ */
+int attachment_reader_init(struct attachment_reader *reader, struct event_loop *loop,
+                           const char *conninfo);
+
+/**
+ * Closes the connection. Requests still queued are dropped without their
+ * callbacks being run.
+ *
+ * @param reader Reader to destroy
+ */
+void attachment_reader_destroy(struct attachment_reader *reader);
+
+/**
+ * Queues a chunk read. The callback runs from the event loop once the
+ * chunk has arrived, or with NULL if it cannot be read.
+ *
+ * @param reader        Reader to use
+ * @param attachment_id Attachment to read
+ * @param offset        Position of the first byte
+ * @param len           Most bytes to read
+ * @param done          Callback for the result
+ * @param arg           Opaque pointer passed to the callback
+ * @return              Handle for attachment_reader_cancel(), or NULL if the
+ *                      request could not be queued (the callback never runs)
+ */
+struct attachment_request *attachment_reader_fetch(struct attachment_reader *reader,
+                                                   int attachment_id, long offset, size_t len,
+                                                   attachment_chunk_fn done, void *arg);
+
+/**
+ * Withdraws a request whose callback has not run yet; it never will.
+ *
+ * @param reader  Reader the request was queued on
+ * @param request Request to cancel
+ */
+void attachment_reader_cancel(struct attachment_reader *reader,
+                              struct attachment_request *request);
+
+#endif /* ATTACHMENT_READER_H */
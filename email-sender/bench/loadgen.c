@@ -0,0 +1,259 @@
+/**
+ * loadgen.c
+ *
+ * Load generator for benchmarking the email sender end to end. It inserts
+ * tickets into the tickets table at a fixed rate, waits for the senders to
+ * finish them, then reports throughput and the distribution of the time
+ * from insert (created_at) to delivery (sent_at). Every ticket of a run
+ * carries the run's tag in its subject, so runs do not mix and no other
+ * tickets are touched.
+ *
+ * Connects with the same POSTGRES_* variables as the sender and is
+ * configured through the environment:
+ *
+ *     BENCH_RATE=200         Tickets inserted per second
+ *     BENCH_SECONDS=30       How long to keep inserting
+ *     BENCH_BATCH=10         Tickets per INSERT statement
+ *     BENCH_BODY_BYTES=1024  Size of each body
+ *     BENCH_SAME_MESSAGE=0   Give every ticket the same subject and body
+ *                            (lets the sender group recipients)
+ *     BENCH_DRAIN_SECONDS=120  How long to wait for the tickets to finish
+ *     BENCH_EMAIL_DOMAIN=example.com  Recipient domain
+ */
+
+#include <postgresql/libpq-fe.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+int BENCH_RATE;
+int BENCH_SECONDS;
+int BENCH_BATCH;
+int BENCH_BODY_BYTES;
+int BENCH_SAME_MESSAGE;
+int BENCH_DRAIN_SECONDS;
+const char *BENCH_EMAIL_DOMAIN;
+
+static int env_int(const char *name, int fallback) {
+    const char *value = getenv(name);
+    return value && *value ? atoi(value) : fallback;
+}
+
+static const char *env_str(const char *name, const char *fallback) {
+    const char *value = getenv(name);
+    return value && *value ? value : fallback;
+}
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until_usec(uint64_t when) {
+    struct timespec ts = { (time_t)(when / 1000000), (long)(when % 1000000) * 1000 };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+    }
+}
+
+static PGconn *connect_to_db(void) {
+    char conninfo[512];
+    PGconn *conn;
+
+    snprintf(conninfo, sizeof(conninfo), "host=%s port=%s dbname=%s user=%s password=%s",
+             env_str("POSTGRES_HOST", "localhost"), env_str("POSTGRES_PORT", "5432"),
+             env_str("POSTGRES_DB", "ticketdb"), env_str("POSTGRES_USER", "postgres"),
+             env_str("POSTGRES_PASSWORD", ""));
+    conn = PQconnectdb(conninfo);
+    if (PQstatus(conn) != CONNECTION_OK) {
+        fprintf(stderr, "Connection to database failed: %s", PQerrorMessage(conn));
+        PQfinish(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+/**
+ * Runs a query and checks its status, printing the error otherwise.
+ *
+ * @return The result, or NULL on failure
+ */
+static PGresult *run(PGconn *conn, const char *what, const char *sql, int nparams,
+                     const char *const *params) {
+    PGresult *res = PQexecParams(conn, sql, nparams, NULL, params, NULL, NULL, 0);
+    ExecStatusType status = PQresultStatus(res);
+
+    if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Failed to %s: %s", what, PQerrorMessage(conn));
+        PQclear(res);
+        return NULL;
+    }
+    return res;
+}
+
+/**
+ * Inserts one batch as a single multi-row INSERT, like a bulk producer
+ * would, so it costs one statement and one notification.
+ */
+static int insert_batch(PGconn *conn, const char *tag, long first, int count) {
+    char first_s[24], count_s[16], bytes_s[16], same_s[4];
+    const char *params[6] = { tag, first_s, count_s, bytes_s, same_s, BENCH_EMAIL_DOMAIN };
+    PGresult *res;
+
+    snprintf(first_s, sizeof(first_s), "%ld", first);
+    snprintf(count_s, sizeof(count_s), "%d", count);
+    snprintf(bytes_s, sizeof(bytes_s), "%d", BENCH_BODY_BYTES);
+    snprintf(same_s, sizeof(same_s), "%d", BENCH_SAME_MESSAGE ? 1 : 0);
+    res = run(conn, "insert tickets",
+              "INSERT INTO tickets (email, subject, body) "
+              "SELECT 'bench' || n || '@' || $6, "
+              "       $1 || CASE WHEN $5::int = 1 THEN '' ELSE ' #' || n END, "
+              "       rpad('Benchmark ticket ' || CASE WHEN $5::int = 1 THEN $1 ELSE n::text END "
+              "            || ' ', $4::int, 'x') "
+              "FROM generate_series($2::bigint, $2::bigint + $3::int - 1) AS n",
+              6, params);
+    if (!res) {
+        return -1;
+    }
+    PQclear(res);
+    return 0;
+}
+
+/**
+ * Counts the run's tickets that are not finished yet.
+ *
+ * @return Number of 'received' or 'processing' tickets, or -1 on failure
+ */
+static long count_unfinished(PGconn *conn, const char *pattern) {
+    const char *params[1] = { pattern };
+    PGresult *res = run(conn, "count unfinished tickets",
+                        "SELECT count(*) FROM tickets "
+                        "WHERE subject LIKE $1 AND status IN ('received', 'processing')",
+                        1, params);
+    long n;
+
+    if (!res) {
+        return -1;
+    }
+    n = atol(PQgetvalue(res, 0, 0));
+    PQclear(res);
+    return n;
+}
+
+/**
+ * Prints throughput and the insert-to-sent latency percentiles of the run.
+ */
+static int report(PGconn *conn, const char *pattern, long inserted, double insert_seconds) {
+    const char *params[1] = { pattern };
+    PGresult *res = run(conn, "compute the report",
+                        "SELECT count(*) FILTER (WHERE status = 'completed'), "
+                        "       count(*) FILTER (WHERE status = 'failed'), "
+                        "       count(*) FILTER (WHERE status IN ('received', 'processing')), "
+                        "       extract(epoch FROM max(sent_at) - min(created_at)), "
+                        "       percentile_cont(ARRAY[0.5, 0.99, 0.999]) WITHIN GROUP "
+                        "           (ORDER BY extract(epoch FROM sent_at - created_at)) "
+                        "           FILTER (WHERE status = 'completed'), "
+                        "       max(extract(epoch FROM sent_at - created_at)) "
+                        "FROM tickets WHERE subject LIKE $1",
+                        1, params);
+    double span, p50 = 0, p99 = 0, p999 = 0;
+    long completed;
+
+    if (!res) {
+        return -1;
+    }
+    completed = atol(PQgetvalue(res, 0, 0));
+    span = atof(PQgetvalue(res, 0, 3));
+    if (!PQgetisnull(res, 0, 4)) {
+        sscanf(PQgetvalue(res, 0, 4), "{%lf,%lf,%lf}", &p50, &p99, &p999);
+    }
+
+    printf("\n");
+    printf("Inserted:    %ld tickets in %.1fs (%.1f/s offered)\n", inserted, insert_seconds,
+           insert_seconds > 0 ? inserted / insert_seconds : 0.0);
+    printf("Completed:   %ld\n", completed);
+    printf("Failed:      %s\n", PQgetvalue(res, 0, 1));
+    printf("Unfinished:  %s\n", PQgetvalue(res, 0, 2));
+    printf("Throughput:  %.1f tickets/s (first insert to last delivery, %.1fs)\n",
+           span > 0 ? completed / span : 0.0, span);
+    printf("Latency:     p50 %.1fms  p99 %.1fms  p999 %.1fms  max %.1fms\n",
+           p50 * 1000, p99 * 1000, p999 * 1000, atof(PQgetvalue(res, 0, 5)) * 1000);
+    PQclear(res);
+    return 0;
+}
+
+int main(void) {
+    char tag[64], pattern[72];
+    uint64_t start, next;
+    long inserted = 0;
+    long total;
+    double insert_seconds;
+    PGconn *conn;
+
+    BENCH_RATE = env_int("BENCH_RATE", 200);
+    BENCH_SECONDS = env_int("BENCH_SECONDS", 30);
+    BENCH_BATCH = env_int("BENCH_BATCH", 10);
+    BENCH_BODY_BYTES = env_int("BENCH_BODY_BYTES", 1024);
+    BENCH_SAME_MESSAGE = env_int("BENCH_SAME_MESSAGE", 0);
+    BENCH_DRAIN_SECONDS = env_int("BENCH_DRAIN_SECONDS", 120);
+    BENCH_EMAIL_DOMAIN = env_str("BENCH_EMAIL_DOMAIN", "example.com");
+    if (BENCH_RATE <= 0 || BENCH_SECONDS <= 0 || BENCH_BATCH <= 0 || BENCH_BODY_BYTES <= 0) {
+        fprintf(stderr, "BENCH_RATE, BENCH_SECONDS, BENCH_BATCH and BENCH_BODY_BYTES must be positive\n");
+        return 1;
+    }
+
+    conn = connect_to_db();
+    if (!conn) {
+        return 1;
+    }
+
+    snprintf(tag, sizeof(tag), "bench-%ld-%d", (long)time(NULL), (int)getpid());
+    snprintf(pattern, sizeof(pattern), "%s%%", tag);
+    total = (long)BENCH_RATE * BENCH_SECONDS;
+    printf("Run %s: %ld tickets at %d/s in batches of %d, %d-byte bodies%s\n", tag, total,
+           BENCH_RATE, BENCH_BATCH, BENCH_BODY_BYTES,
+           BENCH_SAME_MESSAGE ? ", one shared message" : "");
+
+    /* Batches go out on a fixed schedule; a slow insert eats into the
+     * next gap rather than shifting every later batch */
+    start = now_usec();
+    next = start;
+    while (inserted < total) {
+        int count = total - inserted < BENCH_BATCH ? (int)(total - inserted) : BENCH_BATCH;
+
+        sleep_until_usec(next);
+        if (insert_batch(conn, tag, inserted + 1, count) < 0) {
+            PQfinish(conn);
+            return 1;
+        }
+        inserted += count;
+        next = start + (uint64_t)(inserted * 1000000.0 / BENCH_RATE);
+    }
+    insert_seconds = (now_usec() - start) / 1e6;
+
+    /* Wait for the senders to finish (or give up on) every ticket */
+    for (int waited = 0; waited < BENCH_DRAIN_SECONDS * 2; waited++) {
+        long left = count_unfinished(conn, pattern);
+
+        if (left <= 0) {
+            break;
+        }
+        if (waited % 10 == 0) {
+            printf("Waiting for %ld ticket(s)...\n", left);
+            fflush(stdout);
+        }
+        usleep(500000);
+    }
+
+    if (report(conn, pattern, inserted, insert_seconds) < 0) {
+        PQfinish(conn);
+        return 1;
+    }
+    PQfinish(conn);
+    return 0;
+}
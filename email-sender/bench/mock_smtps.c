@@ -0,0 +1,320 @@
+/**
+ * mock_smtps.c
+ *
+ * Local SMTPS sink for benchmarking the email sender without touching a
+ * real relay. It accepts any AUTH, discards every message and answers the
+ * end of DATA after a configurable delay, optionally failing a share of
+ * messages with a temporary (451) or permanent (554) error so retries and
+ * failures can be exercised too. Each connection gets its own thread,
+ * which is plenty for the few dozen pooled sessions a sender opens.
+ *
+ * Configured through the environment:
+ *
+ *     MOCK_PORT=2465            Port to listen on (127.0.0.1)
+ *     MOCK_CERT=bench/cert.pem  Certificate chain (PEM)
+ *     MOCK_KEY=bench/key.pem    Private key (PEM)
+ *     MOCK_LATENCY_MS=50        Delay before accepting each message
+ *     MOCK_JITTER_MS=0          Extra random delay, 0 to this many ms
+ *     MOCK_TEMPFAIL_PERCENT=0   Messages answered 451
+ *     MOCK_PERMFAIL_PERCENT=0   Messages answered 554
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LINE_MAX_BYTES 4096       /* Longest command or body line kept */
+
+int MOCK_PORT;
+const char *MOCK_CERT;
+const char *MOCK_KEY;
+int MOCK_LATENCY_MS;
+int MOCK_JITTER_MS;
+int MOCK_TEMPFAIL_PERCENT;
+int MOCK_PERMFAIL_PERCENT;
+
+static SSL_CTX *ssl_ctx;
+static atomic_long accepted;
+static atomic_long tempfailed;
+static atomic_long permfailed;
+static atomic_int sessions;
+
+struct connection {
+    SSL *ssl;
+    char buf[LINE_MAX_BYTES];
+    int len;                      /* Bytes in buf */
+    int pos;                      /* Next unread byte in buf */
+};
+
+static int env_int(const char *name, int fallback) {
+    const char *value = getenv(name);
+    return value && *value ? atoi(value) : fallback;
+}
+
+static const char *env_str(const char *name, const char *fallback) {
+    const char *value = getenv(name);
+    return value && *value ? value : fallback;
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+    while (ms > 0 && nanosleep(&ts, &ts) < 0) {
+    }
+}
+
+/**
+ * xorshift64*, seeded per connection; rand_r() gives poorly spread first
+ * values for nearby seeds.
+ */
+static unsigned int next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (unsigned int)((*state * 2685821657736338717ULL) >> 32);
+}
+
+static int reply(struct connection *c, const char *text) {
+    int n = (int)strlen(text);
+    return SSL_write(c->ssl, text, n) == n ? 0 : -1;
+}
+
+/**
+ * Reads one CRLF-terminated line (without the CRLF) into line. Longer
+ * lines are truncated, which is fine for a sink.
+ *
+ * @return Line length, or -1 once the connection is closed
+ */
+static int read_line(struct connection *c, char *line, int size) {
+    int n = 0;
+
+    for (;;) {
+        if (c->pos == c->len) {
+            c->len = SSL_read(c->ssl, c->buf, sizeof(c->buf));
+            c->pos = 0;
+            if (c->len <= 0) {
+                c->len = 0;
+                return -1;
+            }
+        }
+        char ch = c->buf[c->pos++];
+        if (ch == '\n') {
+            if (n > 0 && line[n - 1] == '\r') {
+                n--;
+            }
+            line[n] = '\0';
+            return n;
+        }
+        if (n < size - 1) {
+            line[n++] = ch;
+        }
+    }
+}
+
+/**
+ * Swallows a message body up to the lone "." and answers it.
+ */
+static int receive_data(struct connection *c, uint64_t *seed) {
+    char line[LINE_MAX_BYTES];
+    int roll;
+
+    if (reply(c, "354 End data with <CR><LF>.<CR><LF>\r\n") < 0) {
+        return -1;
+    }
+    for (;;) {
+        if (read_line(c, line, sizeof(line)) < 0) {
+            return -1;
+        }
+        if (strcmp(line, ".") == 0) {
+            break;
+        }
+    }
+
+    sleep_ms(MOCK_LATENCY_MS + (MOCK_JITTER_MS > 0 ? next_random(seed) % (MOCK_JITTER_MS + 1) : 0));
+    roll = next_random(seed) % 100;
+    if (roll < MOCK_TEMPFAIL_PERCENT) {
+        atomic_fetch_add(&tempfailed, 1);
+        return reply(c, "451 4.3.0 Mock temporary failure\r\n");
+    }
+    if (roll < MOCK_TEMPFAIL_PERCENT + MOCK_PERMFAIL_PERCENT) {
+        atomic_fetch_add(&permfailed, 1);
+        return reply(c, "554 5.6.0 Mock permanent failure\r\n");
+    }
+    atomic_fetch_add(&accepted, 1);
+    return reply(c, "250 2.0.0 OK queued\r\n");
+}
+
+/**
+ * Speaks just enough ESMTP for libcurl: EHLO with AUTH, AUTH PLAIN/LOGIN
+ * (any credentials), MAIL, RCPT, DATA, RSET, NOOP and QUIT.
+ */
+static void serve(struct connection *c) {
+    char line[LINE_MAX_BYTES];
+    static atomic_ulong connections;
+    uint64_t seed = ((uint64_t)time(NULL) << 32) ^
+                    (atomic_fetch_add(&connections, 1) + 1) * 0x9E3779B97F4A7C15ULL;
+
+    if (reply(c, "220 mock-smtps ESMTP ready\r\n") < 0) {
+        return;
+    }
+    while (read_line(c, line, sizeof(line)) >= 0) {
+        int r;
+
+        if (strncasecmp(line, "EHLO", 4) == 0 || strncasecmp(line, "HELO", 4) == 0) {
+            r = reply(c, "250-mock-smtps\r\n250-AUTH PLAIN LOGIN\r\n250 8BITMIME\r\n");
+        } else if (strncasecmp(line, "AUTH LOGIN", 10) == 0) {
+            /* Username and password prompts, whatever the answers are */
+            r = reply(c, "334 VXNlcm5hbWU6\r\n");
+            if (r == 0 && read_line(c, line, sizeof(line)) >= 0) {
+                r = reply(c, "334 UGFzc3dvcmQ6\r\n");
+            }
+            if (r == 0 && read_line(c, line, sizeof(line)) >= 0) {
+                r = reply(c, "235 2.7.0 Authentication successful\r\n");
+            }
+        } else if (strncasecmp(line, "AUTH PLAIN", 10) == 0) {
+            /* The credentials come inline or after an empty challenge */
+            r = 0;
+            if (strlen(line) <= 11) {
+                r = reply(c, "334 \r\n");
+                if (r == 0 && read_line(c, line, sizeof(line)) < 0) {
+                    r = -1;
+                }
+            }
+            if (r == 0) {
+                r = reply(c, "235 2.7.0 Authentication successful\r\n");
+            }
+        } else if (strncasecmp(line, "DATA", 4) == 0) {
+            r = receive_data(c, &seed);
+        } else if (strncasecmp(line, "QUIT", 4) == 0) {
+            reply(c, "221 2.0.0 Bye\r\n");
+            return;
+        } else if (strncasecmp(line, "MAIL", 4) == 0 || strncasecmp(line, "RCPT", 4) == 0 ||
+                   strncasecmp(line, "RSET", 4) == 0 || strncasecmp(line, "NOOP", 4) == 0) {
+            r = reply(c, "250 2.0.0 OK\r\n");
+        } else {
+            r = reply(c, "502 5.5.2 Command not implemented\r\n");
+        }
+        if (r < 0) {
+            return;
+        }
+    }
+}
+
+static void *connection_main(void *arg) {
+    struct connection *c = arg;
+    int fd = SSL_get_fd(c->ssl);
+
+    atomic_fetch_add(&sessions, 1);
+    if (SSL_accept(c->ssl) == 1) {
+        serve(c);
+        SSL_shutdown(c->ssl);
+    }
+    atomic_fetch_sub(&sessions, 1);
+    SSL_free(c->ssl);
+    close(fd);
+    free(c);
+    return NULL;
+}
+
+/**
+ * Prints the running totals once a second while anything changes.
+ */
+static void *report_main(void *arg) {
+    long last = -1;
+
+    (void)arg;
+    for (;;) {
+        long a = atomic_load(&accepted);
+        long t = atomic_load(&tempfailed);
+        long p = atomic_load(&permfailed);
+
+        if (a + t + p != last) {
+            printf("mock-smtps: %ld accepted, %ld temp failed, %ld perm failed, %d session(s)\n",
+                   a, t, p, atomic_load(&sessions));
+            fflush(stdout);
+            last = a + t + p;
+        }
+        sleep(1);
+    }
+    return NULL;
+}
+
+int main(void) {
+    struct sockaddr_in addr;
+    pthread_attr_t attr;
+    pthread_t reporter;
+    int one = 1;
+    int listen_fd;
+
+    MOCK_PORT = env_int("MOCK_PORT", 2465);
+    MOCK_CERT = env_str("MOCK_CERT", "bench/cert.pem");
+    MOCK_KEY = env_str("MOCK_KEY", "bench/key.pem");
+    MOCK_LATENCY_MS = env_int("MOCK_LATENCY_MS", 50);
+    MOCK_JITTER_MS = env_int("MOCK_JITTER_MS", 0);
+    MOCK_TEMPFAIL_PERCENT = env_int("MOCK_TEMPFAIL_PERCENT", 0);
+    MOCK_PERMFAIL_PERCENT = env_int("MOCK_PERMFAIL_PERCENT", 0);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    ssl_ctx = SSL_CTX_new(TLS_server_method());
+    if (!ssl_ctx || SSL_CTX_use_certificate_chain_file(ssl_ctx, MOCK_CERT) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ssl_ctx, MOCK_KEY, SSL_FILETYPE_PEM) != 1) {
+        fprintf(stderr, "Failed to load %s / %s:\n", MOCK_CERT, MOCK_KEY);
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(MOCK_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 128) < 0) {
+        perror("mock-smtps: listen");
+        return 1;
+    }
+    printf("mock-smtps: listening on 127.0.0.1:%d (latency %d+%dms, %d%% 451, %d%% 554)\n",
+           MOCK_PORT, MOCK_LATENCY_MS, MOCK_JITTER_MS, MOCK_TEMPFAIL_PERCENT,
+           MOCK_PERMFAIL_PERCENT);
+    fflush(stdout);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&reporter, &attr, report_main, NULL);
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        struct connection *c;
+        pthread_t thread;
+
+        if (fd < 0) {
+            continue;
+        }
+        c = calloc(1, sizeof(*c));
+        if (!c || !(c->ssl = SSL_new(ssl_ctx))) {
+            free(c);
+            close(fd);
+            continue;
+        }
+        SSL_set_fd(c->ssl, fd);
+        if (pthread_create(&thread, &attr, connection_main, c) != 0) {
+            SSL_free(c->ssl);
+            close(fd);
+            free(c);
+        }
+    }
+}
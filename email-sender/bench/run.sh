@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# End-to-end benchmark: starts the mock SMTPS server and an email sender
+# pointed at it, drives load with loadgen, then stops both. Needs the
+# database from docker-compose (or any with the schema in postgres/init-db)
+# reachable through the POSTGRES_* variables; everything else has defaults
+# and can be overridden from the environment (see loadgen.c, mock_smtps.c
+# and the sender's own tuning variables).
+#
+# Usage: make bench   (or bench/run.sh from email-sender/)
+
+set -e
+cd "$(dirname "$0")/.."
+
+: "${POSTGRES_HOST:=localhost}"
+: "${POSTGRES_PORT:=5432}"
+: "${POSTGRES_DB:=ticketdb}"
+: "${MOCK_PORT:=2465}"
+: "${METRICS_PORT:=0}"
+export POSTGRES_HOST POSTGRES_PORT POSTGRES_DB MOCK_PORT METRICS_PORT
+
+mock_pid=
+sender_pid=
+cleanup() {
+    [ -n "$sender_pid" ] && kill -TERM "$sender_pid" 2>/dev/null && wait "$sender_pid" || true
+    [ -n "$mock_pid" ] && kill "$mock_pid" 2>/dev/null && wait "$mock_pid" || true
+}
+trap cleanup EXIT INT TERM
+
+bench/mock_smtps > bench/mock_smtps.log 2>&1 &
+mock_pid=$!
+
+# The sender talks to the mock as its only relay, trusting its certificate
+SMTPS_SERVER=localhost SMTPS_PORT="$MOCK_PORT" SMTP_RELAYS_FILE= \
+GMAIL_EMAIL=bench@localhost GMAIL_APP_PASSWORD=bench SENDER_NAME=Benchmark \
+SMTP_CA_FILE=bench/cert.pem WORKER_ID="${WORKER_ID:-bench-$$}" RETENTION_DAYS=0 \
+    ./email-sender > bench/email-sender.log 2>&1 &
+sender_pid=$!
+sleep 1
+if ! kill -0 "$sender_pid" 2>/dev/null; then
+    echo "email-sender failed to start, see bench/email-sender.log" >&2
+    exit 1
+fi
+
+bench/loadgen
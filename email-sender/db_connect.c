@@ -0,0 +1,147 @@
+/**
+ * db_connect.c
+ *
+ * Non-blocking database connector declared in db_connect.h.
+ */
+
+#include "db_connect.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "logger.h"
+#include "metrics.h"
+#include "retry_queue.h"
+
+#define RECONNECT_BASE_MS 500     /* Delay before the first reconnection attempt */
+#define RECONNECT_MAX_MS 30000    /* Upper bound on the reconnection backoff */
+
+static void on_socket_ready(struct event_loop *loop, int fd, uint32_t events, void *arg);
+
+static void schedule_attempt(struct db_connector *connector) {
+    long delay_ms = retry_backoff_ms(connector->attempts + 1, RECONNECT_BASE_MS,
+                                     RECONNECT_MAX_MS);
+
+    if (event_loop_timer_arm(connector->retry_timer, delay_ms, 0) == 0) {
+        connector->scheduled = 1;
+    } else {
+        log_error("Failed to schedule database reconnection");
+    }
+}
+
+static void attempt_failed(struct db_connector *connector) {
+    log_warn("Database connection attempt %d failed: %s", connector->attempts + 1,
+            connector->conn ? PQerrorMessage(connector->conn) : "out of memory\n");
+    PQfinish(connector->conn);
+    connector->conn = NULL;
+    connector->attempts++;
+    schedule_attempt(connector);
+    if (connector->on_failed) {
+        connector->on_failed(connector->arg);
+    }
+}
+
+/**
+ * Waits for the socket state PQconnectPoll() asked for. libpq may switch
+ * to a new socket between polls (another address, SSL fallback), so the
+ * watcher is re-registered every time.
+ */
+static int watch(struct db_connector *connector, PostgresPollingStatusType status) {
+    uint32_t events = status == PGRES_POLLING_READING ? EPOLLIN : EPOLLOUT;
+
+    connector->watcher = event_loop_add_fd(connector->loop, PQsocket(connector->conn), events,
+                                           on_socket_ready, connector);
+    return connector->watcher ? 0 : -1;
+}
+
+static void advance(struct db_connector *connector, PostgresPollingStatusType status) {
+    PGconn *conn;
+
+    if (status == PGRES_POLLING_READING || status == PGRES_POLLING_WRITING) {
+        if (watch(connector, status) < 0) {
+            attempt_failed(connector);
+        }
+        return;
+    }
+    if (status != PGRES_POLLING_OK) {
+        attempt_failed(connector);
+        return;
+    }
+
+    /* Hand it over; the callback's setup (LISTEN, prepare) may also fail */
+    conn = connector->conn;
+    connector->conn = NULL;
+    if (connector->on_connected(conn, connector->arg) < 0) {
+        log_warn("Failed to set up database connection, retrying");
+        PQfinish(conn);
+        connector->attempts++;
+        schedule_attempt(connector);
+        if (connector->on_failed) {
+            connector->on_failed(connector->arg);
+        }
+        return;
+    }
+    if (connector->attempts > 0) {
+        log_info("Reconnected to database after %d failed attempt(s)", connector->attempts);
+    } else {
+        log_info("Reconnected to database");
+    }
+    metrics_add(METRIC_DB_RECONNECTS, 1);
+    connector->attempts = 0;
+}
+
+static void on_socket_ready(struct event_loop *loop, int fd, uint32_t events, void *arg) {
+    struct db_connector *connector = arg;
+
+    (void)fd;
+    (void)events;
+    event_loop_del_fd(loop, connector->watcher);
+    connector->watcher = NULL;
+    advance(connector, PQconnectPoll(connector->conn));
+}
+
+static void on_retry_timer(struct event_loop *loop, struct loop_timer *timer, void *arg) {
+    struct db_connector *connector = arg;
+
+    (void)loop;
+    (void)timer;
+    connector->scheduled = 0;
+    connector->conn = PQconnectStart(connector->conninfo);
+    if (!connector->conn || PQstatus(connector->conn) == CONNECTION_BAD) {
+        attempt_failed(connector);
+        return;
+    }
+    /* A new attempt starts by waiting for the socket to be writable */
+    advance(connector, PGRES_POLLING_WRITING);
+}
+
+int db_connector_init(struct db_connector *connector, struct event_loop *loop,
+                      const char *conninfo, db_connected_fn on_connected, void *arg) {
+    memset(connector, 0, sizeof(*connector));
+    connector->loop = loop;
+    connector->conninfo = conninfo;
+    connector->on_connected = on_connected;
+    connector->arg = arg;
+    connector->retry_timer = event_loop_timer_new(loop, on_retry_timer, connector);
+    return connector->retry_timer ? 0 : -1;
+}
+
+void db_connector_destroy(struct db_connector *connector) {
+    event_loop_del_fd(connector->loop, connector->watcher);
+    PQfinish(connector->conn);
+    event_loop_timer_free(connector->loop, connector->retry_timer);
+    connector->watcher = NULL;
+    connector->conn = NULL;
+    connector->retry_timer = NULL;
+}
+
+void db_connector_start(struct db_connector *connector) {
+    if (db_connector_active(connector)) {
+        return;
+    }
+    schedule_attempt(connector);
+}
+
+int db_connector_active(const struct db_connector *connector) {
+    return connector->conn != NULL || connector->scheduled;
+}
@@ -0,0 +1,72 @@
+/**
+ * db_connect.h
+ *
+ * Non-blocking (re)connection to PostgreSQL on an event loop. A connector
+ * drives PQconnectStart()/PQconnectPoll() from socket readiness, so the
+ * loop keeps running other work (SMTP transfers, timers) while the
+ * database is unreachable, and retries failed attempts with exponential
+ * backoff until one succeeds.
+ */
+
+#ifndef DB_CONNECT_H
+#define DB_CONNECT_H
+
+#include <postgresql/libpq-fe.h>
+
+#include "event_loop.h"
+
+/* Called with a newly established connection. Returns 0 after taking
+ * ownership of it, or -1 if setting it up failed (the connector closes
+ * it and tries again later). */
+typedef int (*db_connected_fn)(PGconn *conn, void *arg);
+
+struct db_connector {
+    struct event_loop *loop;
+    const char *conninfo;         /* Not copied; must outlive the connector */
+    PGconn *conn;                 /* Attempt in progress, or NULL */
+    struct io_watcher *watcher;   /* On the attempt's socket */
+    struct loop_timer *retry_timer;
+    int scheduled;                /* retry_timer is armed */
+    int attempts;                 /* Failed attempts since the last success */
+    db_connected_fn on_connected;
+    void (*on_failed)(void *arg); /* Called after each failed attempt (optional) */
+    void *arg;
+};
+
+/**
+ * Sets up an idle connector.
+ *
+ * @param connector    Connector to initialize
+ * @param loop         Event loop driving the attempts
+ * @param conninfo     libpq connection string
+ * @param on_connected Callback for each established connection
+ * @param arg          Opaque pointer passed to the callback
+ * @return             0 on success, -1 on failure
+ */
+int db_connector_init(struct db_connector *connector, struct event_loop *loop,
+                      const char *conninfo, db_connected_fn on_connected, void *arg);
+
+/**
+ * Abandons any attempt in progress and frees the connector.
+ *
+ * @param connector Connector to destroy
+ */
+void db_connector_destroy(struct db_connector *connector);
+
+/**
+ * Starts connecting after a backoff delay, unless an attempt is already
+ * under way. Call it when the previous connection is lost.
+ *
+ * @param connector Connector to start
+ */
+void db_connector_start(struct db_connector *connector);
+
+/**
+ * Tells whether the connector is still trying to connect.
+ *
+ * @param connector Connector to check
+ * @return          1 while an attempt is in progress or scheduled, 0 otherwise
+ */
+int db_connector_active(const struct db_connector *connector);
+
+#endif /* DB_CONNECT_H */
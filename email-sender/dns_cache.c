@@ -0,0 +1,303 @@
+/**
+ * dns_cache.c
+ *
+ * Relay host address cache declared in dns_cache.h.
+ */
+
+#include "dns_cache.h"
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <resolv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+/* Addresses found by one lookup, in presentation form (IPv6 in brackets) */
+struct lookup {
+    char addresses[DNS_ADDRESSES_MAX][48];
+    int count;
+    long ttl;                         /* Lowest TTL of the records used (-1 = none) */
+};
+
+static time_t monotonic_sec(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+static void add_address(struct lookup *l, int family, const void *addr) {
+    char text[INET6_ADDRSTRLEN];
+
+    if (l->count == DNS_ADDRESSES_MAX || !inet_ntop(family, addr, text, sizeof(text))) {
+        return;
+    }
+    snprintf(l->addresses[l->count], sizeof(l->addresses[0]),
+             family == AF_INET6 ? "[%s]" : "%s", text);
+    for (int i = 0; i < l->count; i++) {
+        if (strcmp(l->addresses[i], l->addresses[l->count]) == 0) {
+            return;
+        }
+    }
+    l->count++;
+}
+
+/**
+ * Asks the name servers for one record type, noting the TTL of every
+ * answer record (CNAMEs included) so the result is not kept longer than
+ * any link of the chain.
+ */
+static void query(res_state res, const char *host, int type, struct lookup *l) {
+    unsigned char answer[4096];
+    int family = type == ns_t_a ? AF_INET : AF_INET6;
+    int size = type == ns_t_a ? 4 : 16;
+    ns_msg msg;
+    int len = res_nquery(res, host, ns_c_in, type, answer, sizeof(answer));
+
+    if (len < 0 || ns_initparse(answer, len, &msg) < 0) {
+        return;
+    }
+    for (int i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+        ns_rr rr;
+
+        if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) {
+            break;
+        }
+        if (l->ttl < 0 || (long)ns_rr_ttl(rr) < l->ttl) {
+            l->ttl = (long)ns_rr_ttl(rr);
+        }
+        if (ns_rr_type(rr) == type && ns_rr_rdlen(rr) == size) {
+            add_address(l, family, ns_rr_rdata(rr));
+        }
+    }
+}
+
+/**
+ * Falls back on the system resolver, which also knows /etc/hosts, for
+ * names the DNS has no answer for (e.g. localhost). It reports no TTL.
+ */
+static void query_system(const char *host, struct lookup *l) {
+    struct addrinfo hints = { 0 };
+    struct addrinfo *list;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &list) != 0) {
+        return;
+    }
+    for (struct addrinfo *ai = list; ai; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET) {
+            add_address(l, AF_INET, &((struct sockaddr_in *)ai->ai_addr)->sin_addr);
+        } else if (ai->ai_family == AF_INET6) {
+            add_address(l, AF_INET6, &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr);
+        }
+    }
+    freeaddrinfo(list);
+}
+
+static int compare_addresses(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+/**
+ * Resolves a host into a comma-separated address list. The addresses are
+ * sorted, so answers that only rotate their order leave the list as it
+ * was.
+ *
+ * @return Number of addresses found
+ */
+static int resolve(const char *host, char *out, size_t size, long *ttl) {
+    struct __res_state res;
+    struct lookup l = { .count = 0, .ttl = -1 };
+    size_t len = 0;
+
+    memset(&res, 0, sizeof(res));
+    if (res_ninit(&res) == 0) {
+        query(&res, host, ns_t_a, &l);
+        query(&res, host, ns_t_aaaa, &l);
+        res_nclose(&res);
+    }
+    if (l.count == 0) {
+        l.ttl = -1;
+        query_system(host, &l);
+    }
+
+    qsort(l.addresses, (size_t)l.count, sizeof(l.addresses[0]), compare_addresses);
+    out[0] = '\0';
+    for (int i = 0; i < l.count; i++) {
+        len += (size_t)snprintf(out + len, size - len, "%s%s", i ? "," : "", l.addresses[i]);
+    }
+    *ttl = l.ttl;
+    return l.count;
+}
+
+/**
+ * Looks up the entry that is due, outside the lock, and stores the result.
+ * Called and returns with the lock held.
+ */
+static void refresh(struct dns_cache *cache, struct dns_entry *entry) {
+    char addresses[sizeof(entry->addresses)];
+    long ttl = 0;
+    int found;
+
+    pthread_mutex_unlock(&cache->lock);
+    found = resolve(entry->host, addresses, sizeof(addresses), &ttl);
+    metrics_add(METRIC_DNS_LOOKUPS, 1);
+    pthread_mutex_lock(&cache->lock);
+
+    if (found == 0) {
+        log_warn("Failed to resolve %s%s, trying again in %ds", entry->host,
+                 entry->addresses[0] ? " (keeping the last addresses)" : "", cache->min_ttl);
+        entry->refresh_at = monotonic_sec() + cache->min_ttl;
+        return;
+    }
+    if (ttl < cache->min_ttl) {
+        ttl = cache->min_ttl;
+    } else if (ttl > cache->max_ttl) {
+        ttl = cache->max_ttl;
+    }
+    if (strcmp(addresses, entry->addresses) != 0) {
+        log_info("Resolved %s to %s (for %lds)", entry->host, addresses, ttl);
+        memcpy(entry->addresses, addresses, sizeof(addresses));
+        atomic_fetch_add(&entry->generation, 1);
+    }
+    entry->refresh_at = monotonic_sec() + ttl;
+}
+
+/**
+ * Resolver thread: looks up each entry when it falls due and sleeps until
+ * the next one does, or a host is added.
+ */
+static void *resolver_main(void *arg) {
+    struct dns_cache *cache = arg;
+
+    pthread_mutex_lock(&cache->lock);
+    while (!cache->stopping) {
+        struct dns_entry *due = NULL;
+        time_t now = monotonic_sec();
+        time_t next = 0;
+
+        for (struct dns_entry *e = cache->entries; e && !due; e = e->next) {
+            if (e->refresh_at <= now) {
+                due = e;
+            } else if (next == 0 || e->refresh_at < next) {
+                next = e->refresh_at;
+            }
+        }
+        if (due) {
+            refresh(cache, due);
+        } else if (next) {
+            struct timespec until = { .tv_sec = next, .tv_nsec = 0 };
+
+            pthread_cond_timedwait(&cache->wake, &cache->lock, &until);
+        } else {
+            pthread_cond_wait(&cache->wake, &cache->lock);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+int dns_cache_init(struct dns_cache *cache, int min_ttl, int max_ttl) {
+    pthread_condattr_t attr;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->min_ttl = min_ttl;
+    cache->max_ttl = max_ttl > min_ttl ? max_ttl : min_ttl;
+
+    /* Waits are timed against the monotonic clock, like the refreshes */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+        pthread_condattr_destroy(&attr);
+        return -1;
+    }
+    if (pthread_cond_init(&cache->wake, &attr) != 0) {
+        pthread_condattr_destroy(&attr);
+        pthread_mutex_destroy(&cache->lock);
+        return -1;
+    }
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&cache->thread, NULL, resolver_main, cache) != 0) {
+        log_error("Failed to start DNS resolver thread");
+        pthread_cond_destroy(&cache->wake);
+        pthread_mutex_destroy(&cache->lock);
+        return -1;
+    }
+    cache->started = 1;
+    return 0;
+}
+
+void dns_cache_destroy(struct dns_cache *cache) {
+    if (!cache->started) {
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    cache->stopping = 1;
+    pthread_cond_signal(&cache->wake);
+    pthread_mutex_unlock(&cache->lock);
+    pthread_join(cache->thread, NULL);
+
+    while (cache->entries) {
+        struct dns_entry *next = cache->entries->next;
+
+        free(cache->entries->host);
+        free(cache->entries);
+        cache->entries = next;
+    }
+    pthread_cond_destroy(&cache->wake);
+    pthread_mutex_destroy(&cache->lock);
+    cache->started = 0;
+}
+
+struct dns_entry *dns_cache_add(struct dns_cache *cache, const char *host) {
+    unsigned char addr[sizeof(struct in6_addr)];
+    struct dns_entry *entry;
+
+    if (inet_pton(AF_INET, host, addr) == 1 || inet_pton(AF_INET6, host, addr) == 1) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    for (entry = cache->entries; entry; entry = entry->next) {
+        if (strcmp(entry->host, host) == 0) {
+            break;
+        }
+    }
+    if (!entry && (entry = calloc(1, sizeof(*entry))) != NULL) {
+        entry->host = strdup(host);
+        if (!entry->host) {
+            free(entry);
+            entry = NULL;
+        } else {
+            /* Due at once */
+            entry->next = cache->entries;
+            cache->entries = entry;
+            pthread_cond_signal(&cache->wake);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+}
+
+unsigned long dns_entry_format(struct dns_cache *cache, struct dns_entry *entry,
+                               const char *port, char *out, size_t size) {
+    unsigned long generation;
+
+    pthread_mutex_lock(&cache->lock);
+    generation = atomic_load(&entry->generation);
+    if (entry->addresses[0]) {
+        snprintf(out, size, "%s:%s:%s", entry->host, port, entry->addresses);
+    } else {
+        out[0] = '\0';
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return generation;
+}
@@ -0,0 +1,84 @@
+/**
+ * dns_cache.h
+ *
+ * Process-wide cache of the addresses of the SMTP relay hosts. A
+ * background thread resolves each registered host, keeps its A and AAAA
+ * records for as long as their TTL allows and refreshes them before use
+ * (keeping the old addresses if a refresh fails). Sessions hand the
+ * cached addresses to curl through CURLOPT_RESOLVE, so opening a
+ * connection never waits on a resolver.
+ */
+
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+#define DNS_ADDRESSES_MAX 8           /* Addresses kept per host */
+
+struct dns_entry {
+    char *host;
+    char addresses[DNS_ADDRESSES_MAX * 48]; /* "a,[b]" for CURLOPT_RESOLVE ("" until resolved) */
+    atomic_ulong generation;          /* Bumped whenever addresses changes */
+    time_t refresh_at;                /* Monotonic time of the next lookup */
+    struct dns_entry *next;
+};
+
+struct dns_cache {
+    pthread_mutex_t lock;             /* Guards the list and the addresses */
+    pthread_cond_t wake;              /* A host was added, or stopping */
+    pthread_t thread;
+    struct dns_entry *entries;
+    int min_ttl;                      /* Bounds applied to record TTLs (seconds) */
+    int max_ttl;
+    int stopping;
+    int started;
+};
+
+/**
+ * Sets up an empty cache and starts its resolver thread.
+ *
+ * @param cache   Cache to initialize
+ * @param min_ttl Shortest time addresses are kept, also the delay before
+ *                a failed lookup is retried (seconds)
+ * @param max_ttl Longest time addresses are kept (seconds)
+ * @return        0 on success, -1 on failure
+ */
+int dns_cache_init(struct dns_cache *cache, int min_ttl, int max_ttl);
+
+/**
+ * Stops the resolver thread and frees every entry.
+ *
+ * @param cache Cache to destroy
+ */
+void dns_cache_destroy(struct dns_cache *cache);
+
+/**
+ * Registers a host to keep resolved; registering it again returns the
+ * same entry. The first lookup happens in the background.
+ *
+ * @param cache Cache to add to
+ * @param host  Host name
+ * @return      Entry, valid until the cache is destroyed, or NULL if host
+ *              is an IP address (nothing to resolve) or out of memory
+ */
+struct dns_entry *dns_cache_add(struct dns_cache *cache, const char *host);
+
+/**
+ * Formats an entry as a CURLOPT_RESOLVE line, "host:port:addresses".
+ * Thread-safe.
+ *
+ * @param cache Owning cache
+ * @param entry Entry to format
+ * @param port  Port the line applies to
+ * @param out   Buffer for the line; empty if the host is not resolved yet
+ * @param size  Size of out
+ * @return      The entry's generation the line reflects
+ */
+unsigned long dns_entry_format(struct dns_cache *cache, struct dns_entry *entry,
+                               const char *port, char *out, size_t size);
+
+#endif /* DNS_CACHE_H */
@@ -12,14 +12,43 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/signalfd.h>
 #include <postgresql/libpq-fe.h>  /* PostgreSQL C client library */
 #include <curl/curl.h>            /* libcurl for SMTP communication */
+#include <time.h>
 #include <unistd.h>
-#include <regex.h>
+
+#include "admin_server.h"
+#include "attachment_reader.h"
+#include "db_connect.h"
+#include "dns_cache.h"
+#include "email_validate.h"
+#include "event_loop.h"
+#include "logger.h"
+#include "metrics.h"
+#include "metrics_server.h"
+#include "rate_limit.h"
+#include "retry_queue.h"
+#include "send_engine.h"
+#include "relay.h"
+#include "settings.h"
+#include "smtp_share.h"
+#include "status_writer.h"
+#include "template.h"
+#include "ticket.h"
+#include "ticket_db.h"
+#include "ticket_ring.h"
 
 /* Configuration constants */
-#define MAX_EMAIL_SIZE 8192       /* Maximum size of email payload */
-#define MAX_QUERY_SIZE 4096       /* Maximum size of SQL queries */
+#define MAX_AUTH_FAILURES 5       /* Consecutive send failures before claiming is paused */
+#define CLAIM_PAUSE_BASE_MS 5000  /* First pause after MAX_AUTH_FAILURES */
+#define CLAIM_PAUSE_MAX_MS 900000 /* Pauses double up to 15 minutes */
+#define RETENTION_RUN_INTERVAL_MS 3600000 /* Retention runs start hourly */
+#define QUEUE_DEPTH_INTERVAL_MS 15000 /* How often the queue depth gauge is sampled */
+#define DRAIN_CHECK_MS 50         /* How often a draining thread checks whether it is done */
 
 /* Environment variables for configuration */
 char *DB_HOST;        /* PostgreSQL server hostname */
@@ -27,45 +56,118 @@ char *DB_PORT;        /* PostgreSQL server port */
 char *DB_NAME;        /* PostgreSQL database name */
 char *DB_USER;        /* PostgreSQL username */
 char *DB_PASSWORD;    /* PostgreSQL password */
+char DB_CONNINFO[512]; /* libpq connection string built from the above */
 char *GMAIL_EMAIL;    /* Gmail sender address */
 char *GMAIL_PASSWORD; /* Gmail app password */
 char *SMTPS_SERVER;   /* SMTP server hostname */
 char *SMTPS_PORT;     /* SMTP server port */
+char *SMTP_RELAYS_FILE; /* Relay list used instead of the four above (optional) */
+char *SMTP_CA_FILE;   /* CA bundle used instead of the system one (optional) */
 char *SENDER_NAME;    /* Display name for sender */
+int SWEEP_INTERVAL;   /* Seconds between sweeps for missed tickets (0 disables) */
+int SMTP_POOL_MAX;    /* Sessions allocated per relay per thread, the most SMTP_POOL_SIZE can use */
+int SMTP_NOOP_AFTER;  /* Idle seconds before a session is health checked with NOOP */
+int SMTP_MAX_SENDS;   /* Messages per SMTP connection before it is recycled (0 = unlimited) */
+char WORKER_ID[256];  /* Identity recorded as the owner of claimed tickets */
+int LEASE_SECONDS;    /* How long a claim is valid without being renewed */
+int METRICS_PORT;     /* Port serving Prometheus /metrics (0 disables) */
+char *METRICS_ADDRESS; /* Address the metrics port listens on */
+int SENDER_THREADS;   /* Sender threads, each with its own SMTP sessions and status connection */
+int RETENTION_DAYS;   /* Finished tickets are kept this long (0 disables retention) */
+int RETENTION_ARCHIVE; /* Move expired tickets to tickets_archive rather than delete them */
+int RETENTION_BATCH_SIZE; /* Tickets removed per retention chunk */
+int RETENTION_BATCH_DELAY_MS; /* Pause between chunks, which bounds the retention rate */
+int SHUTDOWN_TIMEOUT_SECONDS; /* Time in-flight sends get to finish after SIGTERM */
+int TEMPLATE_CACHE_SIZE; /* Compiled templates kept in memory */
+int DNS_CACHE;        /* Resolve relay hosts in the background instead of in curl */
+int DNS_MIN_TTL;      /* Bounds on how long resolved addresses are kept (seconds) */
+int DNS_MAX_TTL;
+char *CONFIG_FILE;    /* Settings file read at startup and on SIGHUP (optional) */
+char *ADMIN_SOCKET;   /* Unix socket of the admin interface (empty disables) */
 
-/**
- * Sanitizes a string for safe inclusion in SQL queries.
- *
- * @param conn  Active PostgreSQL connection
- * @param input String that needs to be escaped
- * @return      Escaped string safe for SQL (must be freed by caller)
- */
-char* sanitize_sql_string(PGconn *conn, const char *input) {
-    return PQescapeLiteral(conn, input, strlen(input));
-}
+/* Settings that can change while running (claim batch size, pool size,
+ * rate limits, retries, priority weights, logging) are read through
+ * settings_get() instead */
 
-/**
- * Validates an email address using regex pattern matching.
- *
- * @param email The email address to validate
- * @return      1 if email is valid, 0 if invalid
- */
-int is_valid_email(const char *email) {
-    regex_t regex;
-    int reti;
+#define ALL_LANES ((1 << PRIORITY_LANES) - 1)
+#define LANE_STRIDE_SCALE (1u << 20) /* Stride of a lane of weight 1 */
 
-    /* Compile the regex pattern for email validation */
-    reti = regcomp(&regex, "^[a-zA-Z0-9._%+-]+@[a-zA-Z0-9.-]+\\.[a-zA-Z]{2,}$", REG_EXTENDED);
-    if (reti) {
-        fprintf(stderr, "Could not compile regex\n");
-        return 0;
-    }
+struct sender_context;
+
+/* Stride scheduling state of a claim lane */
+struct claim_lane {
+    uint64_t stride;              /* Pass advance per slot, inversely proportional to the weight */
+    uint64_t pass;                /* The lane gets a slot when its pass is the lowest */
+};
 
-    /* Perform the regex match */
-    reti = regexec(&regex, email, 0, NULL, 0);
-    regfree(&regex);
+/* A sender thread. Everything in it is only touched by that thread once
+ * it runs, so sends never contend on a lock. */
+struct sender_worker {
+    int index;
+    pthread_t thread;
+    struct sender_context *ctx;
+    struct event_loop loop;
+    struct relay_set relays;      /* This thread's own SMTP sessions */
+    struct send_engine engine;    /* Concurrent SMTP delivery */
+    struct status_writer writer;  /* Pipelined status updates (own connection) */
+    struct attachment_reader attachments; /* Attachment chunks (own connection, opened lazily) */
+    struct retry_queue retries;   /* Failed tickets waiting to be sent again */
+    struct loop_notifier *wake;   /* Tickets in the ring, or time to drain or stop */
+    struct loop_timer *drain_timer; /* Checks whether draining has finished */
+    struct settings_reader reader; /* Reports when the thread holds no settings */
+    unsigned long settings_version; /* Version last applied to the sessions and engine */
+};
 
-    return (reti == 0); /* Return 1 if match, 0 if no match */
+/* Per-process state. The claiming thread owns everything but the atomics,
+ * which the sender threads use to report back. */
+struct sender_context {
+    struct event_loop *loop;      /* The claiming thread's loop */
+    PGconn *conn;                 /* Database connection (also used for LISTEN), NULL while lost */
+    struct io_watcher *db_watcher; /* On conn's socket, for notifications */
+    struct db_connector connector; /* Replaces conn after it is lost */
+    struct status_writer *writer; /* Outcomes decided before sending (invalid addresses) */
+    struct ticket_ring ring;      /* Claimed tickets waiting for a sender thread */
+    struct template_cache templates; /* Compiled templates, most recently used first */
+    struct dns_cache dns;         /* Relay host addresses, shared by every sender thread */
+    struct smtp_share share;      /* TLS sessions and curl's DNS cache, likewise */
+    struct sender_worker *workers;
+    int worker_count;
+    struct rate_limiter account_limit; /* Shared by every sender thread */
+    struct rate_limiter domain_limit;
+    struct loop_notifier *kick;   /* Sender threads asking for work or attention */
+    struct loop_timer *resume_timer; /* Ends a pause in claiming */
+    struct loop_timer *retention_timer; /* Next retention chunk or run */
+    struct loop_timer *drain_timer; /* Ends shutdown once drained or at the deadline */
+    uint64_t drain_deadline_usec; /* When a shutdown stops waiting for in-flight sends */
+    int retention_after_id;       /* Where the current retention run has got to (0 = idle) */
+    int pauses;                   /* Consecutive pauses, for their backoff */
+    int claims_paused;            /* Not claiming new tickets until resume_timer fires */
+    int work_pending;             /* Lanes that may have unclaimed tickets (bit per lane) */
+    struct claim_lane lanes[PRIORITY_LANES];
+    uint64_t lane_clock;          /* Pass of the last slot given out */
+    int high_water_id;            /* Highest ticket id claimed so far */
+    int claim_after_id;           /* Claims skip ids up to this one (0 = none) */
+    struct ticket *notified_head; /* Tickets received in notifications, not yet claimed */
+    struct ticket **notified_tail;
+    int notified;
+    atomic_int failures;          /* Consecutive send failures across threads */
+    atomic_int delivered;         /* A send succeeded since the claimer last looked */
+    atomic_int draining;          /* Shutting down: finish what is in flight, start nothing */
+    atomic_int drained;           /* Sender threads that finished draining */
+    atomic_int stopping;          /* Sender threads should exit */
+    atomic_int worker_failed;     /* A sender thread stopped on its own */
+};
+
+/**
+ * Reads an optional integer environment variable.
+ *
+ * @param name          Variable name
+ * @param default_value Value used when the variable is unset or empty
+ * @return              Parsed value
+ */
+int env_int(const char *name, int default_value) {
+    const char *value = getenv(name);
+    return (value && strlen(value) > 0) ? atoi(value) : default_value;
 }
 
 /**
@@ -73,6 +175,8 @@ int is_valid_email(const char *email) {
  * Exits the program if critical variables are missing.
  */
 void load_env_variables() {
+    struct settings settings;
+
     /* Database connection variables */
     DB_HOST = getenv("POSTGRES_HOST");
     DB_PORT = getenv("POSTGRES_PORT");
@@ -85,8 +189,77 @@ void load_env_variables() {
     GMAIL_PASSWORD = getenv("GMAIL_APP_PASSWORD");
     SMTPS_SERVER = getenv("SMTPS_SERVER");
     SMTPS_PORT = getenv("SMTPS_PORT");
+    SMTP_RELAYS_FILE = getenv("SMTP_RELAYS_FILE");
+    if (SMTP_RELAYS_FILE && strlen(SMTP_RELAYS_FILE) == 0) {
+        SMTP_RELAYS_FILE = NULL;
+    }
+    SMTP_CA_FILE = getenv("SMTP_CA_FILE");
+    if (SMTP_CA_FILE && strlen(SMTP_CA_FILE) == 0) {
+        SMTP_CA_FILE = NULL;
+    }
     SENDER_NAME = getenv("SENDER_NAME");
 
+    /* Optional tuning */
+    SWEEP_INTERVAL = env_int("SWEEP_INTERVAL", 60);
+    SMTP_NOOP_AFTER = env_int("SMTP_NOOP_AFTER", 30);
+    SMTP_MAX_SENDS = env_int("SMTP_MAX_SENDS", 100);
+    LEASE_SECONDS = env_int("LEASE_SECONDS", 60);
+    if (LEASE_SECONDS < 3) {
+        LEASE_SECONDS = 3;
+    }
+    METRICS_PORT = env_int("METRICS_PORT", 9100);
+    METRICS_ADDRESS = getenv("METRICS_ADDRESS");
+    if (!METRICS_ADDRESS || strlen(METRICS_ADDRESS) == 0) {
+        METRICS_ADDRESS = "127.0.0.1";
+    }
+    SENDER_THREADS = env_int("SENDER_THREADS", 1);
+    RETENTION_DAYS = env_int("RETENTION_DAYS", 30);
+    RETENTION_ARCHIVE = env_int("RETENTION_ARCHIVE", 1);
+    RETENTION_BATCH_SIZE = env_int("RETENTION_BATCH_SIZE", 1000);
+    RETENTION_BATCH_DELAY_MS = env_int("RETENTION_BATCH_DELAY_MS", 1000);
+    SHUTDOWN_TIMEOUT_SECONDS = env_int("SHUTDOWN_TIMEOUT_SECONDS", 20);
+    TEMPLATE_CACHE_SIZE = env_int("TEMPLATE_CACHE_SIZE", 256);
+    DNS_CACHE = env_int("DNS_CACHE", 1);
+    DNS_MIN_TTL = env_int("DNS_MIN_TTL", 30);
+    DNS_MAX_TTL = env_int("DNS_MAX_TTL", 3600);
+    CONFIG_FILE = getenv("CONFIG_FILE");
+    ADMIN_SOCKET = getenv("ADMIN_SOCKET");
+    if (CONFIG_FILE && strlen(CONFIG_FILE) == 0) {
+        CONFIG_FILE = NULL;
+    }
+    if (!ADMIN_SOCKET) {
+        ADMIN_SOCKET = "/tmp/email-sender-admin.sock";
+    }
+
+    /* The live settings: environment first, then the config file */
+    settings_from_env(&settings);
+    if (CONFIG_FILE && settings_read_file(&settings, CONFIG_FILE) < 0) {
+        log_error("Error: Cannot read CONFIG_FILE %s", CONFIG_FILE);
+        exit(1);
+    }
+    SMTP_POOL_MAX = env_int("SMTP_POOL_MAX", 16);
+    if (SMTP_POOL_MAX < settings.smtp_pool_size) {
+        SMTP_POOL_MAX = settings.smtp_pool_size;
+    }
+
+    /* Replicas default to their (container) hostname, which survives restarts */
+    const char *worker_id = getenv("WORKER_ID");
+    if (worker_id && strlen(worker_id) > 0) {
+        snprintf(WORKER_ID, sizeof(WORKER_ID), "%s", worker_id);
+    } else if (gethostname(WORKER_ID, sizeof(WORKER_ID)) != 0) {
+        snprintf(WORKER_ID, sizeof(WORKER_ID), "email-sender-%d", (int)getpid());
+    }
+    WORKER_ID[sizeof(WORKER_ID) - 1] = '\0';
+    if (SENDER_THREADS < 1) {
+        SENDER_THREADS = 1;
+    }
+    if (RETENTION_BATCH_SIZE < 1) {
+        RETENTION_BATCH_SIZE = 1;
+    }
+    if (DNS_MIN_TTL < 1) {
+        DNS_MIN_TTL = 1;
+    }
+
     /* Use default sender name if not provided */
     if (!SENDER_NAME || strlen(SENDER_NAME) == 0) {
         SENDER_NAME = "OpenFarm"; // Default sender name
@@ -94,48 +267,105 @@ void load_env_variables() {
 
     /* Validate required environment variables */
     if (!DB_HOST) {
-        fprintf(stderr, "Error: Missing POSTGRES_HOST environment variable\n");
+        log_error("Error: Missing POSTGRES_HOST environment variable");
         exit(1);
     }
     if (!DB_PORT) {
-        fprintf(stderr, "Error: Missing POSTGRES_PORT environment variable\n");
+        log_error("Error: Missing POSTGRES_PORT environment variable");
         exit(1);
     }
     if (!DB_NAME) {
-        fprintf(stderr, "Error: Missing POSTGRES_DB environment variable\n");
+        log_error("Error: Missing POSTGRES_DB environment variable");
         exit(1);
     }
     if (!DB_USER) {
-        fprintf(stderr, "Error: Missing POSTGRES_USER environment variable\n");
+        log_error("Error: Missing POSTGRES_USER environment variable");
         exit(1);
     }
     if (!DB_PASSWORD) {
-        fprintf(stderr, "Error: Missing POSTGRES_PASSWORD environment variable\n");
+        log_error("Error: Missing POSTGRES_PASSWORD environment variable");
         exit(1);
     }
-    if (!GMAIL_EMAIL) {
-        fprintf(stderr, "Error: Missing GMAIL_EMAIL environment variable\n");
-        exit(1);
+    snprintf(DB_CONNINFO, sizeof(DB_CONNINFO), "host=%s port=%s dbname=%s user=%s password=%s",
+             DB_HOST, DB_PORT, DB_NAME, DB_USER, DB_PASSWORD);
+
+    /* A relay file replaces the single account */
+    if (!SMTP_RELAYS_FILE) {
+        if (!GMAIL_EMAIL) {
+            log_error("Error: Missing GMAIL_EMAIL environment variable");
+            exit(1);
+        }
+        if (!GMAIL_PASSWORD) {
+            log_error("Error: Missing GMAIL_APP_PASSWORD environment variable");
+            exit(1);
+        }
+        if (!SMTPS_SERVER) {
+            log_error("Error: Missing SMTP_SERVER environment variable");
+            exit(1);
+        }
+        if (!SMTPS_PORT) {
+            log_error("Error: Missing SMTP_PORT environment variable");
+            exit(1);
+        }
     }
-    if (!GMAIL_PASSWORD) {
-        fprintf(stderr, "Error: Missing GMAIL_APP_PASSWORD environment variable\n");
-        exit(1);
+
+    /* Log successful loading of environment variables */
+    log_info("Environment variables loaded successfully");
+    log_info("Database: %s:%s/%s", DB_HOST, DB_PORT, DB_NAME);
+    if (SMTP_RELAYS_FILE) {
+        log_info("SMTP Relays: %s", SMTP_RELAYS_FILE);
+    } else {
+        log_info("SMTP: %s:%s", SMTPS_SERVER, SMTPS_PORT);
+        log_info("Email: %s", GMAIL_EMAIL);
     }
-    if (!SMTPS_SERVER) {
-        fprintf(stderr, "Error: Missing SMTP_SERVER environment variable\n");
-        exit(1);
+    if (SMTP_CA_FILE) {
+        log_info("SMTP CA Bundle: %s", SMTP_CA_FILE);
     }
-    if (!SMTPS_PORT) {
-        fprintf(stderr, "Error: Missing SMTP_PORT environment variable\n");
-        exit(1);
+    log_info("Sender Name: %s", SENDER_NAME);
+    log_info("Sweep Interval: %ds", SWEEP_INTERVAL);
+    log_info("Sender Threads: %d", SENDER_THREADS);
+    log_info("SMTP Pool: %d session(s) per relay per thread (up to %d), NOOP after %ds idle, "
+           "%d message(s) per connection", settings.smtp_pool_size, SMTP_POOL_MAX,
+           SMTP_NOOP_AFTER, SMTP_MAX_SENDS);
+    log_info("Claim Batch Size: %d", settings.claim_batch_size);
+    log_info("Priority Weights: high %d, normal %d, bulk %d",
+             settings.priority_weights[PRIORITY_HIGH], settings.priority_weights[PRIORITY_NORMAL],
+             settings.priority_weights[PRIORITY_BULK]);
+    log_info("Worker ID: %s (lease %ds)", WORKER_ID, LEASE_SECONDS);
+    log_info("Metrics: %s:%d", METRICS_ADDRESS, METRICS_PORT);
+    log_info("Retries: %d attempt(s), backoff %ds doubling up to %ds",
+           settings.retry_max_attempts, settings.retry_base_seconds, settings.retry_max_seconds);
+    log_info("Rate Limits: account %d/min (burst %d), domain %d/min (burst %d)",
+           settings.rate_limit_account, settings.rate_limit_account_burst,
+           settings.rate_limit_domain, settings.rate_limit_domain_burst);
+    log_info("Recipients Per Message: up to %d", settings.max_rcpt_per_message);
+    if (RETENTION_DAYS > 0) {
+        log_info("Retention: %s completed tickets after %d day(s), %d per chunk every %dms",
+               RETENTION_ARCHIVE ? "archive" : "delete", RETENTION_DAYS, RETENTION_BATCH_SIZE,
+               RETENTION_BATCH_DELAY_MS);
+    } else {
+        log_info("Retention: disabled");
     }
+    log_info("Shutdown Timeout: %ds", SHUTDOWN_TIMEOUT_SECONDS);
+    log_info("Template Cache: %d template(s)", TEMPLATE_CACHE_SIZE);
+    if (DNS_CACHE) {
+        log_info("DNS Cache: addresses kept %d-%ds", DNS_MIN_TTL, DNS_MAX_TTL);
+    } else {
+        log_info("DNS Cache: disabled");
+    }
+    log_info("Logging: level %s, bodies %s, SMTP trace %s",
+             logger_level_name((enum log_level)settings.log_level),
+             settings.log_bodies ? "on" : "off", settings.log_smtp_trace ? "on" : "off");
+    if (CONFIG_FILE) {
+        log_info("Config File: %s (reloaded on SIGHUP)", CONFIG_FILE);
+    }
+    log_info("Admin Socket: %s", *ADMIN_SOCKET ? ADMIN_SOCKET : "disabled");
 
-    /* Log successful loading of environment variables */
-    printf("Environment variables loaded successfully\n");
-    printf("Database: %s:%s/%s\n", DB_HOST, DB_PORT, DB_NAME);
-    printf("SMTP: %s:%s\n", SMTPS_SERVER, SMTPS_PORT);
-    printf("Email: %s\n", GMAIL_EMAIL);
-    printf("Sender Name: %s\n", SENDER_NAME);
+    if (settings_publish(&settings) < 0) {
+        log_error("Out of memory publishing settings");
+        exit(1);
+    }
+    logger_set_level((enum log_level)settings.log_level);
 }
 
 /**
@@ -144,18 +374,12 @@ void load_env_variables() {
  * @return Active PostgreSQL connection or NULL if connection failed
  */
 PGconn* connect_to_db() {
-    char conninfo[256];
-
-    /* Build the connection string */
-    sprintf(conninfo, "host=%s port=%s dbname=%s user=%s password=%s",
-            DB_HOST, DB_PORT, DB_NAME, DB_USER, DB_PASSWORD);
-
     /* Attempt to connect to the database */
-    PGconn *conn = PQconnectdb(conninfo);
+    PGconn *conn = PQconnectdb(DB_CONNINFO);
 
     /* Check if connection was successful */
     if (PQstatus(conn) != CONNECTION_OK) {
-        fprintf(stderr, "Connection to database failed: %s", PQerrorMessage(conn));
+        log_error("Connection to database failed: %s", PQerrorMessage(conn));
         PQfinish(conn);
         return NULL;
     }
@@ -163,191 +387,1175 @@ PGconn* connect_to_db() {
     return conn;
 }
 
+
 /**
- * Sends an email using the SMTP protocol via libcurl.
+ * Opens the SMTP sessions of every configured relay into a relay set
+ * (connections are made on first use). Each sender thread has its own.
  *
- * @param to      Recipient email address
- * @param subject Email subject line
- * @param body    Email body content
- * @return        1 if email was sent successfully, 0 if failed
+ * @param relays Relay set to initialize
+ * @param dns    Cache to take the relays' addresses from, or NULL
+ * @param share  Share handle for the sessions
+ * @return       0 on success, -1 on failure (the set is destroyed)
  */
-int send_email(const char *to, const char *subject, const char *body) {
-    CURL *curl;
-    CURLcode res = CURLE_OK;
-    struct curl_slist *recipients = NULL;
-    char url[100];
+int open_relays(struct relay_set *relays, struct dns_cache *dns, struct smtp_share *share) {
+    relay_set_init(relays);
+    if (SMTP_RELAYS_FILE) {
+        if (relay_set_load(relays, SMTP_RELAYS_FILE, SMTP_POOL_MAX, SMTP_NOOP_AFTER,
+                           SMTP_MAX_SENDS) <= 0) {
+            log_error("No usable SMTP relays in %s", SMTP_RELAYS_FILE);
+            relay_set_destroy(relays);
+            return -1;
+        }
+    } else if (relay_set_add(relays, SMTPS_SERVER, SMTPS_PORT, GMAIL_EMAIL, GMAIL_PASSWORD, 1,
+                             SMTP_POOL_MAX, SMTP_NOOP_AFTER, SMTP_MAX_SENDS) < 0) {
+        log_error("Failed to create SMTP session pool");
+        relay_set_destroy(relays);
+        return -1;
+    }
 
-    /* Build the SMTP URL with TLS/SSL */
-    snprintf(url, sizeof(url), "smtps://%s:%s", SMTPS_SERVER, SMTPS_PORT);
+    /* A private CA, e.g. for the benchmark's mock server (bench/) */
+    if (SMTP_CA_FILE) {
+        for (int r = 0; r < relays->count; r++) {
+            struct smtp_pool *pool = &relays->relays[r].pool;
 
-    /* Initialize curl */
-    curl = curl_easy_init();
-    if (curl) {
-        char payload[MAX_EMAIL_SIZE];
-        char from_header[256];
-        char to_header[256];
-        char subject_header[512];
+            for (int i = 0; i < pool->size; i++) {
+                curl_easy_setopt(pool->sessions[i].curl, CURLOPT_CAINFO, SMTP_CA_FILE);
+            }
+        }
+    }
 
-        /* Prepare email headers */
-        snprintf(from_header, sizeof(from_header), "From: %s <%s>", SENDER_NAME, GMAIL_EMAIL);
-        snprintf(to_header, sizeof(to_header), "To: <%s>", to);
-        snprintf(subject_header, sizeof(subject_header), "Subject: %s", subject);
+    /* Connections use addresses resolved ahead of time, and resume TLS
+     * sessions negotiated by any thread */
+    for (int r = 0; r < relays->count; r++) {
+        struct smtp_pool *pool = &relays->relays[r].pool;
 
-        /* Create the complete email payload with headers and body */
-        snprintf(payload, sizeof(payload),
-                 "%s\r\n%s\r\n%s\r\nContent-Type: text/plain; charset=UTF-8\r\n\r\n%s\r\n",
-                 from_header, to_header, subject_header, body);
+        if (dns) {
+            smtp_pool_use_dns(pool, dns);
+        }
+        for (int i = 0; i < pool->size; i++) {
+            smtp_share_attach(share, pool->sessions[i].curl);
+        }
+    }
+    return 0;
+}
 
-        /* Configure curl for SMTP communication */
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_USERNAME, GMAIL_EMAIL);
-        curl_easy_setopt(curl, CURLOPT_PASSWORD, GMAIL_PASSWORD);
+/**
+ * Opens a dedicated connection and starts a pipelined status writer on it.
+ *
+ * @param writer Writer to initialize
+ * @param loop   Event loop of the thread that will push to it
+ * @return       0 on success, -1 on failure
+ */
+int open_status_writer(struct status_writer *writer, struct event_loop *loop) {
+    PGconn *conn = connect_to_db();
 
-        /* Configure TLS/SSL security settings */
-        curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_ALL);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 2L);
+    if (conn && ticket_db_prepare(conn) < 0) {
+        PQfinish(conn);
+        conn = NULL;
+    }
+    /* status_writer_init() closes the connection itself on failure */
+    if (!conn || status_writer_init(writer, loop, conn, DB_CONNINFO) < 0) {
+        log_error("Failed to start status writer");
+        return -1;
+    }
+    return 0;
+}
 
-        /* Set the sender and recipient addresses */
-        curl_easy_setopt(curl, CURLOPT_MAIL_FROM, GMAIL_EMAIL);
-        recipients = curl_slist_append(recipients, to);
-        curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recipients);
+/**
+ * Subscribes a connection to the insert trigger's notifications, and to
+ * those of changed templates.
+ *
+ * @param conn Newly opened PostgreSQL connection
+ * @return     0 on success, -1 on failure
+ */
+int listen_for_tickets(PGconn *conn) {
+    PGresult *res = PQexec(conn, "LISTEN new_ticket; LISTEN template_changed");
 
-        /* Configure the email data upload */
-        curl_easy_setopt(curl, CURLOPT_READDATA, payload);
-        curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
-        curl_easy_setopt(curl, CURLOPT_READFUNCTION,
-                         (size_t (*)(char *, size_t, size_t, void *))fread);
-        curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        log_error("LISTEN command failed: %s", PQerrorMessage(conn));
+        PQclear(res);
+        return -1;
+    }
+    PQclear(res);
+    return 0;
+}
 
-        /* Create a memory stream for the payload */
-        FILE *fd = fmemopen(payload, strlen(payload), "rb");
-        curl_easy_setopt(curl, CURLOPT_READDATA, fd);
+/**
+ * Drops the claiming connection and starts replacing it in the background
+ * (see on_db_connected()). Sends, retries and status updates carry on
+ * meanwhile; only claiming and lease upkeep wait.
+ *
+ * @param ctx Sender context
+ */
+void db_lost(struct sender_context *ctx) {
+    log_error("Lost connection to database: %s", PQerrorMessage(ctx->conn));
+    event_loop_del_fd(ctx->loop, ctx->db_watcher);
+    ctx->db_watcher = NULL;
+    PQfinish(ctx->conn);
+    ctx->conn = NULL;
+    db_connector_start(&ctx->connector);
+}
 
-        /* Perform the email sending operation */
-        res = curl_easy_perform(curl);
+/**
+ * Checks the claiming connection before and after using it. One found
+ * broken is dropped straight away: libpq has already closed its socket,
+ * so the watcher must go before the descriptor number is reused.
+ *
+ * @param ctx Sender context
+ * @return    1 if the connection is usable, 0 otherwise
+ */
+int db_check(struct sender_context *ctx) {
+    if (!ctx->conn) {
+        return 0;
+    }
+    if (PQstatus(ctx->conn) != CONNECTION_OK) {
+        db_lost(ctx);
+        return 0;
+    }
+    return 1;
+}
 
-        /* Clean up resources */
-        fclose(fd);
-        curl_slist_free_all(recipients);
-        curl_easy_cleanup(curl);
+/**
+ * Detaches up to limit tickets from the front of the notified list.
+ *
+ * @param ctx   Sender context
+ * @param limit Most tickets to take
+ * @return      Linked list of the tickets taken
+ */
+struct ticket *take_notified(struct sender_context *ctx, int limit) {
+    struct ticket *head = ctx->notified_head;
+    struct ticket **link = &ctx->notified_head;
 
-        /* Check if sending succeeded */
-        if (res != CURLE_OK) {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-            return 0;
+    while (*link && limit-- > 0) {
+        link = &(*link)->next;
+        ctx->notified--;
+    }
+    ctx->notified_head = *link;
+    *link = NULL;
+    if (!ctx->notified_head) {
+        ctx->notified_tail = &ctx->notified_head;
+    }
+    return head;
+}
+
+/**
+ * Attaches its template to every templated ticket of a claimed batch.
+ * Templates missing from the cache are loaded in one query for the whole
+ * batch; tickets whose template does not exist are left without one.
+ *
+ * @param ctx  Sender context
+ * @param list Linked list of claimed tickets
+ * @return     0 on success, -1 if the templates could not be loaded
+ */
+int resolve_templates(struct sender_context *ctx, struct ticket *list) {
+    int *missing = NULL;
+    int count = 0;
+    int size = 0;
+    int loaded;
+
+    for (struct ticket *t = list; t; t = t->next) {
+        int known = 0;
+
+        if (!t->template_id) {
+            continue;
         }
+        t->template = template_cache_get(&ctx->templates, t->template_id);
+        for (int i = 0; !t->template && !known && i < count; i++) {
+            known = missing[i] == t->template_id;
+        }
+        if (t->template || known) {
+            continue;
+        }
+        if (count == size) {
+            int *grown = realloc(missing, (size_t)(size ? size * 2 : 8) * sizeof(*missing));
+
+            if (!grown) {
+                free(missing);
+                return -1;
+            }
+            missing = grown;
+            size = size ? size * 2 : 8;
+        }
+        missing[count++] = t->template_id;
+    }
+    if (count == 0) {
+        return 0;
     }
 
-    return (res == CURLE_OK) ? 1 : 0;
+    loaded = ticket_db_load_templates(ctx->conn, &ctx->templates, missing, count);
+    free(missing);
+    if (loaded < 0) {
+        db_check(ctx);
+        return -1;
+    }
+    metrics_add(METRIC_TEMPLATE_LOADS, (uint64_t)loaded);
+    for (struct ticket *t = list; t; t = t->next) {
+        if (t->template_id && !t->template) {
+            t->template = template_cache_get(&ctx->templates, t->template_id);
+        }
+    }
+    return 0;
 }
 
 /**
- * Processes a ticket by sending an email and updating its status.
+ * Divides a claim's room between the lanes that may have work, by stride
+ * scheduling: each slot goes to the lane with the lowest pass, which then
+ * advances by the lane's stride. While every lane has work each gets a
+ * share of the slots in proportion to its weight, so bulk mail keeps
+ * moving behind any transactional load and transactional mail waits for
+ * at most a small part of each batch whatever the bulk backlog; a lane
+ * without work leaves its share to the others. Ties go to the more
+ * urgent lane.
  *
- * @param conn      Active PostgreSQL connection
- * @param ticket_id ID of the ticket to process
+ * @param ctx    Sender context
+ * @param room   Tickets to claim
+ * @param limits Receives each lane's share
  */
-void process_ticket(PGconn *conn, int ticket_id) {
-    char query[MAX_QUERY_SIZE];
-    PGresult *res;
+void share_claims(struct sender_context *ctx, int room, int *limits) {
+    for (int lane = 0; lane < PRIORITY_LANES; lane++) {
+        limits[lane] = 0;
+
+        /* A lane that was idle rejoins at the current pass rather than
+         * catch up on the slots it did not need */
+        if ((ctx->work_pending & (1 << lane)) && ctx->lanes[lane].pass < ctx->lane_clock) {
+            ctx->lanes[lane].pass = ctx->lane_clock;
+        }
+    }
+    while (room-- > 0) {
+        int best = -1;
 
-    /* Authentication failure counter for rate limiting */
-    static int auth_failures = 0;
-    const int MAX_AUTH_FAILURES = 5;
+        for (int lane = 0; lane < PRIORITY_LANES; lane++) {
+            if ((ctx->work_pending & (1 << lane)) &&
+                (best < 0 || ctx->lanes[lane].pass < ctx->lanes[best].pass)) {
+                best = lane;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        limits[best]++;
+        ctx->lane_clock = ctx->lanes[best].pass;
+        ctx->lanes[best].pass += ctx->lanes[best].stride;
+    }
+}
 
-    /* Rate limiting for repeated authentication failures */
-    if (auth_failures >= MAX_AUTH_FAILURES) {
-        fprintf(stderr, "Too many authentication failures, waiting 15 minutes before trying again\n");
-        sleep(900); /* Wait 15 minutes */
-        auth_failures = 0; /* Reset counter after waiting */
+/**
+ * Sets each claim lane's stride from the current priority weights. Passes
+ * already reached are kept, so a change takes effect on the next slots.
+ *
+ * @param ctx Sender context
+ */
+void set_lane_strides(struct sender_context *ctx) {
+    for (int lane = 0; lane < PRIORITY_LANES; lane++) {
+        ctx->lanes[lane].stride =
+            LANE_STRIDE_SCALE / (uint64_t)settings_get()->priority_weights[lane];
     }
+}
 
-    /* Update ticket status to 'processing' */
-    snprintf(query, sizeof(query),
-             "UPDATE tickets SET status = 'processing' WHERE id = %d AND status = 'received'",
-             ticket_id);
+/**
+ * Takes the notifications libpq has queued on the claiming connection.
+ * Besides those read when its socket becomes readable, libpq queues any
+ * that arrive during a synchronous query on it (a claim, lease renewal,
+ * retention chunk...), and those never make the socket readable again;
+ * so this runs after every such query, through dispatch_tickets().
+ *
+ * @param ctx Sender context
+ */
+void take_notifications(struct sender_context *ctx) {
+    PGnotify *notify;
 
-    res = PQexec(conn, query);
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        fprintf(stderr, "Failed to update ticket to processing: %s", PQerrorMessage(conn));
-        PQclear(res);
+    if (!ctx->conn) {
         return;
     }
-    PQclear(res);
+    while ((notify = PQnotifies(ctx->conn)) != NULL) {
+        struct ticket *ticket = NULL;
 
-    /* Retrieve ticket information */
-    snprintf(query, sizeof(query),
-             "SELECT email, subject, body FROM tickets WHERE id = %d AND status = 'processing'",
-             ticket_id);
+        if (strcmp(notify->relname, "template_changed") == 0) {
+            /* Tickets already bound keep the version they were claimed with */
+            log_debug("Template %s changed", notify->extra);
+            template_cache_evict(&ctx->templates, atoi(notify->extra));
+            PQfreemem(notify);
+            continue;
+        }
+        ticket = ticket_from_notification(notify->extra);
+        if (!ticket) {
+            log_debug("Received notification for ticket ID(s): %s", notify->extra);
+            ctx->work_pending = ALL_LANES;
+        } else if (ctx->notified >= settings_get()->claim_batch_size) {
+            /* Enough held already; a full claim will find this one */
+            ticket_free(ticket);
+            ctx->work_pending = ALL_LANES;
+        } else {
+            log_debug("Received notification with ticket ID: %d", ticket->id);
+            *ctx->notified_tail = ticket;
+            ctx->notified_tail = &ticket->next;
+            ctx->notified++;
+        }
+        PQfreemem(notify);
+    }
+}
 
-    res = PQexec(conn, query);
+/**
+ * Claims tickets in batches and hands them to the sender threads while
+ * there may be unclaimed work. Up to CLAIM_BATCH_SIZE claimed tickets are
+ * kept waiting in the ring so sessions never idle between claims; a new
+ * batch is claimed once the ring has drained to half, shared between the
+ * priority lanes by share_claims(). Valid tickets of a
+ * batch that share a subject and body (or a template and params) are
+ * grouped, up to MAX_RCPT_PER_MESSAGE, and each group is sent as one
+ * message.
+ *
+ * @param ctx Sender context
+ */
+void dispatch_tickets(struct sender_context *ctx) {
+    int pushed = 0;
 
-    /* Check if ticket exists and is in 'processing' state */
-    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0) {
-        fprintf(stderr, "No processing ticket found with ID %d\n", ticket_id);
-        PQclear(res);
+    if (atomic_load(&ctx->draining)) {
+        return; /* Shutting down; unclaimed work is left for other replicas */
+    }
+
+    take_notifications(ctx);
+    while ((ctx->work_pending || ctx->notified_head) && !ctx->claims_paused && db_check(ctx)) {
+        const struct settings *settings = settings_get();
+        int room = settings->claim_batch_size - (int)ticket_ring_count(&ctx->ring);
+        struct ticket *valid = NULL;
+        struct ticket **valid_tail = &valid;
+        int claimed;
+        int valid_count = 0;
+        int groups;
+
+        if (room < (settings->claim_batch_size + 1) / 2) {
+            break; /* Resumed when a sender thread drains the ring */
+        }
+
+        /* Tickets that came with their notification only need their lease
+         * taken; the rest are claimed oldest first, contents included */
+        uint64_t started = metrics_now_usec();
+        struct ticket *ticket;
+        if (ctx->notified_head) {
+            ticket = ticket_db_claim_notified(ctx->conn, WORKER_ID, LEASE_SECONDS,
+                                              take_notified(ctx, room), &claimed);
+            if (claimed < 0) {
+                ctx->work_pending = ALL_LANES; /* Left for a full claim */
+                db_check(ctx);
+                break;
+            }
+        } else {
+            int limits[PRIORITY_LANES];
+            int lane_claimed[PRIORITY_LANES];
+
+            share_claims(ctx, room, limits);
+            ticket = ticket_db_claim(ctx->conn, WORKER_ID, LEASE_SECONDS, ctx->claim_after_id,
+                                     limits, lane_claimed, &claimed);
+            if (claimed < 0) {
+                db_check(ctx);
+                break; /* Retried on the next notification, sweep or reconnect */
+            }
+
+            /* A lane that came up short is drained for now; the slots it
+             * did not use are handed back, and the others get them on the
+             * next pass of the loop */
+            for (int lane = 0; lane < PRIORITY_LANES; lane++) {
+                if (lane_claimed[lane] < limits[lane]) {
+                    ctx->work_pending &= ~(1 << lane);
+                    ctx->lanes[lane].pass -=
+                        (uint64_t)(limits[lane] - lane_claimed[lane]) * ctx->lanes[lane].stride;
+                }
+            }
+            if (!ctx->work_pending) {
+                ctx->claim_after_id = 0;
+            }
+        }
+        metrics_observe(METRIC_CLAIM_SECONDS, metrics_now_usec() - started);
+        metrics_add(METRIC_CLAIMED, (uint64_t)claimed);
+        int templates_loaded = resolve_templates(ctx, ticket) == 0;
+
+        while (ticket) {
+            struct ticket *next = ticket->next;
+            const char *error = NULL;
+
+            if (ticket->id > ctx->high_water_id) {
+                ctx->high_water_id = ticket->id;
+            }
+
+            /* An earlier attempt got as far as ending the message, so it
+             * may well have been delivered; sending it again risks a
+             * duplicate, which is worse than a rare lost message */
+            if (ticket->unconfirmed) {
+                log_warn("Not resending ticket %d: an earlier attempt handed it to the "
+                         "SMTP server without its result being recorded", ticket->id);
+                status_writer_push(ctx->writer, ticket->id, OUTCOME_UNCONFIRMED,
+                                   "not resent: handed to the SMTP server by an earlier attempt "
+                                   "whose result was lost");
+                metrics_add(METRIC_RESENDS_SUPPRESSED, 1);
+                ticket_free(ticket);
+                ticket = next;
+                continue;
+            }
+
+            /* Validate email format and template params before sending */
+            enum email_verdict verdict = email_validate(ticket->email);
+
+            if (ticket->template_id && !ticket->template && !templates_loaded) {
+                log_error("Templates unavailable, leaving ticket %d to its lease", ticket->id);
+                ticket_free(ticket);
+                ticket = next;
+                continue;
+            }
+            if (verdict != EMAIL_VALID) {
+                log_warn("Invalid email format: %s (%s)",
+                        ticket->email, email_verdict_str(verdict));
+                error = email_verdict_str(verdict);
+            } else if (ticket->template_id && !ticket->template) {
+                log_warn("Ticket %d uses unknown template %d", ticket->id, ticket->template_id);
+                error = "unknown template";
+            } else if (ticket->template && ticket_bind_template(ticket, &error) < 0) {
+                log_warn("Ticket %d does not fit template %d: %s",
+                         ticket->id, ticket->template_id, error);
+            }
+
+            if (error) {
+                status_writer_push(ctx->writer, ticket->id, OUTCOME_INVALID, error);
+                metrics_add(METRIC_INVALID, 1);
+                ticket_free(ticket);
+            } else {
+                log_debug("Sending ticket %d to %s, subject: %s",
+                          ticket->id, ticket->email, ticket->subject);
+                if (settings->log_bodies && ticket->template) {
+                    log_debug("Params of ticket %d (template %d): %s",
+                              ticket->id, ticket->template_id, ticket->params);
+                } else if (settings->log_bodies) {
+                    log_debug("Body of ticket %d: %s", ticket->id, ticket->body);
+                }
+                *valid_tail = ticket;
+                valid_tail = &ticket->next;
+                valid_count++;
+            }
+            ticket = next;
+        }
+        *valid_tail = NULL;
+
+        ticket = ticket_list_group(valid, settings->max_rcpt_per_message, &groups);
+        if (groups < valid_count) {
+            log_debug("Sending %d ticket(s) as %d message(s)", valid_count, groups);
+        }
+        while (ticket) {
+            struct ticket *next = ticket->next;
+
+            /* Only this thread pushes and never claims more than the room
+             * left, so the ring cannot be full; should it be anyway, the
+             * lease expires and the ticket is claimed again */
+            if (ticket_ring_push(&ctx->ring, ticket) < 0) {
+                log_error("Ticket ring full, leaving ticket %d to its lease", ticket->id);
+                ticket_free(ticket);
+            } else {
+                pushed++;
+            }
+            ticket = next;
+        }
+
+        /* Notifications that came in during the claim */
+        take_notifications(ctx);
+    }
+    take_notifications(ctx);
+
+    for (int i = 0; pushed > 0 && i < ctx->worker_count; i++) {
+        event_loop_notify(ctx->workers[i].wake);
+    }
+}
+
+/**
+ * Stops claiming new tickets for a while after repeated failures (e.g.
+ * rejected credentials), without blocking the loop: in-flight sends and
+ * scheduled retries carry on and act as probes. Pauses back off from
+ * CLAIM_PAUSE_BASE_MS to CLAIM_PAUSE_MAX_MS until a send succeeds.
+ *
+ * @param ctx Sender context
+ */
+void pause_claims(struct sender_context *ctx) {
+    long delay_ms = retry_backoff_ms(++ctx->pauses, CLAIM_PAUSE_BASE_MS, CLAIM_PAUSE_MAX_MS);
+
+    log_warn("Too many consecutive send failures, pausing claims for %lds",
+            delay_ms / 1000);
+    if (event_loop_timer_arm(ctx->resume_timer, delay_ms, 0) < 0) {
+        return; /* Keep claiming rather than stall forever */
+    }
+    ctx->claims_paused = 1;
+    atomic_store(&ctx->failures, 0);
+}
+
+/**
+ * Moves tickets from the ring onto a sender thread's free sessions, and
+ * asks the claiming thread for more once the ring is half empty.
+ *
+ * @param w Sender thread
+ */
+void worker_fill(struct sender_worker *w) {
+    struct sender_context *ctx = w->ctx;
+    int taken = 0;
+
+    while (!w->engine.draining && send_engine_capacity(&w->engine) > 0) {
+        struct ticket *ticket = ticket_ring_pop(&ctx->ring);
+
+        if (!ticket) {
+            break;
+        }
+        send_engine_submit(&w->engine, ticket);
+        taken++;
+    }
+    if (taken > 0 &&
+        ticket_ring_count(&ctx->ring) <= (size_t)settings_get()->claim_batch_size / 2) {
+        event_loop_notify(ctx->kick);
+    }
+}
+
+/**
+ * Records a failed delivery: schedules the ticket for another attempt
+ * after its backoff, or marks it 'failed' once it has used them all.
+ * Retries stay on the thread that made the attempt.
+ *
+ * @param w      Sender thread
+ * @param ticket Ticket that failed (ownership taken)
+ * @param error  Description of the failure
+ */
+void handle_send_failure(struct sender_worker *w, struct ticket *ticket, const char *error) {
+    const struct settings *settings = settings_get();
+
+    ticket->retry_count++;
+    if (ticket->retry_count >= settings->retry_max_attempts) {
+        log_warn("Giving up on email to %s after %d attempt(s): %s",
+                ticket->email, ticket->retry_count, error);
+        status_writer_push(&w->writer, ticket->id, OUTCOME_FAILED, error);
+        ticket_free(ticket);
         return;
     }
 
-    /* Extract ticket data from query result */
-    char *email = PQgetvalue(res, 0, 0);
-    char *subject = PQgetvalue(res, 0, 1);
-    char *body = PQgetvalue(res, 0, 2);
+    long delay_ms = retry_backoff_ms(ticket->retry_count, settings->retry_base_seconds * 1000L,
+                                     settings->retry_max_seconds * 1000L);
+    log_warn("Failed to send email to %s: %s, retry %d/%d in %lds", ticket->email, error,
+            ticket->retry_count, settings->retry_max_attempts - 1, delay_ms / 1000);
+    status_writer_push(&w->writer, ticket->id, OUTCOME_RETRY, error);
 
-    printf("Sending email to: %s\nSubject: %s\nBody: %s\n", email, subject, body);
+    /* The ticket stays leased by this worker while it waits */
+    if (retry_queue_add(&w->retries, ticket, delay_ms) < 0) {
+        log_error("Out of memory scheduling retry of ticket %d", ticket->id);
+        ticket_free(ticket);
+    }
+}
 
-    /* Validate email format before sending */
-    if (!is_valid_email(email)) {
-        fprintf(stderr, "Invalid email format: %s\n", email);
-        PQclear(res);
+/**
+ * Send engine completion callback (on a sender thread): records the
+ * outcome of a delivery and takes more work as sessions free up.
+ *
+ * @param engine        Engine that sent the ticket
+ * @param ticket        Ticket that finished (freed or rescheduled here)
+ * @param result        CURLE_OK if the email was accepted by the server
+ * @param response_code Last SMTP response code
+ * @param arg           Sender thread
+ */
+void on_ticket_sent(struct send_engine *engine, struct ticket *ticket,
+                    CURLcode result, long response_code, void *arg) {
+    struct sender_worker *w = arg;
+    struct sender_context *ctx = w->ctx;
 
-        /* Update status to indicate validation error */
-        snprintf(query, sizeof(query),
-                "UPDATE tickets SET status = 'processing', sent_at = NOW() WHERE id = %d",
-                ticket_id);
-        res = PQexec(conn, query);
-        PQclear(res);
+    (void)engine;
+
+    if (result == CURLE_OK) {
+        log_debug("Email sent successfully to %s", ticket->email);
+        status_writer_push(&w->writer, ticket->id, OUTCOME_COMPLETED, NULL);
+        metrics_add(METRIC_SENT, 1);
+        ticket_free(ticket);
+
+        /* Reset failure tracking on success */
+        atomic_store(&ctx->failures, 0);
+        atomic_store(&ctx->delivered, 1);
+    } else {
+        char error[256];
+
+        snprintf(error, sizeof(error), "%s (SMTP %ld)", curl_easy_strerror(result), response_code);
+        metrics_add(METRIC_FAILED, 1);
+        handle_send_failure(w, ticket, error);
+
+        /* One refused recipient of a group, or an attachment that could not
+         * be read, says nothing about the account */
+        if (result != CURLE_REMOTE_ACCESS_DENIED && result != CURLE_ABORTED_BY_CALLBACK) {
+            int failures = atomic_fetch_add(&ctx->failures, 1) + 1;
+
+            log_warn("Email sending failure detected (%d/%d)",
+                    failures, MAX_AUTH_FAILURES);
+            if (failures == MAX_AUTH_FAILURES) {
+                event_loop_notify(ctx->kick); /* The claiming thread pauses */
+            }
+        }
+    }
+
+    worker_fill(w);
+}
+
+/**
+ * Retry queue callback: a failed ticket's backoff has elapsed.
+ */
+void on_retry_due(struct ticket *ticket, void *arg) {
+    struct sender_worker *w = arg;
+
+    send_engine_submit(&w->engine, ticket);
+}
+
+/**
+ * Timer callback on a draining sender thread: stops its loop once no
+ * transfer is in flight and every status update has been acknowledged.
+ */
+void on_worker_drain_timer(struct event_loop *loop, struct loop_timer *timer, void *arg) {
+    struct sender_worker *w = arg;
+
+    (void)timer;
+    if (w->engine.in_flight == 0 && status_writer_pending(&w->writer) == 0) {
+        event_loop_stop(loop);
+    }
+}
+
+/**
+ * Notifier callback on a sender thread: the claiming thread pushed
+ * tickets, or is shutting down.
+ */
+void on_worker_wake(struct event_loop *loop, struct loop_notifier *notifier, void *arg) {
+    struct sender_worker *w = arg;
+
+    (void)notifier;
+    if (atomic_load(&w->ctx->stopping)) {
+        event_loop_stop(loop);
+        return;
+    }
+    if (atomic_load(&w->ctx->draining)) {
+        if (!w->engine.draining) {
+            send_engine_drain(&w->engine);
+            event_loop_timer_arm(w->drain_timer, 0, DRAIN_CHECK_MS);
+        }
         return;
     }
+    worker_fill(w);
+}
 
-    /* Attempt to send the email */
-    if (send_email(email, subject, body)) {
-        printf("Email sent successfully to %s\n", email);
+/**
+ * Brings a sender thread's sessions and engine in line with the settings,
+ * if they changed since last time. Runs on the thread itself once started.
+ *
+ * @param w Sender thread
+ * @return  1 if a new version was applied, 0 if nothing changed
+ */
+int worker_apply_settings(struct sender_worker *w) {
+    const struct settings *settings = settings_get();
 
-        /* Update ticket status to 'completed' and record sent timestamp */
-        PQclear(res);
-        snprintf(query, sizeof(query),
-                 "UPDATE tickets SET sent_at = NOW(), status = 'completed' WHERE id = %d",
-                 ticket_id);
+    if (settings->version == w->settings_version) {
+        return 0;
+    }
+    w->settings_version = settings->version;
+    relay_set_limit_sessions(&w->relays, settings->smtp_pool_size);
+    send_engine_resize(&w->engine);
+    w->engine.trace = settings->log_smtp_trace;
+    return 1;
+}
 
-        res = PQexec(conn, query);
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            fprintf(stderr, "Failed to update ticket status: %s", PQerrorMessage(conn));
+/**
+ * Sender thread body: runs the thread's event loop until shutdown. If the
+ * loop ends any other way (its status connection was lost) the whole
+ * process stops. Between iterations the thread holds no settings, which
+ * lets replaced versions be freed, and picks up any change.
+ */
+void *worker_main(void *arg) {
+    struct sender_worker *w = arg;
+
+    worker_fill(w);
+    w->loop.running = 1;
+    while (w->loop.running) {
+        settings_quiescent(&w->reader);
+        if (worker_apply_settings(w) && !w->engine.draining) {
+            worker_fill(w); /* The pool may have grown */
+        }
+        if (event_loop_run_once(&w->loop, -1) < 0) {
+            break;
         }
+    }
+    if (atomic_load(&w->ctx->stopping)) {
+        return NULL;
+    }
+    if (w->engine.draining) {
+        atomic_fetch_add(&w->ctx->drained, 1);
+    } else {
+        log_error("Sender thread %d stopped", w->index);
+        atomic_store(&w->ctx->worker_failed, 1);
+    }
+    event_loop_notify(w->ctx->kick);
+    return NULL;
+}
+
+/**
+ * Sets up a sender thread's loop, SMTP sessions, status connection,
+ * attachment reader and retry queue. The thread itself is started separately.
+ *
+ * @param w     Sender thread to initialize
+ * @param ctx   Sender context
+ * @param index Thread number, for logging
+ * @return      0 on success, -1 on failure (nothing is left allocated)
+ */
+int worker_init(struct sender_worker *w, struct sender_context *ctx, int index) {
+    memset(w, 0, sizeof(*w));
+    w->index = index;
+    w->ctx = ctx;
+
+    if (open_relays(&w->relays, DNS_CACHE ? &ctx->dns : NULL, &ctx->share) < 0) {
+        return -1;
+    }
+    if (event_loop_init(&w->loop) < 0) {
+        relay_set_destroy(&w->relays);
+        return -1;
+    }
+    if (open_status_writer(&w->writer, &w->loop) < 0) {
+        event_loop_destroy(&w->loop);
+        relay_set_destroy(&w->relays);
+        return -1;
+    }
+    if (send_engine_init(&w->engine, &w->loop, &w->relays, SENDER_NAME, on_ticket_sent, w) < 0) {
+        log_error("Failed to create send engine");
+        status_writer_destroy(&w->writer);
+        event_loop_destroy(&w->loop);
+        relay_set_destroy(&w->relays);
+        return -1;
+    }
+    if (attachment_reader_init(&w->attachments, &w->loop, DB_CONNINFO) < 0) {
+        log_error("Failed to create attachment reader");
+        send_engine_destroy(&w->engine);
+        status_writer_destroy(&w->writer);
+        event_loop_destroy(&w->loop);
+        relay_set_destroy(&w->relays);
+        return -1;
+    }
+    send_engine_set_attachment_reader(&w->engine, &w->attachments);
+    send_engine_set_status_writer(&w->engine, &w->writer);
+
+    /* Keep under provider quotas; a limiter set to 0 lets everything through */
+    send_engine_set_rate_limits(&w->engine, &ctx->account_limit, &ctx->domain_limit);
+    worker_apply_settings(w);
+
+    /* Failed sends wait here for their backoff instead of blocking the loop */
+    w->wake = event_loop_notifier_new(&w->loop, on_worker_wake, w);
+    w->drain_timer = event_loop_timer_new(&w->loop, on_worker_drain_timer, w);
+    if (!w->wake || !w->drain_timer ||
+        retry_queue_init(&w->retries, &w->loop, on_retry_due, w) < 0) {
+        log_error("Failed to create retry scheduler");
+        event_loop_timer_free(&w->loop, w->drain_timer);
+        event_loop_notifier_free(&w->loop, w->wake);
+        send_engine_destroy(&w->engine);
+        attachment_reader_destroy(&w->attachments);
+        status_writer_destroy(&w->writer);
+        event_loop_destroy(&w->loop);
+        relay_set_destroy(&w->relays);
+        return -1;
+    }
+    settings_reader_register(&w->reader);
+    return 0;
+}
+
+/**
+ * Releases a sender thread's resources once it has been joined (or was
+ * never started).
+ *
+ * @param w Sender thread to destroy
+ */
+void worker_destroy(struct sender_worker *w) {
+    settings_reader_unregister(&w->reader);
+    retry_queue_destroy(&w->retries);
+    event_loop_timer_free(&w->loop, w->drain_timer);
+    event_loop_notifier_free(&w->loop, w->wake);
+    send_engine_destroy(&w->engine);
+    attachment_reader_destroy(&w->attachments);
+    status_writer_destroy(&w->writer);
+    event_loop_destroy(&w->loop);
+    relay_set_destroy(&w->relays);
+}
+
+/**
+ * Timer callback on the claiming thread while shutting down: stops the
+ * main loop once every sender thread has drained and the claiming
+ * thread's own status updates are acknowledged, or at the deadline.
+ */
+void on_drain_timer(struct event_loop *loop, struct loop_timer *timer, void *arg) {
+    struct sender_context *ctx = arg;
 
-        /* Reset auth failures counter on success */
-        auth_failures = 0;
+    (void)timer;
+    if (atomic_load(&ctx->drained) == ctx->worker_count && status_writer_pending(ctx->writer) == 0) {
+        log_info("In-flight sends finished");
+        event_loop_stop(loop);
+    } else if (metrics_now_usec() >= ctx->drain_deadline_usec) {
+        log_warn("Shutdown timeout reached, abandoning in-flight sends");
+        event_loop_stop(loop);
+    }
+}
+
+/**
+ * Starts a graceful shutdown: no more claims or new transfers, while the
+ * transfers and status updates in flight get SHUTDOWN_TIMEOUT_SECONDS to
+ * finish. A second signal stops at once.
+ *
+ * @param ctx Sender context
+ * @param loop Claiming thread's loop
+ */
+void begin_shutdown(struct sender_context *ctx, struct event_loop *loop) {
+    if (atomic_exchange(&ctx->draining, 1)) {
+        log_warn("Second signal, stopping now");
+        event_loop_stop(loop);
+        return;
+    }
+    log_info("Shutting down, waiting up to %ds for in-flight sends", SHUTDOWN_TIMEOUT_SECONDS);
+    event_loop_timer_disarm(ctx->resume_timer);
+    if (ctx->retention_timer) {
+        event_loop_timer_disarm(ctx->retention_timer);
+    }
+    for (int i = 0; i < ctx->worker_count; i++) {
+        event_loop_notify(ctx->workers[i].wake);
+    }
+    ctx->drain_deadline_usec = metrics_now_usec() + SHUTDOWN_TIMEOUT_SECONDS * 1000000ULL;
+    if (event_loop_timer_arm(ctx->drain_timer, 0, DRAIN_CHECK_MS) < 0) {
+        event_loop_stop(loop);
+    }
+}
+
+/**
+ * Publishes new settings and applies the parts the claiming thread owns:
+ * lane strides, rate limits and log level. Sender threads are woken to
+ * apply the rest (pool sizes, SMTP trace) themselves. Admin socket
+ * callback, also used for reloads.
+ *
+ * @param settings New settings
+ * @param arg      Sender context
+ * @return         0 on success, -1 if out of memory
+ */
+int publish_settings(const struct settings *settings, void *arg) {
+    struct sender_context *ctx = arg;
+    struct settings published = *settings;
+
+    if (published.smtp_pool_size > SMTP_POOL_MAX) {
+        log_warn("SMTP_POOL_SIZE %d is above SMTP_POOL_MAX, using %d",
+                 published.smtp_pool_size, SMTP_POOL_MAX);
+        published.smtp_pool_size = SMTP_POOL_MAX;
+    }
+    if (settings_publish(&published) < 0) {
+        log_error("Out of memory publishing settings");
+        return -1;
+    }
+    set_lane_strides(ctx);
+    rate_limiter_configure(&ctx->account_limit, published.rate_limit_account,
+                           published.rate_limit_account_burst);
+    rate_limiter_configure(&ctx->domain_limit, published.rate_limit_domain,
+                           published.rate_limit_domain_burst);
+    logger_set_level((enum log_level)published.log_level);
+    for (int i = 0; i < ctx->worker_count; i++) {
+        event_loop_notify(ctx->workers[i].wake);
+    }
+
+    /* A larger batch may leave room to claim more now */
+    dispatch_tickets(ctx);
+    return 0;
+}
+
+/**
+ * Rebuilds the settings from the environment and CONFIG_FILE and
+ * publishes them. Values set over the admin socket since are dropped.
+ * Admin socket callback, and run on SIGHUP.
+ *
+ * @param arg Sender context
+ * @return    0 on success, -1 if there is no file or it cannot be read
+ */
+int reload_settings(void *arg) {
+    struct settings settings;
+
+    if (!CONFIG_FILE) {
+        log_warn("Nothing to reload, CONFIG_FILE is not set");
+        return -1;
+    }
+    settings_from_env(&settings);
+    if (settings_read_file(&settings, CONFIG_FILE) < 0 || publish_settings(&settings, arg) < 0) {
+        log_warn("Keeping the current settings");
+        return -1;
+    }
+    log_info("Reloaded %s (settings version %lu)", CONFIG_FILE, settings_get()->version);
+    return 0;
+}
+
+/**
+ * Event loop callback for the signalfd: SIGHUP reloads the config file,
+ * SIGTERM and SIGINT shut down.
+ */
+void on_signal(struct event_loop *loop, int fd, uint32_t events, void *arg) {
+    struct signalfd_siginfo info;
+
+    (void)events;
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+        log_info("Received %s", strsignal((int)info.ssi_signo));
+        if (info.ssi_signo == SIGHUP) {
+            reload_settings(arg);
+        } else {
+            begin_shutdown(arg, loop);
+        }
+    }
+}
+
+/**
+ * Notifier callback on the claiming thread: a sender thread drained the
+ * ring, hit the failure limit, or stopped.
+ */
+void on_kick(struct event_loop *loop, struct loop_notifier *notifier, void *arg) {
+    struct sender_context *ctx = arg;
+
+    (void)notifier;
+    if (atomic_load(&ctx->worker_failed)) {
+        event_loop_stop(loop);
+        return;
+    }
+    if (atomic_load(&ctx->draining)) {
+        return; /* on_drain_timer() decides when to stop */
+    }
+    if (atomic_exchange(&ctx->delivered, 0)) {
+        ctx->pauses = 0;
+    }
+    if (atomic_load(&ctx->failures) >= MAX_AUTH_FAILURES && !ctx->claims_paused) {
+        pause_claims(ctx);
+    }
+    dispatch_tickets(ctx);
+}
+
+/**
+ * Timer callback: ends a pause in claiming started by pause_claims().
+ */
+void on_resume_timer(struct event_loop *loop, struct loop_timer *timer, void *arg) {
+    struct sender_context *ctx = arg;
+
+    (void)loop;
+    (void)timer;
+    log_info("Resuming claims");
+    ctx->claims_paused = 0;
+    ctx->work_pending = ALL_LANES;
+    ctx->claim_after_id = 0;
+    dispatch_tickets(ctx);
+}
+
+/**
+ * Event loop callback for the libpq socket: consumes pending input and
+ * claims work for the new_ticket notifications received. A notification
+ * carrying its ticket is kept and claimed by id; one carrying just an id,
+ * or the id range of a bulk insert, only signals that work exists, and any
+ * number of those collapses into batch claims.
+ */
+void on_db_readable(struct event_loop *loop, int fd, uint32_t events, void *arg) {
+    struct sender_context *ctx = arg;
+
+    (void)loop;
+    (void)fd;
+    (void)events;
+
+    /* Read whatever the server sent; failure means the connection is gone */
+    if (!PQconsumeInput(ctx->conn)) {
+        db_lost(ctx);
+        return;
+    }
+
+    /* Take every notification received, even while shutting down, before claiming */
+    take_notifications(ctx);
+    dispatch_tickets(ctx);
+}
+
+/**
+ * Connector callback: the claiming connection is back. It listens again,
+ * then catches up on notifications missed while it was down. When every
+ * ticket up to the high-water mark had already been claimed, only newer
+ * ones can be waiting, so the first claims skip straight past it instead
+ * of walking everything unsent; anything older that was missed (a long
+ * insert transaction committing late) is left to the periodic sweep.
+ *
+ * @param conn New connection
+ * @param arg  Sender context
+ * @return     0 on success, -1 to have the connector try again
+ */
+int on_db_connected(PGconn *conn, void *arg) {
+    struct sender_context *ctx = arg;
+
+    if (listen_for_tickets(conn) < 0 || ticket_db_prepare(conn) < 0) {
+        return -1;
+    }
+    ctx->db_watcher = event_loop_add_fd(ctx->loop, PQsocket(conn), EPOLLIN, on_db_readable, ctx);
+    if (!ctx->db_watcher) {
+        return -1;
+    }
+    ctx->conn = conn;
+
+    /* Template changes may have been missed while disconnected */
+    template_cache_clear(&ctx->templates);
+
+    if (!ctx->work_pending) {
+        ctx->claim_after_id = ctx->high_water_id;
+    }
+    log_info("Catching up on tickets after ID %d", ctx->claim_after_id);
+    ctx->work_pending = ALL_LANES;
+    dispatch_tickets(ctx);
+    return 0;
+}
+
+/**
+ * Timer callback: periodically picks up 'received' tickets whose
+ * notification was missed (e.g. sent while the sender was busy or down).
+ */
+void on_sweep_timer(struct event_loop *loop, struct loop_timer *timer, void *arg) {
+    struct sender_context *ctx = arg;
+
+    (void)loop;
+    (void)timer;
+    ctx->work_pending = ALL_LANES;
+    ctx->claim_after_id = 0;
+    dispatch_tickets(ctx);
+}
+
+/**
+ * Timer callback: keeps this worker's leases alive and returns tickets
+ * whose lease has expired (a crashed or failed sender) to the queue.
+ */
+void on_lease_timer(struct event_loop *loop, struct loop_timer *timer, void *arg) {
+    struct sender_context *ctx = arg;
+
+    (void)loop;
+    (void)timer;
+    if (!db_check(ctx)) {
+        return;
+    }
+    ticket_db_renew_leases(ctx->conn, WORKER_ID, LEASE_SECONDS);
+    int reclaimed = ticket_db_reclaim_expired(ctx->conn);
+    if (reclaimed > 0) {
+        log_info("Reclaimed %d ticket(s) with expired leases", reclaimed);
+        ctx->work_pending = ALL_LANES;
+        ctx->claim_after_id = 0;
+    } else if (reclaimed < 0) {
+        db_check(ctx);
+    }
+    dispatch_tickets(ctx); /* Also takes notifications queued meanwhile */
+}
+
+/**
+ * Timer callback: removes one chunk of expired finished tickets. A run
+ * starts by dropping whole expired partitions (when archiving, only those
+ * an earlier walk has emptied), then walks the remaining completed and
+ * failed tickets in id order, a short chunk at a time with a pause in
+ * between, so neither the table nor the claiming thread is held for long.
+ * The run ends with a short chunk and the next one starts an hour later.
+ */
+void on_retention_timer(struct event_loop *loop, struct loop_timer *timer, void *arg) {
+    struct sender_context *ctx = arg;
+    int last_id = 0;
+
+    (void)loop;
+    if (!db_check(ctx)) {
+        event_loop_timer_arm(timer, RETENTION_BATCH_DELAY_MS, 0); /* Resumed once reconnected */
+        return;
+    }
+    if (ctx->retention_after_id == 0) {
+        int dropped = ticket_db_drop_expired_partitions(ctx->conn, RETENTION_ARCHIVE,
+                                                        RETENTION_DAYS);
+
+        if (dropped > 0) {
+            log_info("Retention dropped %d expired partition(s)", dropped);
+            metrics_add(METRIC_PARTITIONS_DROPPED, (uint64_t)dropped);
+        }
+    }
+
+    uint64_t started = metrics_now_usec();
+    int retired = ticket_db_retire_completed(ctx->conn, RETENTION_ARCHIVE, RETENTION_DAYS,
+                                             ctx->retention_after_id, RETENTION_BATCH_SIZE,
+                                             &last_id);
+    metrics_observe(METRIC_RETENTION_SECONDS, metrics_now_usec() - started);
+
+    if (retired > 0) {
+        metrics_add(METRIC_RETIRED, (uint64_t)retired);
+        ctx->retention_after_id = last_id;
+        metrics_set(METRIC_RETENTION_CURSOR, last_id);
+    }
+    if (retired < RETENTION_BATCH_SIZE) {
+        /* Caught up (or failed): start over from the oldest next time */
+        if (ctx->retention_after_id > 0) {
+            log_info("Retention run finished at ticket %d", ctx->retention_after_id);
+        }
+        ctx->retention_after_id = 0;
+        if (retired < 0 && !db_check(ctx)) {
+            event_loop_timer_arm(timer, RETENTION_BATCH_DELAY_MS, 0);
+            return;
+        }
+        event_loop_timer_arm(timer, RETENTION_RUN_INTERVAL_MS, 0);
     } else {
-        /* Handle email sending failure */
-        fprintf(stderr, "Failed to send email to %s, keeping status as processing\n", email);
-        auth_failures++;
-        fprintf(stderr, "Email sending failure detected (%d/%d)\n",
-                auth_failures, MAX_AUTH_FAILURES);
+        event_loop_timer_arm(timer, RETENTION_BATCH_DELAY_MS, 0);
     }
+    dispatch_tickets(ctx); /* Takes notifications queued during the chunk */
+}
 
-    PQclear(res);
+/**
+ * Timer callback: samples the queue depth gauge. Scrapes report the last
+ * sample, so they never wait on the database or hold up claiming.
+ */
+void on_queue_depth_timer(struct event_loop *loop, struct loop_timer *timer, void *arg) {
+    struct sender_context *ctx = arg;
+    long depth = db_check(ctx) ? ticket_db_count_received(ctx->conn) : -1;
+
+    if (depth >= 0) {
+        metrics_set(METRIC_QUEUE_DEPTH, depth);
+    } else {
+        db_check(ctx);
+    }
+    (void)loop;
+    (void)timer;
+    dispatch_tickets(ctx); /* Takes notifications queued during the count */
 }
 
 /**
- * Main function: initializes systems, connects to database, and
- * processes tickets in an infinite loop.
+ * Main function: initializes systems, connects to database, starts the
+ * sender threads and claims tickets for them as notifications arrive.
  */
 int main() {
+    struct event_loop loop;
+    struct loop_timer *sweep_timer = NULL;
+    struct loop_timer *lease_timer = NULL;
+    struct loop_timer *depth_timer = NULL;
+    struct io_watcher *signal_watcher = NULL;
+    struct status_writer writer;
+    struct sender_context ctx;
+    struct metrics_server metrics;
+    struct admin_server admin;
+    int metrics_started = 0;
+    int admin_started = 0;
+    int writer_started = 0;
+    int limits_started = 0;
+    int ring_started = 0;
+    int share_started = 0;
+    int workers_ready = 0;
+    int threads_started = 0;
+    int signal_fd = -1;
+    int released;
+    int exit_code = 1;
+    sigset_t signals;
+
+    /* Start logging first; log calls before this would be synchronous */
+    if (logger_init(getenv("LOG_LEVEL"), getenv("LOG_FORMAT")) < 0) {
+        log_error("Failed to start log writer, logging synchronously");
+    }
+
     /* Initialize environment and configurations */
     load_env_variables();
 
-    /* Initialize curl library */
+    /* SIGTERM, SIGINT and SIGHUP are read from a signalfd on the main
+     * loop; block them before any thread starts so every thread inherits
+     * the mask */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    /* Initialize curl library (before any thread uses it) */
     curl_global_init(CURL_GLOBAL_DEFAULT);
 
     /* Connect to PostgreSQL database */
@@ -357,51 +1565,258 @@ int main() {
     }
 
     /* Set up notification listening */
-    PGresult *res = PQexec(conn, "LISTEN new_ticket");
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        fprintf(stderr, "LISTEN command failed: %s", PQerrorMessage(conn));
-        PQclear(res);
+    if (listen_for_tickets(conn) < 0) {
+        PQfinish(conn);
+        return 1;
+    }
+
+    /* Parse and plan the hot-path queries once for this connection */
+    if (ticket_db_prepare(conn) < 0) {
+        PQfinish(conn);
+        return 1;
+    }
+
+    if (event_loop_init(&loop) < 0) {
         PQfinish(conn);
         return 1;
     }
-    PQclear(res);
 
-    printf("Email sender started. Waiting for new tickets...\n");
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.loop = &loop;
+    ctx.conn = conn;
+    ctx.writer = &writer;
+    ctx.notified_tail = &ctx.notified_head;
+    set_lane_strides(&ctx);
 
-    /* Process any existing tickets in received or processing state */
-    res = PQexec(conn, "SELECT id FROM tickets WHERE status IN ('received', 'processing')");
-    if (PQresultStatus(res) == PGRES_TUPLES_OK) {
-        int rows = PQntuples(res);
-        for (int i = 0; i < rows; i++) {
-            int ticket_id = atoi(PQgetvalue(res, i, 0));
-            process_ticket(conn, ticket_id);
+    /* Status updates are pipelined over other connections, since this one
+     * also serves LISTEN and the synchronous claims */
+    if (open_status_writer(&writer, &loop) < 0) {
+        goto cleanup;
+    }
+    writer_started = 1;
+
+    if (rate_limiter_init(&ctx.account_limit, settings_get()->rate_limit_account,
+                          settings_get()->rate_limit_account_burst) < 0) {
+        log_error("Out of memory creating rate limiters");
+        goto cleanup;
+    }
+    if (rate_limiter_init(&ctx.domain_limit, settings_get()->rate_limit_domain,
+                          settings_get()->rate_limit_domain_burst) < 0) {
+        log_error("Out of memory creating rate limiters");
+        rate_limiter_destroy(&ctx.account_limit);
+        goto cleanup;
+    }
+    limits_started = 1;
+
+    /* Claimed tickets are handed to the sender threads through the ring,
+     * sized for the largest batch the setting can be raised to */
+    if (ticket_ring_init(&ctx.ring, SETTINGS_CLAIM_BATCH_MAX) < 0) {
+        log_error("Out of memory creating ticket ring");
+        goto cleanup;
+    }
+    ring_started = 1;
+
+    if (template_cache_init(&ctx.templates, TEMPLATE_CACHE_SIZE) < 0) {
+        log_error("Out of memory creating template cache");
+        goto cleanup;
+    }
+    if (smtp_share_init(&ctx.share) < 0) {
+        log_error("Failed to create curl share handle");
+        goto cleanup;
+    }
+    share_started = 1;
+    if (DNS_CACHE && dns_cache_init(&ctx.dns, DNS_MIN_TTL, DNS_MAX_TTL) < 0) {
+        log_warn("Failed to start DNS cache, continuing without it");
+        DNS_CACHE = 0;
+    }
+
+    srandom((unsigned)time(NULL) ^ (unsigned)getpid());
+    ctx.kick = event_loop_notifier_new(&loop, on_kick, &ctx);
+    ctx.resume_timer = event_loop_timer_new(&loop, on_resume_timer, &ctx);
+    ctx.drain_timer = event_loop_timer_new(&loop, on_drain_timer, &ctx);
+    ctx.workers = calloc(SENDER_THREADS, sizeof(*ctx.workers));
+    if (!ctx.kick || !ctx.resume_timer || !ctx.drain_timer || !ctx.workers ||
+        db_connector_init(&ctx.connector, &loop, DB_CONNINFO, on_db_connected, &ctx) < 0) {
+        log_error("Failed to set up sender threads");
+        goto cleanup;
+    }
+
+    /* Every sender thread gets its own SMTP sessions and status connection */
+    for (; workers_ready < SENDER_THREADS; workers_ready++) {
+        if (worker_init(&ctx.workers[workers_ready], &ctx, workers_ready) < 0) {
+            goto cleanup;
         }
     }
-    PQclear(res);
+    ctx.worker_count = workers_ready;
+    log_info("Started %d sender thread(s) with %d SMTP relay(s) each",
+           workers_ready, ctx.workers[0].relays.count);
 
-    /* Main event loop: wait for and process notifications */
-    while (1) {
-        PGnotify *notify;
+    log_info("Email sender started. Waiting for new tickets...");
 
-        /* Check for notifications */
-        PQconsumeInput(conn);
+    /* Take back tickets this worker leased before a restart, then pick up
+     * everything unclaimed in batches. Other replicas' tickets are left
+     * alone until their leases expire. */
+    released = ticket_db_release_leases(conn, WORKER_ID);
+    if (released > 0) {
+        log_info("Released %d ticket(s) leased by a previous run", released);
+    }
+    ctx.work_pending = ALL_LANES;
+    dispatch_tickets(&ctx);
 
-        /* Process any received notifications */
-        while ((notify = PQnotifies(conn)) != NULL) {
-            printf("Received notification for ticket ID: %s\n", notify->extra);
-            int ticket_id = atoi(notify->extra);
-            process_ticket(conn, ticket_id);
-            PQfreemem(notify);
+    for (; threads_started < ctx.worker_count; threads_started++) {
+        struct sender_worker *w = &ctx.workers[threads_started];
+
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            log_error("Failed to start sender thread %d", threads_started);
+            goto cleanup;
+        }
+    }
+
+    /* Drain and exit cleanly when the container is stopped */
+    signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd >= 0) {
+        signal_watcher = event_loop_add_fd(&loop, signal_fd, EPOLLIN, on_signal, &ctx);
+    }
+    if (!signal_watcher) {
+        log_error("Failed to watch for termination signals");
+        goto cleanup;
+    }
+
+    /* Wake up as soon as the server sends anything (i.e. a NOTIFY) */
+    ctx.db_watcher = event_loop_add_fd(&loop, PQsocket(conn), EPOLLIN, on_db_readable, &ctx);
+    if (!ctx.db_watcher) {
+        goto cleanup;
+    }
+
+    /* Optional periodic sweep for tickets whose notification was missed */
+    if (SWEEP_INTERVAL > 0) {
+        sweep_timer = event_loop_timer_new(&loop, on_sweep_timer, &ctx);
+        if (!sweep_timer ||
+            event_loop_timer_arm(sweep_timer, SWEEP_INTERVAL * 1000L, SWEEP_INTERVAL * 1000L) < 0) {
+            log_warn("Failed to start sweep timer, continuing without it");
         }
+    }
 
-        /* Sleep to avoid excessive CPU usage
-         * Check every second */
-        sleep(1);
+    /* Renew leases well before they expire, reclaiming abandoned ones */
+    lease_timer = event_loop_timer_new(&loop, on_lease_timer, &ctx);
+    if (!lease_timer ||
+        event_loop_timer_arm(lease_timer, LEASE_SECONDS * 1000L / 3, LEASE_SECONDS * 1000L / 3) < 0) {
+        log_error("Failed to start lease timer");
+        goto cleanup;
     }
 
-    /* Cleanup resources (never reached in current implementation) */
-    PQfinish(conn);
+    /* Retire old completed tickets in the background; the first run starts
+     * shortly after startup */
+    if (RETENTION_DAYS > 0) {
+        ctx.retention_timer = event_loop_timer_new(&loop, on_retention_timer, &ctx);
+        if (!ctx.retention_timer ||
+            event_loop_timer_arm(ctx.retention_timer, RETENTION_BATCH_DELAY_MS, 0) < 0) {
+            log_warn("Failed to start retention timer, continuing without it");
+        }
+    }
+
+    /* Serve /metrics; the sender works without it */
+    if (METRICS_PORT > 0) {
+        if (metrics_server_init(&metrics, &loop, METRICS_ADDRESS, METRICS_PORT, NULL, NULL) == 0) {
+            metrics_started = 1;
+
+            /* Sample the queue depth on a timer, not on each scrape */
+            depth_timer = event_loop_timer_new(&loop, on_queue_depth_timer, &ctx);
+            if (!depth_timer || event_loop_timer_arm(depth_timer, 0, QUEUE_DEPTH_INTERVAL_MS) < 0) {
+                log_warn("Failed to start queue depth timer, continuing without it");
+            }
+        } else {
+            log_warn("Failed to start metrics server on port %d, continuing without it",
+                    METRICS_PORT);
+        }
+    }
+
+    /* Inspect and change the live settings; likewise optional */
+    if (*ADMIN_SOCKET) {
+        if (admin_server_init(&admin, &loop, ADMIN_SOCKET, publish_settings, reload_settings,
+                              &ctx) == 0) {
+            admin_started = 1;
+        } else {
+            log_warn("Failed to start admin socket %s, continuing without it", ADMIN_SOCKET);
+        }
+    }
+
+    /* Main event loop: block until a notification or timer is ready.
+     * It returns after a shutdown signal or when a sender thread is lost;
+     * a lost database connection is replaced in the background. */
+    if (event_loop_run(&loop) == 0 && !atomic_load(&ctx.worker_failed)) {
+        exit_code = 0;
+    }
+
+cleanup:
+    /* Stop the sender threads before tearing down what they share */
+    atomic_store(&ctx.stopping, 1);
+    for (int i = 0; i < threads_started; i++) {
+        event_loop_notify(ctx.workers[i].wake);
+        pthread_join(ctx.workers[i].thread, NULL);
+    }
+    for (int i = 0; i < workers_ready; i++) {
+        worker_destroy(&ctx.workers[i]);
+    }
+    free(ctx.workers);
+
+    /* Hand back whatever was claimed but not sent (queued, waiting for a
+     * retry or still in the ring) instead of waiting for leases to expire */
+    if (atomic_load(&ctx.draining) && db_check(&ctx)) {
+        released = ticket_db_release_leases(ctx.conn, WORKER_ID);
+        if (released >= 0) {
+            log_info("Released %d unsent ticket(s)", released);
+        }
+    }
+
+    /* Cleanup resources */
+    if (metrics_started) {
+        metrics_server_destroy(&metrics);
+    }
+    if (admin_started) {
+        admin_server_destroy(&admin);
+    }
+    event_loop_timer_free(&loop, depth_timer);
+    event_loop_timer_free(&loop, ctx.retention_timer);
+    event_loop_timer_free(&loop, lease_timer);
+    event_loop_timer_free(&loop, sweep_timer);
+    if (ctx.db_watcher) {
+        event_loop_del_fd(&loop, ctx.db_watcher);
+    }
+    db_connector_destroy(&ctx.connector);
+    if (signal_watcher) {
+        event_loop_del_fd(&loop, signal_watcher);
+    }
+    if (signal_fd >= 0) {
+        close(signal_fd);
+    }
+    event_loop_timer_free(&loop, ctx.drain_timer);
+    event_loop_timer_free(&loop, ctx.resume_timer);
+    event_loop_notifier_free(&loop, ctx.kick);
+    while (ctx.notified_head) {
+        struct ticket *next = ctx.notified_head->next;
+        ticket_free(ctx.notified_head);
+        ctx.notified_head = next;
+    }
+    if (ring_started) {
+        ticket_ring_destroy(&ctx.ring);
+    }
+    template_cache_destroy(&ctx.templates);
+    dns_cache_destroy(&ctx.dns);
+    if (share_started) {
+        smtp_share_destroy(&ctx.share);
+    }
+    if (limits_started) {
+        rate_limiter_destroy(&ctx.account_limit);
+        rate_limiter_destroy(&ctx.domain_limit);
+    }
+    if (writer_started) {
+        status_writer_destroy(&writer);
+    }
+    event_loop_destroy(&loop);
+    PQfinish(ctx.conn);
     curl_global_cleanup();
+    settings_cleanup();
 
-    return 0;
+    return exit_code;
 }
@@ -0,0 +1,100 @@
+/**
+ * email_validate.c
+ *
+ * Single-pass address validator declared in email_validate.h.
+ */
+
+#include "email_validate.h"
+
+#include <stddef.h>
+
+/* Length of the tickets.email column */
+#define MAX_EMAIL_LENGTH 255
+
+static int is_alpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static int is_alnum(char c) {
+    return is_alpha(c) || (c >= '0' && c <= '9');
+}
+
+/* [A-Za-z0-9._%+-] */
+static int is_local_char(char c) {
+    return is_alnum(c) || c == '.' || c == '_' || c == '%' || c == '+' || c == '-';
+}
+
+/* [A-Za-z0-9.-] */
+static int is_domain_char(char c) {
+    return is_alnum(c) || c == '.' || c == '-';
+}
+
+enum email_verdict email_validate(const char *email) {
+    const char *p = email;
+    const char *domain;
+    const char *last_dot = NULL;
+    int tld_letters = 1;          /* Every character after last_dot is a letter */
+
+    if (!email || *email == '\0') {
+        return EMAIL_EMPTY;
+    }
+
+    /* Local part */
+    while (*p && *p != '@') {
+        if (!is_local_char(*p)) {
+            return EMAIL_BAD_LOCAL_CHAR;
+        }
+        p++;
+    }
+    if (*p != '@') {
+        return EMAIL_NO_AT;
+    }
+    if (p == email) {
+        return EMAIL_EMPTY_LOCAL;
+    }
+    domain = ++p;
+
+    /* Domain: the TLD is whatever follows the last dot, since a dot can't
+     * appear in it */
+    for (; *p; p++) {
+        if (!is_domain_char(*p)) {
+            return EMAIL_BAD_DOMAIN_CHAR;
+        }
+        if (*p == '.') {
+            last_dot = p;
+            tld_letters = 1;
+        } else if (!is_alpha(*p)) {
+            tld_letters = 0;
+        }
+    }
+
+    if (p - email > MAX_EMAIL_LENGTH) {
+        return EMAIL_TOO_LONG;
+    }
+    if (!last_dot) {
+        return EMAIL_NO_DOT;
+    }
+    if (last_dot == domain) {
+        return EMAIL_EMPTY_DOMAIN;
+    }
+    if (!tld_letters || p - last_dot - 1 < 2) {
+        return EMAIL_BAD_TLD;
+    }
+    return EMAIL_VALID;
+}
+
+const char *email_verdict_str(enum email_verdict verdict) {
+    switch (verdict) {
+    case EMAIL_VALID:           return "valid";
+    case EMAIL_EMPTY:           return "empty address";
+    case EMAIL_TOO_LONG:        return "address too long";
+    case EMAIL_NO_AT:           return "missing '@'";
+    case EMAIL_EMPTY_LOCAL:     return "empty local part";
+    case EMAIL_BAD_LOCAL_CHAR:  return "invalid character in local part";
+    case EMAIL_BAD_DOMAIN_CHAR: return "invalid character in domain";
+    case EMAIL_NO_DOT:          return "domain has no '.'";
+    case EMAIL_EMPTY_DOMAIN:    return "empty domain name";
+    case EMAIL_BAD_TLD:         return "top-level domain must be two or more letters";
+    }
+    return "unknown";
+}
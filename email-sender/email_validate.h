@@ -0,0 +1,46 @@
+/**
+ * email_validate.h
+ *
+ * Recipient address validation. Accepts exactly the addresses matched by
+ *
+ *     ^[A-Za-z0-9._%+-]+@[A-Za-z0-9.-]+\.[A-Za-z]{2,}$
+ *
+ * (the pattern the tickets table's CHECK constraint is based on) with a
+ * hand-written single pass over the string, so there is nothing to
+ * compile and no allocation per address.
+ */
+
+#ifndef EMAIL_VALIDATE_H
+#define EMAIL_VALIDATE_H
+
+/* Result of validating an address: EMAIL_VALID or why it was rejected */
+enum email_verdict {
+    EMAIL_VALID,
+    EMAIL_EMPTY,               /* Empty string */
+    EMAIL_TOO_LONG,            /* Longer than the email column allows */
+    EMAIL_NO_AT,               /* No '@' separator */
+    EMAIL_EMPTY_LOCAL,         /* Nothing before the '@' */
+    EMAIL_BAD_LOCAL_CHAR,      /* Character not allowed before the '@' */
+    EMAIL_BAD_DOMAIN_CHAR,     /* Character (including a second '@') not allowed in the domain */
+    EMAIL_NO_DOT,              /* Domain has no '.' */
+    EMAIL_EMPTY_DOMAIN,        /* Nothing between the '@' and the last '.' */
+    EMAIL_BAD_TLD              /* Top-level domain is not two or more letters */
+};
+
+/**
+ * Validates an email address.
+ *
+ * @param email The email address to validate
+ * @return      EMAIL_VALID, or the reason the address was rejected
+ */
+enum email_verdict email_validate(const char *email);
+
+/**
+ * Describes a verdict for log messages.
+ *
+ * @param verdict Result of email_validate()
+ * @return        Static, human-readable description
+ */
+const char *email_verdict_str(enum email_verdict verdict);
+
+#endif /* EMAIL_VALIDATE_H */
@@ -0,0 +1,280 @@
+/**
+ * event_loop.c
+ *
+ * epoll/timerfd/eventfd implementation of the reactor declared in event_loop.h.
+ */
+
+#include "event_loop.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define MAX_EVENTS 64             /* Events fetched per epoll_wait() call */
+
+struct io_watcher {
+    int fd;
+    io_callback cb;
+    void *arg;
+    int active;                   /* Cleared when removed during dispatch */
+    struct io_watcher *next_dead; /* Link in the loop's graveyard */
+};
+
+struct loop_timer {
+    int fd;                       /* timerfd backing this timer */
+    struct io_watcher *watcher;
+    timer_callback cb;
+    void *arg;
+};
+
+struct loop_notifier {
+    int fd;                       /* eventfd backing this notifier */
+    struct io_watcher *watcher;
+    notify_callback cb;
+    void *arg;
+};
+
+int event_loop_init(struct event_loop *loop) {
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        log_error("epoll_create1() failed: %s", strerror(errno));
+        return -1;
+    }
+    loop->running = 0;
+    loop->graveyard = NULL;
+    return 0;
+}
+
+/**
+ * Frees watchers that were removed while events might still have been
+ * pending for them in the current epoll_wait() batch.
+ */
+static void bury_dead_watchers(struct event_loop *loop) {
+    while (loop->graveyard) {
+        struct io_watcher *w = loop->graveyard;
+        loop->graveyard = w->next_dead;
+        free(w);
+    }
+}
+
+void event_loop_destroy(struct event_loop *loop) {
+    bury_dead_watchers(loop);
+    if (loop->epfd >= 0) {
+        close(loop->epfd);
+        loop->epfd = -1;
+    }
+}
+
+struct io_watcher *event_loop_add_fd(struct event_loop *loop, int fd, uint32_t events,
+                                     io_callback cb, void *arg) {
+    struct io_watcher *w = calloc(1, sizeof(*w));
+    if (!w) {
+        return NULL;
+    }
+    w->fd = fd;
+    w->cb = cb;
+    w->arg = arg;
+    w->active = 1;
+
+    struct epoll_event ev = { .events = events, .data.ptr = w };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_error("epoll_ctl(ADD, %d) failed: %s", fd, strerror(errno));
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+int event_loop_mod_fd(struct event_loop *loop, struct io_watcher *w, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = w };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, w->fd, &ev) < 0) {
+        log_error("epoll_ctl(MOD, %d) failed: %s", w->fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void event_loop_del_fd(struct event_loop *loop, struct io_watcher *w) {
+    if (!w) {
+        return;
+    }
+    /* The descriptor may already be closed, in which case epoll dropped it */
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+    w->active = 0;
+    w->next_dead = loop->graveyard;
+    loop->graveyard = w;
+}
+
+/**
+ * Drains a timerfd and forwards the expiry to the timer's callback.
+ */
+static void on_timer_ready(struct event_loop *loop, int fd, uint32_t events, void *arg) {
+    struct loop_timer *timer = arg;
+    uint64_t expirations;
+
+    (void)events;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return; /* Spurious wakeup or timer re-armed in the meantime */
+    }
+    timer->cb(loop, timer, timer->arg);
+}
+
+struct loop_timer *event_loop_timer_new(struct event_loop *loop, timer_callback cb, void *arg) {
+    struct loop_timer *timer = calloc(1, sizeof(*timer));
+    if (!timer) {
+        return NULL;
+    }
+    timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer->fd < 0) {
+        log_error("timerfd_create() failed: %s", strerror(errno));
+        free(timer);
+        return NULL;
+    }
+    timer->cb = cb;
+    timer->arg = arg;
+    timer->watcher = event_loop_add_fd(loop, timer->fd, EPOLLIN, on_timer_ready, timer);
+    if (!timer->watcher) {
+        close(timer->fd);
+        free(timer);
+        return NULL;
+    }
+    return timer;
+}
+
+int event_loop_timer_arm(struct loop_timer *timer, long delay_ms, long interval_ms) {
+    struct itimerspec spec;
+
+    /* An all-zero it_value disarms a timerfd, so "now" is rounded up to 1 ns */
+    if (delay_ms <= 0) {
+        spec.it_value.tv_sec = 0;
+        spec.it_value.tv_nsec = 1;
+    } else {
+        spec.it_value.tv_sec = delay_ms / 1000;
+        spec.it_value.tv_nsec = (delay_ms % 1000) * 1000000L;
+    }
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+
+    if (timerfd_settime(timer->fd, 0, &spec, NULL) < 0) {
+        log_error("timerfd_settime() failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void event_loop_timer_disarm(struct loop_timer *timer) {
+    struct itimerspec spec;
+
+    memset(&spec, 0, sizeof(spec));
+    timerfd_settime(timer->fd, 0, &spec, NULL);
+}
+
+void event_loop_timer_free(struct event_loop *loop, struct loop_timer *timer) {
+    if (!timer) {
+        return;
+    }
+    event_loop_del_fd(loop, timer->watcher);
+    close(timer->fd);
+    free(timer);
+}
+
+/**
+ * Drains an eventfd and forwards the notifications to the callback.
+ */
+static void on_notifier_ready(struct event_loop *loop, int fd, uint32_t events, void *arg) {
+    struct loop_notifier *notifier = arg;
+    uint64_t count;
+
+    (void)events;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return; /* Another wakeup already drained it */
+    }
+    notifier->cb(loop, notifier, notifier->arg);
+}
+
+struct loop_notifier *event_loop_notifier_new(struct event_loop *loop, notify_callback cb,
+                                              void *arg) {
+    struct loop_notifier *notifier = calloc(1, sizeof(*notifier));
+    if (!notifier) {
+        return NULL;
+    }
+    notifier->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notifier->fd < 0) {
+        log_error("eventfd() failed: %s", strerror(errno));
+        free(notifier);
+        return NULL;
+    }
+    notifier->cb = cb;
+    notifier->arg = arg;
+    notifier->watcher = event_loop_add_fd(loop, notifier->fd, EPOLLIN, on_notifier_ready, notifier);
+    if (!notifier->watcher) {
+        close(notifier->fd);
+        free(notifier);
+        return NULL;
+    }
+    return notifier;
+}
+
+void event_loop_notify(struct loop_notifier *notifier) {
+    uint64_t one = 1;
+
+    /* Only fails when the counter is saturated, i.e. already signalled */
+    if (write(notifier->fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_error("eventfd write failed: %s", strerror(errno));
+    }
+}
+
+void event_loop_notifier_free(struct event_loop *loop, struct loop_notifier *notifier) {
+    if (!notifier) {
+        return;
+    }
+    event_loop_del_fd(loop, notifier->watcher);
+    close(notifier->fd);
+    free(notifier);
+}
+
+int event_loop_run_once(struct event_loop *loop, int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n;
+
+    n = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        log_error("epoll_wait() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct io_watcher *w = events[i].data.ptr;
+
+        /* Skip watchers removed by an earlier callback in this batch */
+        if (w->active) {
+            w->cb(loop, w->fd, events[i].events, w->arg);
+        }
+    }
+
+    bury_dead_watchers(loop);
+    return n;
+}
+
+int event_loop_run(struct event_loop *loop) {
+    loop->running = 1;
+    while (loop->running) {
+        if (event_loop_run_once(loop, -1) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void event_loop_stop(struct event_loop *loop) {
+    loop->running = 0;
+}
@@ -0,0 +1,173 @@
+/**
+ * event_loop.h
+ *
+ * A minimal epoll based reactor used by the email sender. File descriptors
+ * (such as the libpq socket), timers (backed by timerfd) and notifiers
+ * (backed by eventfd, for waking a loop from another thread) are
+ * registered with a callback, and the loop blocks until one of them
+ * becomes ready. A loop and everything registered on it belong to the
+ * thread running it; only event_loop_notify() may be called elsewhere.
+ */
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+struct event_loop;
+struct io_watcher;
+struct loop_timer;
+struct loop_notifier;
+
+/* Called when a watched file descriptor becomes ready (events are EPOLL* flags) */
+typedef void (*io_callback)(struct event_loop *loop, int fd, uint32_t events, void *arg);
+
+/* Called when a timer expires */
+typedef void (*timer_callback)(struct event_loop *loop, struct loop_timer *timer, void *arg);
+
+/* Called on the loop's thread after one or more event_loop_notify() calls */
+typedef void (*notify_callback)(struct event_loop *loop, struct loop_notifier *notifier,
+                                void *arg);
+
+struct event_loop {
+    int epfd;                      /* epoll instance */
+    int running;                   /* Cleared by event_loop_stop() */
+    struct io_watcher *graveyard;  /* Watchers removed during dispatch, freed afterwards */
+};
+
+/**
+ * Initializes an event loop.
+ *
+ * @param loop Loop to initialize
+ * @return     0 on success, -1 on failure
+ */
+int event_loop_init(struct event_loop *loop);
+
+/**
+ * Releases the resources held by an event loop. All watchers and timers
+ * must have been removed beforehand.
+ *
+ * @param loop Loop to destroy
+ */
+void event_loop_destroy(struct event_loop *loop);
+
+/**
+ * Starts watching a file descriptor.
+ *
+ * @param loop   Event loop
+ * @param fd     File descriptor to watch
+ * @param events EPOLLIN / EPOLLOUT mask
+ * @param cb     Callback invoked when the descriptor is ready
+ * @param arg    Opaque pointer passed to the callback
+ * @return       Watcher handle, or NULL on failure
+ */
+struct io_watcher *event_loop_add_fd(struct event_loop *loop, int fd, uint32_t events,
+                                     io_callback cb, void *arg);
+
+/**
+ * Changes the set of events a watcher is interested in.
+ *
+ * @param loop   Event loop
+ * @param w      Watcher returned by event_loop_add_fd()
+ * @param events New EPOLLIN / EPOLLOUT mask
+ * @return       0 on success, -1 on failure
+ */
+int event_loop_mod_fd(struct event_loop *loop, struct io_watcher *w, uint32_t events);
+
+/**
+ * Stops watching a file descriptor. Safe to call from inside a callback.
+ * The descriptor itself is not closed.
+ *
+ * @param loop Event loop
+ * @param w    Watcher returned by event_loop_add_fd()
+ */
+void event_loop_del_fd(struct event_loop *loop, struct io_watcher *w);
+
+/**
+ * Creates a (disarmed) timer.
+ *
+ * @param loop Event loop
+ * @param cb   Callback invoked on expiry
+ * @param arg  Opaque pointer passed to the callback
+ * @return     Timer handle, or NULL on failure
+ */
+struct loop_timer *event_loop_timer_new(struct event_loop *loop, timer_callback cb, void *arg);
+
+/**
+ * Arms a timer. A delay of 0 ms fires on the next loop iteration.
+ *
+ * @param timer       Timer to arm
+ * @param delay_ms    Time until the first expiry
+ * @param interval_ms Period for subsequent expiries, or 0 for a one-shot timer
+ * @return            0 on success, -1 on failure
+ */
+int event_loop_timer_arm(struct loop_timer *timer, long delay_ms, long interval_ms);
+
+/**
+ * Disarms a timer without destroying it.
+ *
+ * @param timer Timer to disarm
+ */
+void event_loop_timer_disarm(struct loop_timer *timer);
+
+/**
+ * Destroys a timer. Safe to call from inside a callback.
+ *
+ * @param loop  Event loop
+ * @param timer Timer to destroy
+ */
+void event_loop_timer_free(struct event_loop *loop, struct loop_timer *timer);
+
+/**
+ * Creates a notifier, through which other threads wake the loop.
+ *
+ * @param loop Event loop
+ * @param cb   Callback invoked on the loop's thread once notified
+ * @param arg  Opaque pointer passed to the callback
+ * @return     Notifier handle, or NULL on failure
+ */
+struct loop_notifier *event_loop_notifier_new(struct event_loop *loop, notify_callback cb,
+                                              void *arg);
+
+/**
+ * Wakes the notifier's loop. Safe to call from any thread; notifications
+ * made before the callback runs are coalesced into one call.
+ *
+ * @param notifier Notifier to signal
+ */
+void event_loop_notify(struct loop_notifier *notifier);
+
+/**
+ * Destroys a notifier. No other thread may still be notifying it.
+ *
+ * @param loop     Event loop
+ * @param notifier Notifier to destroy
+ */
+void event_loop_notifier_free(struct event_loop *loop, struct loop_notifier *notifier);
+
+/**
+ * Waits for events and dispatches them once.
+ *
+ * @param loop       Event loop
+ * @param timeout_ms Maximum time to block, or -1 to block indefinitely
+ * @return           Number of events dispatched, or -1 on failure
+ */
+int event_loop_run_once(struct event_loop *loop, int timeout_ms);
+
+/**
+ * Dispatches events until event_loop_stop() is called.
+ *
+ * @param loop Event loop
+ * @return     0 when stopped normally, -1 on failure
+ */
+int event_loop_run(struct event_loop *loop);
+
+/**
+ * Makes event_loop_run() return after the current iteration.
+ *
+ * @param loop Event loop
+ */
+void event_loop_stop(struct event_loop *loop);
+
+#endif /* EVENT_LOOP_H */
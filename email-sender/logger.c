@@ -0,0 +1,262 @@
+/**
+ * logger.c
+ *
+ * Asynchronous logger declared in logger.h. The ring is the same
+ * sequence-tagged design as the ticket ring, with many producers and the
+ * writer thread as its only consumer; messages are formatted straight
+ * into the slot a producer claimed.
+ */
+
+#include "logger.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_RING_SIZE 4096        /* Records queued at most (a power of two) */
+#define LOG_TEXT_MAX 480          /* Longest message kept; longer ones are cut */
+#define LOG_IDLE_SLEEP_MS 5       /* Writer's nap when the ring is empty */
+
+struct log_record {
+    atomic_size_t seq;
+    enum log_level level;
+    int thread;                   /* Small per-thread number, in order of first use */
+    struct timespec time;
+    char text[LOG_TEXT_MAX];
+};
+
+_Atomic enum log_level logger_level = LOG_INFO;
+
+static struct log_record *records;
+static _Alignas(64) atomic_size_t tail;  /* Next position to claim */
+static _Alignas(64) size_t head;         /* Next position to write (writer thread only) */
+static atomic_ulong dropped;
+static atomic_int threads;
+static _Thread_local int thread_number;
+static int json;
+static atomic_int running;               /* The writer thread owns the output */
+static atomic_int stopping;
+static pthread_t writer;
+
+static const char *const level_names[] = { "debug", "info", "warn", "error" };
+
+static int current_thread(void) {
+    if (thread_number == 0) {
+        thread_number = atomic_fetch_add(&threads, 1) + 1;
+    }
+    return thread_number;
+}
+
+/**
+ * Appends text to a JSON string being built, escaping as needed.
+ */
+static size_t json_escape(char *out, size_t size, size_t len, const char *text) {
+    for (const unsigned char *p = (const unsigned char *)text; *p && len + 7 < size; p++) {
+        switch (*p) {
+        case '"':  len += sprintf(out + len, "\\\""); break;
+        case '\\': len += sprintf(out + len, "\\\\"); break;
+        case '\n': len += sprintf(out + len, "\\n"); break;
+        case '\r': len += sprintf(out + len, "\\r"); break;
+        case '\t': len += sprintf(out + len, "\\t"); break;
+        default:
+            if (*p < 0x20) {
+                len += sprintf(out + len, "\\u%04x", *p);
+            } else {
+                out[len++] = (char)*p;
+            }
+        }
+    }
+    return len;
+}
+
+/**
+ * Renders one record as a line and writes it (to stderr for warnings and
+ * errors in text mode, so the split matches what plain output used).
+ */
+static void emit(enum log_level level, int thread, const struct timespec *time, char *text) {
+    char line[LOG_TEXT_MAX * 2 + 128];
+    char stamp[32];
+    struct tm tm;
+    size_t len = strlen(text);
+
+    while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) {
+        text[--len] = '\0';
+    }
+    gmtime_r(&time->tv_sec, &tm);
+    len = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(stamp + len, sizeof(stamp) - len, ".%03ldZ", time->tv_nsec / 1000000);
+
+    if (json) {
+        len = snprintf(line, sizeof(line), "{\"time\":\"%s\",\"level\":\"%s\",\"thread\":%d,\"msg\":\"",
+                       stamp, level_names[level], thread);
+        len = json_escape(line, sizeof(line), len, text);
+        len += snprintf(line + len, sizeof(line) - len, "\"}\n");
+        fwrite(line, 1, len, stdout);
+    } else {
+        fprintf(level >= LOG_WARN ? stderr : stdout, "%s %-5s [%d] %s\n", stamp,
+                level_names[level], thread, text);
+    }
+}
+
+static void report_dropped(void) {
+    unsigned long n = atomic_exchange(&dropped, 0);
+    struct timespec now;
+    char text[64];
+
+    if (n > 0) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        snprintf(text, sizeof(text), "Log ring full, dropped %lu record(s)", n);
+        emit(LOG_WARN, 0, &now, text);
+    }
+}
+
+/**
+ * Writes out every record published so far.
+ *
+ * @return Number of records written
+ */
+static int drain(void) {
+    int written = 0;
+
+    for (;;) {
+        struct log_record *r = &records[head & (LOG_RING_SIZE - 1)];
+
+        if (atomic_load_explicit(&r->seq, memory_order_acquire) != head + 1) {
+            break;
+        }
+        emit(r->level, r->thread, &r->time, r->text);
+        atomic_store_explicit(&r->seq, head + LOG_RING_SIZE, memory_order_release);
+        head++;
+        written++;
+    }
+    report_dropped();
+    if (written > 0) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return written;
+}
+
+static void *writer_main(void *arg) {
+    struct timespec nap = { 0, LOG_IDLE_SLEEP_MS * 1000000L };
+
+    (void)arg;
+    while (!atomic_load(&stopping)) {
+        if (drain() == 0) {
+            nanosleep(&nap, NULL);
+        }
+    }
+    drain();
+    return NULL;
+}
+
+int logger_parse_level(const char *name) {
+    for (int i = LOG_DEBUG; i <= LOG_ERROR; i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *logger_level_name(enum log_level level) {
+    return level_names[level];
+}
+
+void logger_set_level(enum log_level level) {
+    atomic_store(&logger_level, level);
+}
+
+int logger_init(const char *level, const char *format) {
+    sigset_t all, old;
+    int rc;
+
+    if (level && logger_parse_level(level) >= 0) {
+        logger_level = (enum log_level)logger_parse_level(level);
+    }
+    json = format && strcmp(format, "json") == 0;
+
+    records = calloc(LOG_RING_SIZE, sizeof(*records));
+    if (!records) {
+        return -1;
+    }
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&records[i].seq, i);
+    }
+
+    /* The writer never handles signals; they stay with the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    rc = pthread_create(&writer, NULL, writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        free(records);
+        records = NULL;
+        return -1;
+    }
+    atomic_store(&running, 1);
+    atexit(logger_shutdown);
+    return 0;
+}
+
+void logger_shutdown(void) {
+    if (atomic_exchange(&running, 0)) {
+        atomic_store(&stopping, 1);
+        pthread_join(writer, NULL);
+    }
+}
+
+void logger_write(enum log_level level, const char *fmt, ...) {
+    struct log_record *r;
+    va_list ap;
+    size_t pos;
+
+    if (!atomic_load_explicit(&running, memory_order_acquire)) {
+        char text[LOG_TEXT_MAX];
+        struct timespec now;
+
+        /* Before logger_init() or after shutdown: write it synchronously */
+        clock_gettime(CLOCK_REALTIME, &now);
+        va_start(ap, fmt);
+        vsnprintf(text, sizeof(text), fmt, ap);
+        va_end(ap);
+        emit(level, current_thread(), &now, text);
+        fflush(level >= LOG_WARN ? stderr : stdout);
+        return;
+    }
+
+    /* Claim a free slot; a full ring drops the record */
+    pos = atomic_load_explicit(&tail, memory_order_relaxed);
+    for (;;) {
+        r = &records[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add(&dropped, 1);
+            return;
+        } else {
+            pos = atomic_load_explicit(&tail, memory_order_relaxed);
+        }
+    }
+
+    r->level = level;
+    r->thread = current_thread();
+    clock_gettime(CLOCK_REALTIME, &r->time);
+    va_start(ap, fmt);
+    vsnprintf(r->text, sizeof(r->text), fmt, ap);
+    va_end(ap);
+    atomic_store_explicit(&r->seq, pos + 1, memory_order_release);
+}
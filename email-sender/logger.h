@@ -0,0 +1,93 @@
+/**
+ * logger.h
+ *
+ * Leveled, asynchronous logging. A log call only formats its message into
+ * a slot of a bounded lock-free ring; a background thread timestamps,
+ * renders (plain text or one JSON object per line) and writes the records,
+ * so no thread ever waits on log I/O. Should the ring be full the record
+ * is dropped and counted rather than blocking the caller.
+ *
+ * Messages below the configured level cost a single comparison: the
+ * macros check the level before evaluating any argument. A trailing
+ * newline (as in libpq error messages) is stripped.
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdatomic.h>
+
+enum log_level {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR
+};
+
+/* Records below this level are discarded (set by logger_init(), may
+ * change at any time through logger_set_level()) */
+extern _Atomic enum log_level logger_level;
+
+/**
+ * Configures the logger and starts its writer thread. Call it first in
+ * main(), before any other thread exists; the records still queued are
+ * written out at exit.
+ *
+ * @param level  "debug", "info", "warn" or "error" (NULL or empty: "info")
+ * @param format "text" or "json" (NULL or empty: "text")
+ * @return       0 on success, -1 if the writer thread could not be started
+ *               (records are then written synchronously)
+ */
+int logger_init(const char *level, const char *format);
+
+/**
+ * Parses a level name.
+ *
+ * @param name "debug", "info", "warn" or "error"
+ * @return     The level, or -1 if name is none of those
+ */
+int logger_parse_level(const char *name);
+
+/**
+ * Names a level.
+ *
+ * @param level Level to name
+ * @return      "debug", "info", "warn" or "error"
+ */
+const char *logger_level_name(enum log_level level);
+
+/**
+ * Changes the level while the logger runs. Safe from any thread.
+ *
+ * @param level New level
+ */
+void logger_set_level(enum log_level level);
+
+/**
+ * Writes out every queued record and stops the writer thread. Called at
+ * exit; later records are written synchronously.
+ */
+void logger_shutdown(void);
+
+/**
+ * Queues a record regardless of logger_level. Safe from any thread.
+ *
+ * @param level Severity recorded with the message
+ * @param fmt   printf-style format
+ */
+void logger_write(enum log_level level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#define LOG_AT(level, ...) \
+    do { \
+        if ((level) >= logger_level) { \
+            logger_write((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define log_debug(...) LOG_AT(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...)  LOG_AT(LOG_INFO, __VA_ARGS__)
+#define log_warn(...)  LOG_AT(LOG_WARN, __VA_ARGS__)
+#define log_error(...) LOG_AT(LOG_ERROR, __VA_ARGS__)
+
+#endif /* LOGGER_H */
@@ -0,0 +1,133 @@
+/**
+ * metrics.c
+ *
+ * Lock-free metric storage declared in metrics.h.
+ */
+
+#include "metrics.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define NUM_BUCKETS 14
+
+/* Upper bounds in microseconds, from 1 ms to 30 s */
+static const uint64_t bucket_bounds[NUM_BUCKETS] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000,
+    250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000
+};
+
+struct histogram {
+    _Atomic uint64_t buckets[NUM_BUCKETS + 1];   /* Per bucket, last one is +Inf */
+    _Atomic uint64_t sum_usec;
+};
+
+static const struct metric_info {
+    const char *name;
+    const char *help;
+} counter_info[METRIC_COUNTER_COUNT] = {
+    [METRIC_CLAIMED] = { "email_sender_tickets_claimed_total", "Tickets claimed from the database" },
+    [METRIC_SENT]    = { "email_sender_emails_sent_total", "Emails accepted by the SMTP server" },
+    [METRIC_FAILED]  = { "email_sender_emails_failed_total", "Delivery attempts that failed" },
+    [METRIC_INVALID] = { "email_sender_tickets_invalid_total", "Tickets rejected by address or params validation" },
+    [METRIC_RETIRED] =
+        { "email_sender_tickets_retired_total", "Completed tickets archived or deleted by retention" },
+    [METRIC_PARTITIONS_DROPPED] =
+        { "email_sender_partitions_dropped_total", "Expired ticket partitions dropped by retention" },
+    [METRIC_DB_RECONNECTS] =
+        { "email_sender_db_reconnects_total", "Database connections re-established after being lost" },
+    [METRIC_TEMPLATE_LOADS] =
+        { "email_sender_template_loads_total", "Templates fetched from the database (cache misses)" },
+    [METRIC_DNS_LOOKUPS] =
+        { "email_sender_dns_lookups_total", "Relay host lookups made by the DNS cache" },
+    [METRIC_RESENDS_SUPPRESSED] =
+        { "email_sender_resends_suppressed_total",
+          "Claimed tickets not resent because an earlier attempt handed them over" },
+}, gauge_info[METRIC_GAUGE_COUNT] = {
+    [METRIC_QUEUE_DEPTH] = { "email_sender_queue_depth", "Tickets waiting in 'received'" },
+    [METRIC_IN_FLIGHT]   = { "email_sender_transfers_in_flight", "Transfers currently on an SMTP session" },
+    [METRIC_RETENTION_CURSOR] =
+        { "email_sender_retention_cursor", "Highest ticket id the current retention run has reached" },
+}, histogram_info[METRIC_HISTOGRAM_COUNT] = {
+    [METRIC_CLAIM_SECONDS] =
+        { "email_sender_claim_seconds", "Latency of claiming a batch of tickets" },
+    [METRIC_SMTP_CONNECT_SECONDS] =
+        { "email_sender_smtp_connect_seconds", "Time to connect and complete the TLS handshake" },
+    [METRIC_SMTP_TRANSFER_SECONDS] =
+        { "email_sender_smtp_transfer_seconds", "Duration of one message's SMTP transaction" },
+    [METRIC_DB_UPDATE_SECONDS] =
+        { "email_sender_db_update_seconds", "Latency of a ticket status update" },
+    [METRIC_RETENTION_SECONDS] =
+        { "email_sender_retention_chunk_seconds", "Latency of one retention chunk" },
+};
+
+static _Atomic uint64_t counters[METRIC_COUNTER_COUNT];
+static _Atomic int64_t gauges[METRIC_GAUGE_COUNT];
+static struct histogram histograms[METRIC_HISTOGRAM_COUNT];
+
+void metrics_add(enum metrics_counter counter, uint64_t n) {
+    atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+}
+
+void metrics_set(enum metrics_gauge gauge, int64_t value) {
+    atomic_store_explicit(&gauges[gauge], value, memory_order_relaxed);
+}
+
+void metrics_gauge_add(enum metrics_gauge gauge, int64_t delta) {
+    atomic_fetch_add_explicit(&gauges[gauge], delta, memory_order_relaxed);
+}
+
+void metrics_observe(enum metrics_histogram histogram, uint64_t usec) {
+    struct histogram *h = &histograms[histogram];
+    int i = 0;
+
+    while (i < NUM_BUCKETS && usec > bucket_bounds[i]) {
+        i++;
+    }
+    atomic_fetch_add_explicit(&h->buckets[i], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_usec, usec, memory_order_relaxed);
+}
+
+uint64_t metrics_now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void metrics_render(FILE *out) {
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %" PRIu64 "\n",
+                counter_info[i].name, counter_info[i].help, counter_info[i].name,
+                counter_info[i].name,
+                atomic_load_explicit(&counters[i], memory_order_relaxed));
+    }
+
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %" PRId64 "\n",
+                gauge_info[i].name, gauge_info[i].help, gauge_info[i].name,
+                gauge_info[i].name,
+                atomic_load_explicit(&gauges[i], memory_order_relaxed));
+    }
+
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+        const char *name = histogram_info[i].name;
+        struct histogram *h = &histograms[i];
+        uint64_t cumulative = 0;
+
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_info[i].help, name);
+
+        /* Buckets are stored individually; Prometheus wants them cumulative */
+        for (int b = 0; b < NUM_BUCKETS; b++) {
+            cumulative += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+            fprintf(out, "%s_bucket{le=\"%g\"} %" PRIu64 "\n",
+                    name, bucket_bounds[b] / 1e6, cumulative);
+        }
+        cumulative += atomic_load_explicit(&h->buckets[NUM_BUCKETS], memory_order_relaxed);
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, cumulative);
+        fprintf(out, "%s_sum %g\n", name,
+                atomic_load_explicit(&h->sum_usec, memory_order_relaxed) / 1e6);
+        fprintf(out, "%s_count %" PRIu64 "\n", name, cumulative);
+    }
+}
@@ -0,0 +1,92 @@
+/**
+ * metrics.h
+ *
+ * Process-wide counters, gauges and latency histograms, exported in the
+ * Prometheus text format by metrics_server.h. Every update is a single
+ * relaxed atomic add or store, so instrumenting the hot path takes no
+ * locks and costs next to nothing.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum metrics_counter {
+    METRIC_CLAIMED,            /* Tickets claimed from the database */
+    METRIC_SENT,               /* Emails accepted by the SMTP server */
+    METRIC_FAILED,             /* Delivery attempts that failed */
+    METRIC_INVALID,            /* Tickets rejected by address or params validation */
+    METRIC_RETIRED,            /* Completed tickets archived or deleted by retention */
+    METRIC_PARTITIONS_DROPPED, /* Expired ticket partitions dropped by retention */
+    METRIC_DB_RECONNECTS,      /* Database connections re-established after being lost */
+    METRIC_TEMPLATE_LOADS,     /* Templates fetched from the database (cache misses) */
+    METRIC_DNS_LOOKUPS,        /* Relay host lookups made by the DNS cache */
+    METRIC_RESENDS_SUPPRESSED, /* Claimed tickets not resent: an earlier attempt handed them over */
+    METRIC_COUNTER_COUNT
+};
+
+enum metrics_gauge {
+    METRIC_QUEUE_DEPTH,        /* Tickets in 'received', sampled every QUEUE_DEPTH_INTERVAL_MS */
+    METRIC_IN_FLIGHT,          /* Transfers currently on an SMTP session */
+    METRIC_RETENTION_CURSOR,   /* Highest ticket id the current retention run has reached */
+    METRIC_GAUGE_COUNT
+};
+
+enum metrics_histogram {
+    METRIC_CLAIM_SECONDS,      /* Claim query round-trip */
+    METRIC_SMTP_CONNECT_SECONDS, /* TCP connect plus TLS handshake of new connections */
+    METRIC_SMTP_TRANSFER_SECONDS, /* Whole SMTP transaction of one message */
+    METRIC_DB_UPDATE_SECONDS,  /* Status update sent until acknowledged */
+    METRIC_RETENTION_SECONDS,  /* One retention chunk */
+    METRIC_HISTOGRAM_COUNT
+};
+
+/**
+ * Adds to a counter.
+ *
+ * @param counter Counter to increment
+ * @param n       Amount to add
+ */
+void metrics_add(enum metrics_counter counter, uint64_t n);
+
+/**
+ * Sets a gauge.
+ *
+ * @param gauge Gauge to set
+ * @param value New value
+ */
+void metrics_set(enum metrics_gauge gauge, int64_t value);
+
+/**
+ * Adjusts a gauge that several threads contribute to.
+ *
+ * @param gauge Gauge to update
+ * @param delta Amount to add (negative to subtract)
+ */
+void metrics_gauge_add(enum metrics_gauge gauge, int64_t delta);
+
+/**
+ * Records one observation in a histogram.
+ *
+ * @param histogram Histogram to update
+ * @param usec      Observed duration in microseconds
+ */
+void metrics_observe(enum metrics_histogram histogram, uint64_t usec);
+
+/**
+ * Monotonic clock for timing the operations observed above.
+ *
+ * @return Microseconds since an arbitrary fixed point
+ */
+uint64_t metrics_now_usec(void);
+
+/**
+ * Writes every metric in the Prometheus text exposition format.
+ *
+ * @param out Stream to write to
+ */
+void metrics_render(FILE *out);
+
+#endif /* METRICS_H */
@@ -0,0 +1,192 @@
+/**
+ * metrics_server.c
+ *
+ * HTTP scrape endpoint declared in metrics_server.h.
+ */
+
+#define _GNU_SOURCE            /* accept4() */
+
+#include "metrics_server.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+#define MAX_REQUEST_SIZE 2048
+
+/* One scrape connection */
+struct metrics_client {
+    struct metrics_server *server;
+    int fd;
+    struct io_watcher *watcher;
+    char request[MAX_REQUEST_SIZE];
+    size_t received;
+    char *response;               /* Complete HTTP response once the request is read */
+    size_t response_len;
+    size_t sent;
+};
+
+static void close_client(struct metrics_client *client) {
+    event_loop_del_fd(client->server->loop, client->watcher);
+    close(client->fd);
+    free(client->response);
+    free(client);
+}
+
+/**
+ * Renders the response to a complete request into client->response.
+ */
+static int build_response(struct metrics_client *client) {
+    struct metrics_server *server = client->server;
+    char *body = NULL;
+    size_t body_len = 0;
+    const char *status = "200 OK";
+    FILE *out = open_memstream(&body, &body_len);
+
+    if (!out) {
+        return -1;
+    }
+    if (strncmp(client->request, "GET /metrics ", 13) == 0 ||
+        strncmp(client->request, "GET /metrics?", 13) == 0) {
+        if (server->refresh) {
+            server->refresh(server->refresh_arg);
+        }
+        metrics_render(out);
+    } else {
+        status = "404 Not Found";
+        fputs("Not found\n", out);
+    }
+    fclose(out);
+
+    FILE *resp = open_memstream(&client->response, &client->response_len);
+    if (!resp) {
+        free(body);
+        return -1;
+    }
+    fprintf(resp, "HTTP/1.1 %s\r\n"
+            "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n", status, body_len);
+    fwrite(body, 1, body_len, resp);
+    fclose(resp);
+    free(body);
+    return 0;
+}
+
+static void on_client_ready(struct event_loop *loop, int fd, uint32_t events, void *arg) {
+    struct metrics_client *client = arg;
+    ssize_t n;
+
+    (void)events;
+    if (!client->response) {
+        n = read(fd, client->request + client->received,
+                 sizeof(client->request) - 1 - client->received);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (n <= 0) {
+            close_client(client);
+            return;
+        }
+        client->received += (size_t)n;
+        client->request[client->received] = '\0';
+
+        /* Wait for the end of the headers; requests never have a body */
+        if (!strstr(client->request, "\r\n\r\n") &&
+            client->received < sizeof(client->request) - 1) {
+            return;
+        }
+        if (build_response(client) < 0) {
+            close_client(client);
+            return;
+        }
+        event_loop_mod_fd(loop, client->watcher, EPOLLOUT);
+    }
+
+    while (client->sent < client->response_len) {
+        n = write(fd, client->response + client->sent, client->response_len - client->sent);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return; /* Finished on the next EPOLLOUT */
+        }
+        if (n <= 0) {
+            break;
+        }
+        client->sent += (size_t)n;
+    }
+    close_client(client);
+}
+
+static void on_accept(struct event_loop *loop, int fd, uint32_t events, void *arg) {
+    struct metrics_server *server = arg;
+    int client_fd;
+
+    (void)events;
+    while ((client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct metrics_client *client = calloc(1, sizeof(*client));
+
+        if (!client) {
+            close(client_fd);
+            continue;
+        }
+        client->server = server;
+        client->fd = client_fd;
+        client->watcher = event_loop_add_fd(loop, client_fd, EPOLLIN, on_client_ready, client);
+        if (!client->watcher) {
+            close(client_fd);
+            free(client);
+        }
+    }
+}
+
+int metrics_server_init(struct metrics_server *server, struct event_loop *loop,
+                        const char *address, int port, metrics_refresh_callback refresh,
+                        void *arg) {
+    struct sockaddr_in addr;
+    int one = 1;
+
+    memset(server, 0, sizeof(*server));
+    server->loop = loop;
+    server->refresh = refresh;
+    server->refresh_arg = arg;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+        log_error("Invalid metrics address: %s", address);
+        return -1;
+    }
+
+    server->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(server->fd, 16) < 0) {
+        perror("metrics listen");
+        close(server->fd);
+        return -1;
+    }
+
+    server->watcher = event_loop_add_fd(loop, server->fd, EPOLLIN, on_accept, server);
+    if (!server->watcher) {
+        close(server->fd);
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_server_destroy(struct metrics_server *server) {
+    event_loop_del_fd(server->loop, server->watcher);
+    close(server->fd);
+}
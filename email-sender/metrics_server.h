@@ -0,0 +1,47 @@
+/**
+ * metrics_server.h
+ *
+ * Minimal HTTP endpoint serving GET /metrics from the event loop. Each
+ * connection carries one request; the response is rendered by
+ * metrics_render() and the connection is closed once it is written.
+ */
+
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include "event_loop.h"
+
+/* Called before each scrape to refresh gauges that are sampled, not tracked */
+typedef void (*metrics_refresh_callback)(void *arg);
+
+struct metrics_server {
+    struct event_loop *loop;
+    int fd;                            /* Listening socket */
+    struct io_watcher *watcher;
+    metrics_refresh_callback refresh;
+    void *refresh_arg;
+};
+
+/**
+ * Starts listening for scrapes.
+ *
+ * @param server  Server to initialize
+ * @param loop    Event loop serving connections
+ * @param address IPv4 address to listen on, e.g. "127.0.0.1" or "0.0.0.0"
+ * @param port    TCP port to listen on
+ * @param refresh Optional callback run before rendering each scrape
+ * @param arg     Opaque pointer passed to refresh
+ * @return        0 on success, -1 on failure
+ */
+int metrics_server_init(struct metrics_server *server, struct event_loop *loop,
+                        const char *address, int port, metrics_refresh_callback refresh,
+                        void *arg);
+
+/**
+ * Stops listening. Scrapes in progress are abandoned.
+ *
+ * @param server Server to destroy
+ */
+void metrics_server_destroy(struct metrics_server *server);
+
+#endif /* METRICS_SERVER_H */
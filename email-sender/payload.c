@@ -0,0 +1,402 @@
+/**
+ * payload.c
+ *
+ * Segmented message payloads declared in payload.h.
+ */
+
+#include "payload.h"
+
+#include <curl/curl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BASE64_LINE_BYTES 57      /* Input bytes per 76-column base64 line */
+#define PART_HEADERS_MAX 1024     /* An attachment's part headers, with its name and type capped */
+#define STREAM_BUFFER_SIZE \
+    (PART_HEADERS_MAX + PAYLOAD_CHUNK_BYTES / BASE64_LINE_BYTES * 78)
+#define DELIMITER_MAX 160         /* One MIME delimiter with the part headers that follow it */
+
+/* Appends to the header block while a payload is built */
+struct builder {
+    struct payload *payload;
+    size_t used;
+    size_t size;
+    int capacity;                 /* Segments allocated */
+};
+
+static void add_segment(struct builder *b, const char *data, size_t len, int attachment) {
+    struct payload *payload = b->payload;
+
+    if ((len > 0 || attachment) && payload->count < b->capacity) {
+        payload->segments[payload->count].data = data;
+        payload->segments[payload->count].len = len;
+        payload->segments[payload->count].attachment = attachment;
+        payload->count++;
+    }
+}
+
+/**
+ * Formats text at the end of the header block and adds it as a segment.
+ */
+static void put(struct builder *b, const char *fmt, ...) {
+    char *at = b->payload->headers + b->used;
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(at, b->size - b->used, fmt, ap);
+    va_end(ap);
+    if (len > 0 && (size_t)len < b->size - b->used) {
+        b->used += (size_t)len;
+        add_segment(b, at, (size_t)len, 0);
+    }
+}
+
+static void add_body(struct builder *b, const struct ticket *ticket) {
+    const struct template *t = ticket->template;
+
+    if (!t) {
+        add_segment(b, ticket->body, strlen(ticket->body), 0);
+        return;
+    }
+    for (int i = 0; i < t->body_parts; i++) {
+        const struct template_part *part = &t->body[i];
+
+        if (part->text) {
+            add_segment(b, part->text, part->len, 0);
+        } else {
+            add_segment(b, ticket->args->values[part->var].data,
+                        ticket->args->values[part->var].len, 0);
+        }
+    }
+}
+
+static int count_attachments(const char *ids) {
+    int n = 0;
+
+    for (const char *p = ids; *p; p++) {
+        n += (*p >= '0' && *p <= '9') && !(p[1] >= '0' && p[1] <= '9');
+    }
+    return n;
+}
+
+int payload_init_message(struct payload *payload, const char *from_name,
+                         const char *from_address, const char *message_id,
+                         const struct ticket *ticket, payload_fetch_fn fetch, void *fetch_arg) {
+    static const char header_format[] =
+        "From: %s <%s>\r\n"
+        "To: %s%s%s\r\n"
+        "Subject: %s\r\n"
+        "Message-ID: <%s>\r\n";
+    /* Recipients of a grouped message must not see each other */
+    int grouped = ticket->same_message != NULL;
+    const char *to_open = grouped ? "undisclosed-recipients:;" : "<";
+    const char *to = grouped ? "" : ticket->email;
+    const char *to_close = grouped ? "" : ">";
+    int html = ticket->html_body[0] != '\0';
+    int attachments = count_attachments(ticket->attachment_ids);
+    struct builder b = { payload, 0, 0, PAYLOAD_INLINE_SEGMENTS };
+    char mixed[24];
+    char alternative[24];
+    int len;
+
+    memset(payload, 0, sizeof(*payload));
+    payload->segments = payload->inline_segments;
+    payload->fetch = fetch;
+    payload->fetch_arg = fetch_arg;
+
+    /* Headers, body parts, an HTML part and attachments, each with their
+     * delimiters, and the closing delimiters */
+    len = (ticket->template ? ticket->template->body_parts : 1) + 2 * attachments + 8;
+    if (len > b.capacity) {
+        b.capacity = len;
+        payload->segments = malloc((size_t)b.capacity * sizeof(*payload->segments));
+        if (!payload->segments) {
+            payload_free(payload);
+            return -1;
+        }
+    }
+
+    /* Size the header block exactly instead of assuming a maximum */
+    len = snprintf(NULL, 0, header_format, from_name, from_address,
+                   to_open, to, to_close, ticket->subject, message_id);
+    b.size = (size_t)len + 1 + (size_t)DELIMITER_MAX * (6 + attachments);
+    if (len < 0 || !(payload->headers = malloc(b.size))) {
+        payload_free(payload);
+        return -1;
+    }
+    put(&b, header_format, from_name, from_address, to_open, to, to_close, ticket->subject,
+        message_id);
+
+    if (!html && !attachments) {
+        put(&b, "Content-Type: text/plain; charset=UTF-8\r\n\r\n");
+        add_body(&b, ticket);
+        add_segment(&b, "\r\n", 2, 0);
+        return 0;
+    }
+
+    /* Base64 never contains "=_", and the random part makes a clash with
+     * the text parts all but impossible */
+    snprintf(mixed, sizeof(mixed), "=_m%08lx%08lx", (unsigned long)random(),
+             (unsigned long)random());
+    snprintf(alternative, sizeof(alternative), "=_a%s", mixed + 3);
+    put(&b, "MIME-Version: 1.0\r\nContent-Type: multipart/%s; boundary=\"%s\"\r\n\r\n",
+        attachments ? "mixed" : "alternative", attachments ? mixed : alternative);
+    if (attachments && html) {
+        put(&b, "--%s\r\nContent-Type: multipart/alternative; boundary=\"%s\"\r\n\r\n",
+            mixed, alternative);
+    }
+    put(&b, "--%s\r\nContent-Type: text/plain; charset=UTF-8\r\n\r\n", html ? alternative : mixed);
+    add_body(&b, ticket);
+    if (html) {
+        put(&b, "\r\n--%s\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n", alternative);
+        add_segment(&b, ticket->html_body, strlen(ticket->html_body), 0);
+        put(&b, "\r\n--%s--", alternative);
+    }
+    for (const char *p = ticket->attachment_ids; *p; ) {
+        char *end;
+        long id = strtol(p, &end, 10);
+
+        if (end == p) {
+            p++;
+            continue;
+        }
+        p = end;
+        put(&b, "\r\n--%s\r\n", mixed);
+        add_segment(&b, NULL, 0, (int)id);
+    }
+    if (attachments) {
+        put(&b, "\r\n--%s--", mixed);
+    }
+    add_segment(&b, "\r\n", 2, 0);
+    return 0;
+}
+
+void payload_free(struct payload *payload) {
+    free(payload->headers);
+    free(payload->stream.buf);
+    if (payload->segments != payload->inline_segments) {
+        free(payload->segments);
+    }
+    payload->headers = NULL;
+    payload->stream.buf = NULL;
+    payload->segments = payload->inline_segments;
+    payload->count = 0;
+}
+
+static void reset_stream(struct payload_stream *stream) {
+    stream->len = stream->pos = 0;
+    stream->offset = 0;
+    stream->waiting = stream->done = stream->failed = 0;
+}
+
+void payload_rewind(struct payload *payload) {
+    payload->current = 0;
+    payload->offset = 0;
+    payload->held = 0;
+    reset_stream(&payload->stream);
+}
+
+static const char base64_digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * Base64 encodes one line's worth of input (at most BASE64_LINE_BYTES).
+ * Whole 3-byte groups go through a loop without branches, which the
+ * compiler unrolls and vectorizes; only the last group of an attachment
+ * can need padding.
+ *
+ * @return Characters written
+ */
+static size_t base64_line(char *out, const unsigned char *in, size_t len) {
+    size_t groups = len / 3;
+    size_t n = 0;
+
+    for (size_t i = 0; i < groups; i++) {
+        uint32_t v = (uint32_t)in[3 * i] << 16 | (uint32_t)in[3 * i + 1] << 8 | in[3 * i + 2];
+
+        out[4 * i] = base64_digits[v >> 18];
+        out[4 * i + 1] = base64_digits[(v >> 12) & 63];
+        out[4 * i + 2] = base64_digits[(v >> 6) & 63];
+        out[4 * i + 3] = base64_digits[v & 63];
+    }
+    n = 4 * groups;
+    in += 3 * groups;
+    if (len % 3 == 1) {
+        out[n++] = base64_digits[in[0] >> 2];
+        out[n++] = base64_digits[(in[0] & 3) << 4];
+        out[n++] = '=';
+        out[n++] = '=';
+    } else if (len % 3 == 2) {
+        out[n++] = base64_digits[in[0] >> 2];
+        out[n++] = base64_digits[(in[0] & 3) << 4 | in[1] >> 4];
+        out[n++] = base64_digits[(in[1] & 15) << 2];
+        out[n++] = '=';
+    }
+    return n;
+}
+
+/**
+ * Copies a header parameter, replacing what cannot appear in a quoted
+ * string on one line.
+ */
+static void clean_copy(char *out, size_t size, const char *in, const char *fallback) {
+    size_t n = 0;
+
+    for (; *in && n + 1 < size; in++) {
+        unsigned char c = (unsigned char)*in;
+        out[n++] = (c < 0x20 || c == 0x7f || c == '"' || c == '\\') ? '_' : (char)c;
+    }
+    out[n] = '\0';
+    if (n == 0) {
+        snprintf(out, size, "%s", fallback);
+    }
+}
+
+void payload_feed(struct payload *payload, const char *filename, const char *content_type,
+                  const char *data, size_t len) {
+    struct payload_stream *stream = &payload->stream;
+    const unsigned char *in = (const unsigned char *)data;
+
+    stream->waiting = 0;
+    stream->len = stream->pos = 0;
+    if (len > PAYLOAD_CHUNK_BYTES ||
+        (!stream->buf && !(stream->buf = malloc(STREAM_BUFFER_SIZE)))) {
+        stream->failed = 1;
+        return;
+    }
+
+    if (stream->offset == 0) {
+        char name[200];
+        char type[128];
+
+        clean_copy(name, sizeof(name), filename, "attachment");
+        clean_copy(type, sizeof(type), content_type, "application/octet-stream");
+        stream->len = (size_t)snprintf(stream->buf, PART_HEADERS_MAX,
+                                       "Content-Type: %s; name=\"%s\"\r\n"
+                                       "Content-Disposition: attachment; filename=\"%s\"\r\n"
+                                       "Content-Transfer-Encoding: base64\r\n\r\n",
+                                       type, name, name);
+    }
+
+    /* Lines are separated rather than terminated, so the delimiter that
+     * follows the attachment starts its own line */
+    for (size_t done = 0; done < len; done += BASE64_LINE_BYTES) {
+        size_t n = len - done < BASE64_LINE_BYTES ? len - done : BASE64_LINE_BYTES;
+
+        if (stream->offset > 0 || done > 0) {
+            stream->buf[stream->len++] = '\r';
+            stream->buf[stream->len++] = '\n';
+        }
+        stream->len += base64_line(stream->buf + stream->len, in + done, n);
+    }
+    stream->offset += (long)len;
+    if (len < PAYLOAD_CHUNK_BYTES) {
+        stream->done = 1;
+    }
+}
+
+void payload_fail(struct payload *payload) {
+    payload->stream.waiting = 0;
+    payload->stream.failed = 1;
+}
+
+/**
+ * Reads from the attachment segment being streamed, asking for its next
+ * chunk once the encoded one is used up.
+ *
+ * @return Bytes copied, 0 when the attachment is finished, or
+ *         CURL_READFUNC_PAUSE or CURL_READFUNC_ABORT
+ */
+static size_t read_attachment(struct payload *payload, const struct payload_segment *seg,
+                              char *buffer, size_t room) {
+    struct payload_stream *stream = &payload->stream;
+    size_t n;
+
+    if (stream->pos == stream->len) {
+        if (stream->failed) {
+            return CURL_READFUNC_ABORT;
+        }
+        if (stream->done) {
+            reset_stream(stream);
+            return 0;
+        }
+        if (!stream->waiting) {
+            if (!payload->fetch ||
+                payload->fetch(payload->fetch_arg, seg->attachment, stream->offset,
+                               PAYLOAD_CHUNK_BYTES) < 0) {
+                return CURL_READFUNC_ABORT;
+            }
+            stream->waiting = 1;
+        }
+        return CURL_READFUNC_PAUSE;
+    }
+
+    n = stream->len - stream->pos;
+    if (n > room) {
+        n = room;
+    }
+    memcpy(buffer, stream->buf + stream->pos, n);
+    stream->pos += n;
+    return n;
+}
+
+size_t payload_read(char *buffer, size_t size, size_t nitems, void *userdata) {
+    struct payload *payload = userdata;
+    size_t room = size * nitems;
+    size_t copied = 0;
+
+    while (room > 0 && payload->current < payload->count) {
+        const struct payload_segment *seg = &payload->segments[payload->current];
+        size_t n;
+
+        if (seg->attachment) {
+            n = read_attachment(payload, seg, buffer + copied, room);
+            if (n == CURL_READFUNC_PAUSE || n == CURL_READFUNC_ABORT) {
+                /* Hand over what was read first; the next call pauses again */
+                return copied > 0 ? copied : n;
+            }
+            if (n == 0) {
+                payload->current++;
+            }
+            copied += n;
+            room -= n;
+            continue;
+        }
+
+        n = seg->len - payload->offset;
+        if (n > room) {
+            n = room;
+        }
+        memcpy(buffer + copied, seg->data + payload->offset, n);
+        copied += n;
+        room -= n;
+        payload->offset += n;
+
+        if (payload->offset == seg->len) {
+            payload->current++;
+            payload->offset = 0;
+        }
+    }
+
+    /* Ending the message is what has the server take it */
+    if (copied == 0 && payload->hold) {
+        if (!payload->held && payload->at_end(payload->fetch_arg) < 0) {
+            payload->hold = 0;
+            return 0;
+        }
+        payload->held = 1;
+        return CURL_READFUNC_PAUSE;
+    }
+    return copied;
+}
+
+int payload_release(struct payload *payload) {
+    int held = payload->held;
+
+    payload->hold = payload->held = 0;
+    return held;
+}
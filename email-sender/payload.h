@@ -0,0 +1,148 @@
+/**
+ * payload.h
+ *
+ * Streaming message payloads for CURLOPT_READFUNCTION. A payload is a
+ * list of segments read back to back: the formatted header block, which
+ * the payload owns, and borrowed buffers such as a ticket's body, which
+ * are read in place straight out of the PGresult. A templated body is the
+ * template's literal runs interleaved with the ticket's bound values, so
+ * it is rendered as curl reads it. Nothing is truncated and the body is
+ * never copied before curl asks for it.
+ *
+ * A ticket with an HTML alternative or attachments becomes a MIME
+ * multipart message. Attachments are not held in memory: each is fetched
+ * a chunk at a time as curl reads, base64 encoded into one buffer of
+ * fixed size, and the transfer is paused while the next chunk is on its
+ * way, so a payload's memory does not depend on the attachments' size.
+ *
+ * The end of a message can be held back, pausing the transfer before the
+ * server is told the message is complete, until the caller releases it.
+ */
+
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <stddef.h>
+
+#include "ticket.h"
+
+#define PAYLOAD_INLINE_SEGMENTS 4   /* Enough for a plain text message */
+#define PAYLOAD_CHUNK_BYTES (57 * 1024) /* Attachment bytes per fetch: whole 76-column lines */
+
+/* Asks for up to len bytes of an attachment from offset. The answer is
+ * handed to payload_feed() or payload_fail() later, never from within
+ * the call. Returns 0 if the request was made, -1 otherwise. */
+typedef int (*payload_fetch_fn)(void *arg, int attachment_id, long offset, size_t len);
+
+/* The end of a message held back (see struct payload) has been reached.
+ * Returns 0 to keep it held until payload_release(), which must not be
+ * called from within the call, or -1 to let it go at once. */
+typedef int (*payload_end_fn)(void *arg);
+
+struct payload_segment {
+    const char *data;
+    size_t len;
+    int attachment;                /* Attachment streamed in its place (0 = data) */
+};
+
+/* Encoding of the attachment segment being read */
+struct payload_stream {
+    char *buf;                     /* Part headers and base64 lines (allocated on first use) */
+    size_t len;                    /* Bytes in buf... */
+    size_t pos;                    /* ...of which curl has read this many */
+    long offset;                   /* Attachment bytes received so far */
+    int waiting;                   /* A chunk has been asked for */
+    int done;                      /* The last chunk has been received */
+    int failed;                    /* The attachment could not be read */
+};
+
+struct payload {
+    char *headers;                 /* Owned header block and MIME delimiters (segment 0) */
+    struct payload_segment *segments; /* inline_segments, or allocated for a longer list */
+    struct payload_segment inline_segments[PAYLOAD_INLINE_SEGMENTS];
+    int count;
+    int current;                   /* Read position: segment index... */
+    size_t offset;                 /* ...and offset within it */
+    struct payload_stream stream;
+    payload_fetch_fn fetch;
+    void *fetch_arg;
+    int hold;                      /* Hold back the end of the message (set by the caller)... */
+    int held;                      /* ...on which curl is paused */
+    payload_end_fn at_end;         /* Called with fetch_arg when the end is reached */
+};
+
+/**
+ * Builds the message for a ticket: plain text, or multipart when it has
+ * an HTML alternative or attachments. The body (or the template and
+ * values it is rendered from) is referenced, not copied, so the ticket
+ * must outlive the payload. A ticket heading a group (see
+ * ticket_list_group()) is addressed to undisclosed recipients.
+ *
+ * @param payload      Payload to initialize
+ * @param from_name    Display name in the From header
+ * @param from_address Sender address
+ * @param message_id   Message-ID header value, without the angle brackets
+ * @param ticket       Ticket supplying the recipient, subject and body
+ * @param fetch        Reads attachment chunks (only called if there are any)
+ * @param fetch_arg    Opaque pointer passed to fetch
+ * @return             0 on success, -1 if out of memory
+ */
+int payload_init_message(struct payload *payload, const char *from_name,
+                         const char *from_address, const char *message_id,
+                         const struct ticket *ticket, payload_fetch_fn fetch, void *fetch_arg);
+
+/**
+ * Releases the header block, segment list and encoding buffer.
+ *
+ * @param payload Payload to free
+ */
+void payload_free(struct payload *payload);
+
+/**
+ * Moves the read position back to the start, e.g. before a retry. A chunk
+ * still on its way must have been cancelled.
+ *
+ * @param payload Payload to rewind
+ */
+void payload_rewind(struct payload *payload);
+
+/**
+ * Hands over the chunk last asked for through the fetch callback. Reading
+ * can resume afterwards (the caller unpauses the transfer).
+ *
+ * @param payload      Payload that asked
+ * @param filename     Attachment's file name
+ * @param content_type Attachment's MIME type
+ * @param data         The bytes read
+ * @param len          Their number; less than asked for at the end
+ */
+void payload_feed(struct payload *payload, const char *filename, const char *content_type,
+                  const char *data, size_t len);
+
+/**
+ * Reports that the chunk last asked for could not be read; the transfer
+ * is aborted when curl next reads.
+ *
+ * @param payload Payload that asked
+ */
+void payload_fail(struct payload *payload);
+
+/**
+ * Lets the end of a held message be read.
+ *
+ * @param payload Payload to release
+ * @return        Non-zero if curl is paused on it (the caller unpauses it)
+ */
+int payload_release(struct payload *payload);
+
+/**
+ * CURLOPT_READFUNCTION callback; userdata is the struct payload.
+ *
+ * @return Bytes copied into buffer, 0 at the end of the message,
+ *         CURL_READFUNC_PAUSE while waiting for an attachment chunk or
+ *         for the end of the message to be released, or
+ *         CURL_READFUNC_ABORT if a chunk could not be read
+ */
+size_t payload_read(char *buffer, size_t size, size_t nitems, void *userdata);
+
+#endif /* PAYLOAD_H */
@@ -0,0 +1,257 @@
+/**
+ * rate_limit.c
+ *
+ * Keyed token buckets declared in rate_limit.h.
+ */
+
+#include "rate_limit.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "metrics.h"
+
+#define INITIAL_TABLE_SIZE 64
+
+struct token_bucket {
+    char *key;
+    double tokens;
+    uint64_t updated_usec;         /* Last refill */
+    struct token_bucket *next;     /* Hash chain */
+};
+
+/* FNV-1a over the lowercased key, since domains are case-insensitive */
+static uint32_t hash_key(const char *key) {
+    uint32_t h = 2166136261u;
+
+    for (; *key; key++) {
+        h ^= (uint32_t)tolower((unsigned char)*key);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void refill(const struct rate_limiter *limiter, struct token_bucket *b, uint64_t now) {
+    b->tokens += (double)(now - b->updated_usec) / 1e6 * limiter->rate;
+    if (b->tokens > limiter->burst) {
+        b->tokens = limiter->burst;
+    }
+    b->updated_usec = now;
+}
+
+/**
+ * Drops buckets that are full again: they behave exactly like a bucket
+ * that was never created.
+ */
+static void sweep_full(struct rate_limiter *limiter, uint64_t now) {
+    for (int i = 0; i < limiter->table_size; i++) {
+        struct token_bucket **link = &limiter->table[i];
+
+        while (*link) {
+            struct token_bucket *b = *link;
+
+            refill(limiter, b, now);
+            if (b->tokens >= limiter->burst) {
+                *link = b->next;
+                free(b->key);
+                free(b);
+                limiter->count--;
+            } else {
+                link = &b->next;
+            }
+        }
+    }
+}
+
+static int grow(struct rate_limiter *limiter) {
+    int size = limiter->table_size * 2;
+    struct token_bucket **table = calloc(size, sizeof(*table));
+
+    if (!table) {
+        return -1;
+    }
+    for (int i = 0; i < limiter->table_size; i++) {
+        struct token_bucket *b = limiter->table[i];
+
+        while (b) {
+            struct token_bucket *next = b->next;
+            uint32_t slot = hash_key(b->key) % (uint32_t)size;
+
+            b->next = table[slot];
+            table[slot] = b;
+            b = next;
+        }
+    }
+    free(limiter->table);
+    limiter->table = table;
+    limiter->table_size = size;
+    return 0;
+}
+
+/**
+ * Finds key's bucket, refilled up to now; NULL if it has none (i.e. its
+ * bucket would be full).
+ */
+static struct token_bucket *lookup(struct rate_limiter *limiter, const char *key, uint64_t now) {
+    struct token_bucket *b = limiter->table[hash_key(key) % (uint32_t)limiter->table_size];
+
+    for (; b; b = b->next) {
+        if (strcasecmp(b->key, key) == 0) {
+            refill(limiter, b, now);
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static struct token_bucket *lookup_or_create(struct rate_limiter *limiter, const char *key,
+                                             uint64_t now) {
+    struct token_bucket *b = lookup(limiter, key, now);
+
+    if (b) {
+        return b;
+    }
+
+    /* Keep chains short: forget idle keys first, then grow */
+    if (limiter->count >= limiter->table_size) {
+        sweep_full(limiter, now);
+        if (limiter->count >= limiter->table_size / 2 && grow(limiter) < 0) {
+            return NULL;
+        }
+    }
+
+    b = calloc(1, sizeof(*b));
+    if (!b || !(b->key = strdup(key))) {
+        free(b);
+        return NULL;
+    }
+    b->tokens = limiter->burst;
+    b->updated_usec = now;
+
+    uint32_t slot = hash_key(key) % (uint32_t)limiter->table_size;
+    b->next = limiter->table[slot];
+    limiter->table[slot] = b;
+    limiter->count++;
+    return b;
+}
+
+int rate_limiter_init(struct rate_limiter *limiter, int per_minute, int burst) {
+    memset(limiter, 0, sizeof(*limiter));
+    limiter->rate = per_minute > 0 ? per_minute / 60.0 : 0;
+    limiter->burst = burst > 0 ? burst : 1;
+    atomic_init(&limiter->enabled, per_minute > 0);
+    limiter->table_size = INITIAL_TABLE_SIZE;
+    limiter->table = calloc(limiter->table_size, sizeof(*limiter->table));
+    if (!limiter->table) {
+        return -1;
+    }
+    pthread_mutex_init(&limiter->lock, NULL);
+    return 0;
+}
+
+void rate_limiter_configure(struct rate_limiter *limiter, int per_minute, int burst) {
+    pthread_mutex_lock(&limiter->lock);
+    limiter->rate = per_minute > 0 ? per_minute / 60.0 : 0;
+    limiter->burst = burst > 0 ? burst : 1;
+    atomic_store(&limiter->enabled, per_minute > 0);
+    pthread_mutex_unlock(&limiter->lock);
+}
+
+void rate_limiter_destroy(struct rate_limiter *limiter) {
+    for (int i = 0; i < limiter->table_size; i++) {
+        struct token_bucket *b = limiter->table[i];
+
+        while (b) {
+            struct token_bucket *next = b->next;
+            free(b->key);
+            free(b);
+            b = next;
+        }
+    }
+    free(limiter->table);
+    limiter->table = NULL;
+    limiter->count = 0;
+    pthread_mutex_destroy(&limiter->lock);
+}
+
+long rate_limiter_wait_ms(struct rate_limiter *limiter, const char *key) {
+    struct token_bucket *b;
+    long wait_ms = 0;
+
+    if (!atomic_load(&limiter->enabled)) {
+        return 0;
+    }
+    pthread_mutex_lock(&limiter->lock);
+    if (limiter->rate > 0 && (b = lookup(limiter, key, metrics_now_usec())) != NULL &&
+        b->tokens < 1) {
+        wait_ms = (long)((1 - b->tokens) / limiter->rate * 1000) + 1;
+    }
+    pthread_mutex_unlock(&limiter->lock);
+    return wait_ms;
+}
+
+long rate_limiter_try_take(struct rate_limiter *limiter, const char *key, int n) {
+    struct token_bucket *b;
+    long wait_ms = 0;
+
+    if (!atomic_load(&limiter->enabled)) {
+        return 0;
+    }
+    pthread_mutex_lock(&limiter->lock);
+    if (limiter->rate > 0 && (b = lookup_or_create(limiter, key, metrics_now_usec())) != NULL) {
+        double needed = n < limiter->burst ? n : limiter->burst;
+
+        if (b->tokens >= needed) {
+            b->tokens -= n;
+        } else {
+            wait_ms = (long)((needed - b->tokens) / limiter->rate * 1000) + 1;
+        }
+    }
+    pthread_mutex_unlock(&limiter->lock);
+    return wait_ms;
+}
+
+void rate_limiter_take(struct rate_limiter *limiter, const char *key, int n) {
+    struct token_bucket *b;
+
+    if (!atomic_load(&limiter->enabled)) {
+        return;
+    }
+    pthread_mutex_lock(&limiter->lock);
+    if (limiter->rate > 0 && (b = lookup_or_create(limiter, key, metrics_now_usec())) != NULL) {
+        b->tokens -= n;
+    }
+    pthread_mutex_unlock(&limiter->lock);
+}
+
+void rate_limiter_refund(struct rate_limiter *limiter, const char *key, int n) {
+    struct token_bucket *b;
+
+    if (!atomic_load(&limiter->enabled)) {
+        return;
+    }
+    pthread_mutex_lock(&limiter->lock);
+    if (limiter->rate > 0 && (b = lookup(limiter, key, metrics_now_usec())) != NULL) {
+        b->tokens += n;
+        if (b->tokens > limiter->burst) {
+            b->tokens = limiter->burst;
+        }
+    }
+    pthread_mutex_unlock(&limiter->lock);
+}
+
+void rate_limiter_drain(struct rate_limiter *limiter, const char *key) {
+    struct token_bucket *b;
+
+    if (!atomic_load(&limiter->enabled)) {
+        return;
+    }
+    pthread_mutex_lock(&limiter->lock);
+    if (limiter->rate > 0 && (b = lookup_or_create(limiter, key, metrics_now_usec())) != NULL &&
+        b->tokens > 0) {
+        b->tokens = 0;
+    }
+    pthread_mutex_unlock(&limiter->lock);
+}
@@ -0,0 +1,110 @@
+/**
+ * rate_limit.h
+ *
+ * Token bucket rate limiters keyed by a string, such as the sending
+ * account or the recipient domain. Each key has its own bucket that
+ * refills continuously at the configured rate up to a burst size, so a
+ * limiter keeps sustained throughput just under a provider's quota while
+ * still allowing short bursts. Buckets are created on first use and
+ * dropped again once they have refilled completely. A limiter may be
+ * shared by several sender threads.
+ */
+
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+struct token_bucket;
+
+struct rate_limiter {
+    atomic_int enabled;            /* Zero while unlimited, checked without the lock */
+    double rate;                   /* Tokens added per second (0 = unlimited) */
+    double burst;                  /* Bucket capacity */
+    struct token_bucket **table;   /* Hash chains keyed case-insensitively */
+    int table_size;
+    int count;
+    pthread_mutex_t lock;          /* Guards the table and every bucket */
+};
+
+/**
+ * Initializes a limiter.
+ *
+ * @param limiter    Limiter to initialize
+ * @param per_minute Sustained rate per key (0 disables the limiter)
+ * @param burst      Tokens a key may use at once (at least 1)
+ * @return           0 on success, -1 if out of memory
+ */
+int rate_limiter_init(struct rate_limiter *limiter, int per_minute, int burst);
+
+/**
+ * Changes the rate and burst while the limiter is in use. Existing buckets
+ * keep their tokens, capped at the new burst.
+ *
+ * @param limiter    Limiter to update
+ * @param per_minute Sustained rate per key (0 disables the limiter)
+ * @param burst      Tokens a key may use at once (at least 1)
+ */
+void rate_limiter_configure(struct rate_limiter *limiter, int per_minute, int burst);
+
+/**
+ * Frees every bucket.
+ *
+ * @param limiter Limiter to destroy
+ */
+void rate_limiter_destroy(struct rate_limiter *limiter);
+
+/**
+ * Checks whether key may send now, without using a token.
+ *
+ * @param limiter Limiter to check
+ * @param key     Account or domain
+ * @return        0 if a token is available, otherwise milliseconds until one is
+ */
+long rate_limiter_wait_ms(struct rate_limiter *limiter, const char *key);
+
+/**
+ * Uses n of key's tokens if it has them, checking and taking them in one
+ * step so that threads sharing the limiter cannot both spend the same
+ * tokens. With n above the burst size, a full bucket is enough and the
+ * rest is owed.
+ *
+ * @param limiter Limiter to charge
+ * @param key     Account or domain
+ * @param n       Tokens needed, e.g. one per recipient
+ * @return        0 if the tokens were taken, otherwise milliseconds until
+ *                they are available (nothing is taken)
+ */
+long rate_limiter_try_take(struct rate_limiter *limiter, const char *key, int n);
+
+/**
+ * Uses n of key's tokens whether or not it has them, leaving the bucket
+ * in debt if needed.
+ *
+ * @param limiter Limiter to charge
+ * @param key     Account or domain
+ * @param n       Tokens used
+ */
+void rate_limiter_take(struct rate_limiter *limiter, const char *key, int n);
+
+/**
+ * Gives back tokens taken for a send that did not happen.
+ *
+ * @param limiter Limiter to credit
+ * @param key     Account or domain
+ * @param n       Tokens taken
+ */
+void rate_limiter_refund(struct rate_limiter *limiter, const char *key, int n);
+
+/**
+ * Empties key's bucket, e.g. after the server answered that we are
+ * sending too fast, so the next send waits for a full token.
+ *
+ * @param limiter Limiter to update
+ * @param key     Account or domain
+ */
+void rate_limiter_drain(struct rate_limiter *limiter, const char *key);
+
+#endif /* RATE_LIMIT_H */
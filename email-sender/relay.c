@@ -0,0 +1,204 @@
+/**
+ * relay.c
+ *
+ * Relay selection and health tracking declared in relay.h.
+ */
+
+#include "relay.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+#define ERROR_RATE_ALPHA 0.2       /* Weight of the newest result in the moving average */
+#define ERROR_RATE_DOWN 0.5        /* Taken out of rotation above this (about 4 failures in a row) */
+#define ERROR_RATE_PROBATION 0.4   /* Back in rotation: one more failure takes it out again */
+#define COOLDOWN_MIN 10            /* Seconds out of rotation the first time */
+#define COOLDOWN_MAX 300           /* Cap for the doubling cooldown */
+#define MAX_LINE 1024
+
+void relay_set_init(struct relay_set *set) {
+    memset(set, 0, sizeof(*set));
+}
+
+int relay_set_add(struct relay_set *set, const char *server, const char *port,
+                  const char *username, const char *password, int weight,
+                  int pool_size, int noop_after, int max_sends) {
+    struct relay *relays = realloc(set->relays, (set->count + 1) * sizeof(*relays));
+
+    if (!relays) {
+        return -1;
+    }
+    set->relays = relays;
+
+    struct relay *relay = &set->relays[set->count];
+    memset(relay, 0, sizeof(*relay));
+    relay->username = strdup(username);
+    relay->password = strdup(password);
+    if (!relay->username || !relay->password ||
+        smtp_pool_init(&relay->pool, pool_size, server, port, relay->username, relay->password,
+                       noop_after, max_sends) < 0) {
+        free(relay->username);
+        free(relay->password);
+        return -1;
+    }
+    relay->index = set->count;
+    relay->weight = weight > 0 ? weight : 1;
+    relay->cooldown = COOLDOWN_MIN;
+
+    set->count++;
+    set->total_sessions += relay->pool.size;
+    if (relay->pool.size > set->max_sessions) {
+        set->max_sessions = relay->pool.size;
+    }
+    return 0;
+}
+
+int relay_set_load(struct relay_set *set, const char *path,
+                   int pool_size, int noop_after, int max_sends) {
+    FILE *f = fopen(path, "r");
+    char line[MAX_LINE];
+    int line_no = 0;
+    int added = 0;
+
+    if (!f) {
+        log_error("%s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char *save = NULL;
+        char *host = strtok_r(line, " \t\r\n", &save);
+        char *port, *username, *password, *weight;
+
+        line_no++;
+        if (!host || host[0] == '#') {
+            continue;
+        }
+        port = strtok_r(NULL, " \t\r\n", &save);
+        username = strtok_r(NULL, " \t\r\n", &save);
+        password = strtok_r(NULL, " \t\r\n", &save);
+        weight = strtok_r(NULL, " \t\r\n", &save);
+        if (!password) {
+            log_error("%s:%d: expected \"host port username password [weight]\"",
+                    path, line_no);
+            fclose(f);
+            return -1;
+        }
+        if (relay_set_add(set, host, port, username, password, weight ? atoi(weight) : 1,
+                          pool_size, noop_after, max_sends) < 0) {
+            log_error("%s:%d: failed to set up relay %s", path, line_no, host);
+            fclose(f);
+            return -1;
+        }
+        added++;
+    }
+    fclose(f);
+    return added;
+}
+
+void relay_set_limit_sessions(struct relay_set *set, int limit) {
+    set->total_sessions = 0;
+    for (int i = 0; i < set->count; i++) {
+        smtp_pool_set_limit(&set->relays[i].pool, limit);
+        set->total_sessions += set->relays[i].pool.limit;
+    }
+}
+
+void relay_set_destroy(struct relay_set *set) {
+    for (int i = 0; i < set->count; i++) {
+        smtp_pool_destroy(&set->relays[i].pool);
+        free(set->relays[i].username);
+        free(set->relays[i].password);
+    }
+    free(set->relays);
+    relay_set_init(set);
+}
+
+int relay_is_up(struct relay *relay) {
+    if (relay->down_until == 0) {
+        return 1;
+    }
+    if (time(NULL) < relay->down_until) {
+        return 0;
+    }
+
+    /* Cooldown over: back on probation */
+    log_info("SMTP relay %s (%s) back in rotation", relay->pool.url, relay->pool.username);
+    relay->down_until = 0;
+    relay->error_rate = ERROR_RATE_PROBATION;
+    return 1;
+}
+
+struct relay *relay_set_pick(struct relay_set *set, int avoid, relay_usable_fn usable, void *arg) {
+    struct relay *best = NULL;
+    struct relay *avoided = NULL;
+    int total = 0;
+
+    for (int i = 0; i < set->count; i++) {
+        struct relay *relay = &set->relays[i];
+
+        if (!relay_is_up(relay) || !usable(relay, arg)) {
+            continue;
+        }
+        if (i == avoid) {
+            avoided = relay;
+            continue;
+        }
+        relay->current_weight += relay->weight;
+        total += relay->weight;
+        if (!best || relay->current_weight > best->current_weight) {
+            best = relay;
+        }
+    }
+
+    if (!best) {
+        return avoided;
+    }
+    best->current_weight -= total;
+    return best;
+}
+
+long relay_set_next_recovery_ms(const struct relay_set *set) {
+    time_t now = time(NULL);
+    long best = -1;
+
+    for (int i = 0; i < set->count; i++) {
+        const struct relay *relay = &set->relays[i];
+
+        if (relay->down_until != 0) {
+            long ms = relay->down_until > now ? (long)(relay->down_until - now) * 1000 : 0;
+            if (best < 0 || ms < best) {
+                best = ms;
+            }
+        }
+    }
+    return best;
+}
+
+static void take_down(struct relay *relay, const char *why) {
+    log_warn("SMTP relay %s (%s) out of rotation for %ds: %s",
+            relay->pool.url, relay->pool.username, relay->cooldown, why);
+    relay->down_until = time(NULL) + relay->cooldown;
+    relay->cooldown = relay->cooldown * 2 > COOLDOWN_MAX ? COOLDOWN_MAX : relay->cooldown * 2;
+}
+
+void relay_record_result(struct relay *relay, int ok, long response_code) {
+    relay->error_rate = relay->error_rate * (1 - ERROR_RATE_ALPHA) + (ok ? 0 : ERROR_RATE_ALPHA);
+
+    if (ok) {
+        relay->cooldown = COOLDOWN_MIN;
+        return;
+    }
+    if (relay->down_until != 0) {
+        return;
+    }
+    if (response_code == 535) {
+        take_down(relay, "authentication rejected");
+    } else if (relay->error_rate > ERROR_RATE_DOWN) {
+        take_down(relay, "error rate too high");
+    }
+}
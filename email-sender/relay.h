@@ -0,0 +1,138 @@
+/**
+ * relay.h
+ *
+ * The SMTP relays (servers and accounts) mail can be sent through. Each
+ * relay has its own session pool and a weight; new transfers are spread
+ * across relays by smooth weighted round-robin. A relay whose recent
+ * error rate climbs too high, or whose credentials are rejected, is taken
+ * out of rotation for a cooldown that doubles while it keeps failing.
+ */
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <time.h>
+
+#include "smtp_pool.h"
+
+struct relay {
+    struct smtp_pool pool;         /* Sessions logged in to this relay's account */
+    char *username;                /* Owned copies of the credentials the pool uses */
+    char *password;
+    int index;                     /* Position in the relay set */
+    int weight;                    /* Share of traffic relative to the others */
+    int current_weight;            /* Smooth weighted round-robin state */
+    double error_rate;             /* Moving average of failed transfers (0..1) */
+    time_t down_until;             /* Out of rotation until then (0 = up) */
+    int cooldown;                  /* Seconds of the next time out */
+};
+
+struct relay_set {
+    struct relay *relays;
+    int count;
+    int total_sessions;            /* Sessions in use, the sum of the pool limits */
+    int max_sessions;              /* Largest single pool */
+};
+
+/* Decides whether a relay can take a transfer right now */
+typedef int (*relay_usable_fn)(struct relay *relay, void *arg);
+
+/**
+ * Initializes an empty relay set.
+ *
+ * @param set Set to initialize
+ */
+void relay_set_init(struct relay_set *set);
+
+/**
+ * Adds a relay with its own session pool. The account's address is also
+ * used as the envelope sender for mail sent through it.
+ *
+ * @param set        Set to add to
+ * @param server     SMTP server hostname
+ * @param port       SMTP server port
+ * @param username   Account (email address) to log in with
+ * @param password   Account password
+ * @param weight     Relative share of traffic (at least 1)
+ * @param pool_size  Sessions to keep for this relay
+ * @param noop_after See smtp_pool_init()
+ * @param max_sends  See smtp_pool_init()
+ * @return           0 on success, -1 on failure
+ */
+int relay_set_add(struct relay_set *set, const char *server, const char *port,
+                  const char *username, const char *password, int weight,
+                  int pool_size, int noop_after, int max_sends);
+
+/**
+ * Adds every relay listed in a file, one per line:
+ *
+ *     host port username password [weight]
+ *
+ * Blank lines and lines starting with '#' are ignored. Fields are
+ * separated by whitespace, so passwords must not contain any.
+ *
+ * @param set        Set to add to
+ * @param path       File to read
+ * @param pool_size  Sessions per relay
+ * @param noop_after See smtp_pool_init()
+ * @param max_sends  See smtp_pool_init()
+ * @return           Number of relays added, or -1 on failure
+ */
+int relay_set_load(struct relay_set *set, const char *path,
+                   int pool_size, int noop_after, int max_sends);
+
+/**
+ * Changes how many sessions of each relay's pool are used, e.g. after the
+ * pool size setting changed.
+ *
+ * @param set   Relays to resize
+ * @param limit Sessions per relay, at most the pool size it was added with
+ */
+void relay_set_limit_sessions(struct relay_set *set, int limit);
+
+/**
+ * Closes every relay's sessions.
+ *
+ * @param set Set to destroy
+ */
+void relay_set_destroy(struct relay_set *set);
+
+/**
+ * Picks the relay for the next transfer among those in rotation that
+ * usable() accepts, by weight. The relay at index avoid (e.g. the one a
+ * retried ticket last failed on) is only chosen when nothing else is.
+ *
+ * @param set    Relays to choose from
+ * @param avoid  Index of a relay to avoid, or -1
+ * @param usable Filter, e.g. "has an idle session"
+ * @param arg    Opaque pointer passed to usable
+ * @return       Chosen relay, or NULL if none is usable
+ */
+struct relay *relay_set_pick(struct relay_set *set, int avoid, relay_usable_fn usable, void *arg);
+
+/**
+ * Tells whether a relay is in rotation.
+ *
+ * @param relay Relay to check
+ * @return      1 if up, 0 while it is timed out
+ */
+int relay_is_up(struct relay *relay);
+
+/**
+ * Milliseconds until the first timed out relay returns to rotation.
+ *
+ * @param set Relays to check
+ * @return    Delay, or -1 if no relay is down
+ */
+long relay_set_next_recovery_ms(const struct relay_set *set);
+
+/**
+ * Feeds the result of a transfer into the relay's health.
+ *
+ * @param relay         Relay the transfer used
+ * @param ok            Non-zero if it succeeded
+ * @param response_code Last SMTP response code (535 takes the relay out at once)
+ */
+void relay_record_result(struct relay *relay, int ok, long response_code);
+
+#endif /* RELAY_H */
@@ -0,0 +1,144 @@
+/**
+ * retry_queue.c
+ *
+ * Min-heap retry scheduler declared in retry_queue.h.
+ */
+
+#include "retry_queue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+static void swap(struct retry_entry *a, struct retry_entry *b) {
+    struct retry_entry tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void sift_up(struct retry_entry *heap, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap[parent].due_usec <= heap[i].due_usec) {
+            break;
+        }
+        swap(&heap[parent], &heap[i]);
+        i = parent;
+    }
+}
+
+static void sift_down(struct retry_entry *heap, int count, int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+
+        if (left < count && heap[left].due_usec < heap[smallest].due_usec) {
+            smallest = left;
+        }
+        if (right < count && heap[right].due_usec < heap[smallest].due_usec) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        swap(&heap[i], &heap[smallest]);
+        i = smallest;
+    }
+}
+
+/**
+ * Arms the timer for the earliest entry, or disarms it when empty.
+ */
+static void rearm(struct retry_queue *queue) {
+    if (queue->count == 0) {
+        event_loop_timer_disarm(queue->timer);
+        return;
+    }
+
+    uint64_t now = metrics_now_usec();
+    uint64_t due = queue->heap[0].due_usec;
+    long delay_ms = due > now ? (long)((due - now + 999) / 1000) : 0;
+
+    if (event_loop_timer_arm(queue->timer, delay_ms, 0) < 0) {
+        log_error("Failed to arm retry timer");
+    }
+}
+
+static void on_retry_timer(struct event_loop *loop, struct loop_timer *timer, void *arg) {
+    struct retry_queue *queue = arg;
+    uint64_t now = metrics_now_usec();
+
+    (void)loop;
+    (void)timer;
+    while (queue->count > 0 && queue->heap[0].due_usec <= now) {
+        struct ticket *ticket = queue->heap[0].ticket;
+
+        queue->heap[0] = queue->heap[--queue->count];
+        sift_down(queue->heap, queue->count, 0);
+        queue->due(ticket, queue->due_arg);
+    }
+    rearm(queue);
+}
+
+int retry_queue_init(struct retry_queue *queue, struct event_loop *loop,
+                     retry_due_callback due, void *arg) {
+    memset(queue, 0, sizeof(*queue));
+    queue->loop = loop;
+    queue->due = due;
+    queue->due_arg = arg;
+    queue->timer = event_loop_timer_new(loop, on_retry_timer, queue);
+    return queue->timer ? 0 : -1;
+}
+
+void retry_queue_destroy(struct retry_queue *queue) {
+    for (int i = 0; i < queue->count; i++) {
+        ticket_free(queue->heap[i].ticket);
+    }
+    free(queue->heap);
+    queue->heap = NULL;
+    queue->count = 0;
+    event_loop_timer_free(queue->loop, queue->timer);
+}
+
+int retry_queue_add(struct retry_queue *queue, struct ticket *ticket, long delay_ms) {
+    if (queue->count == queue->capacity) {
+        int capacity = queue->capacity ? queue->capacity * 2 : 16;
+        struct retry_entry *heap = realloc(queue->heap, capacity * sizeof(*heap));
+
+        if (!heap) {
+            return -1;
+        }
+        queue->heap = heap;
+        queue->capacity = capacity;
+    }
+
+    int i = queue->count++;
+    queue->heap[i].due_usec = metrics_now_usec() + (uint64_t)delay_ms * 1000;
+    queue->heap[i].ticket = ticket;
+    sift_up(queue->heap, i);
+
+    /* Only a new earliest entry moves the timer */
+    if (queue->heap[0].ticket == ticket) {
+        rearm(queue);
+    }
+    return 0;
+}
+
+long retry_backoff_ms(int attempts, long base_ms, long max_ms) {
+    long delay = base_ms;
+
+    for (int i = 1; i < attempts && delay < max_ms; i++) {
+        delay *= 2;
+    }
+    if (delay > max_ms) {
+        delay = max_ms;
+    }
+
+    /* Equal jitter: somewhere between half and the full delay */
+    long half = delay / 2;
+    return half + (half > 0 ? random() % (half + 1) : 0);
+}
@@ -0,0 +1,77 @@
+/**
+ * retry_queue.h
+ *
+ * Tickets waiting to be sent again after a failed delivery. Tickets are
+ * kept in a min-heap ordered by their next attempt time and a single
+ * event loop timer is armed for the earliest one, so waiting never blocks
+ * the loop and each ticket backs off independently of the others.
+ */
+
+#ifndef RETRY_QUEUE_H
+#define RETRY_QUEUE_H
+
+#include <stdint.h>
+
+#include "event_loop.h"
+#include "ticket.h"
+
+/* Called with each ticket whose retry time has come; takes ownership */
+typedef void (*retry_due_callback)(struct ticket *ticket, void *arg);
+
+struct retry_entry {
+    uint64_t due_usec;             /* metrics_now_usec() time of the next attempt */
+    struct ticket *ticket;
+};
+
+struct retry_queue {
+    struct event_loop *loop;
+    struct loop_timer *timer;      /* Armed for the root of the heap */
+    struct retry_entry *heap;
+    int count;
+    int capacity;
+    retry_due_callback due;
+    void *due_arg;
+};
+
+/**
+ * Initializes an empty retry queue.
+ *
+ * @param queue Queue to initialize
+ * @param loop  Event loop whose timer drives the queue
+ * @param due   Callback receiving tickets that are due
+ * @param arg   Opaque pointer passed to due
+ * @return      0 on success, -1 on failure
+ */
+int retry_queue_init(struct retry_queue *queue, struct event_loop *loop,
+                     retry_due_callback due, void *arg);
+
+/**
+ * Frees the queue and every ticket still waiting in it.
+ *
+ * @param queue Queue to destroy
+ */
+void retry_queue_destroy(struct retry_queue *queue);
+
+/**
+ * Schedules a ticket to be handed back after a delay.
+ *
+ * @param queue    Queue to add to
+ * @param ticket   Ticket to retry (owned by the queue until it is due)
+ * @param delay_ms Milliseconds until the next attempt
+ * @return         0 on success, -1 if out of memory (the ticket is not taken)
+ */
+int retry_queue_add(struct retry_queue *queue, struct ticket *ticket, long delay_ms);
+
+/**
+ * Computes the delay before a retry: exponential in the number of
+ * attempts so far, capped, with random jitter over the upper half so
+ * tickets that failed together do not retry in lockstep.
+ *
+ * @param attempts Failed attempts so far (1 for the first retry)
+ * @param base_ms  Delay before the first retry
+ * @param max_ms   Upper bound on the delay
+ * @return         Delay in milliseconds
+ */
+long retry_backoff_ms(int attempts, long base_ms, long max_ms);
+
+#endif /* RETRY_QUEUE_H */
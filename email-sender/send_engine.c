@@ -0,0 +1,806 @@
+/**
+ * send_engine.c
+ *
+ * curl_multi based delivery engine declared in send_engine.h.
+ */
+
+#include "send_engine.h"
+
+#include "attachment_reader.h"
+#include "logger.h"
+#include "metrics.h"
+#include "payload.h"
+#include "status_writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* What a transfer is currently doing on its session */
+enum transfer_phase {
+    PHASE_NOOP,                   /* Health checking an idle connection */
+    PHASE_SEND                    /* Uploading the message */
+};
+
+/* A ticket (or group of tickets with one message) bound to a session for
+ * the duration of its delivery */
+struct transfer {
+    struct send_engine *engine;
+    struct relay *relay;
+    struct smtp_session *session;
+    struct ticket *ticket;        /* First ticket of the group */
+    struct ticket **members;      /* Every ticket in the group, in RCPT TO order */
+    long *rcpt_codes;             /* Reply to each member's RCPT TO (0 until seen) */
+    int count;
+    int rcpt_sent;                /* RCPT TO commands sent in this phase */
+    int rcpt_pending;             /* Member whose RCPT reply is next, or -1 */
+    enum transfer_phase phase;
+    int retried;                  /* Already retried on a fresh connection */
+    struct curl_slist *recipients;
+    struct payload payload;       /* Headers plus the body read in place */
+    struct attachment_request *fetch; /* Attachment chunk on its way, if any */
+    char message_id[320];         /* Message-ID header value */
+    int recording;                /* Records of it not yet acknowledged */
+};
+
+static void start_queued(struct send_engine *engine);
+
+/**
+ * CURLOPT_DEBUGFUNCTION: picks out the reply to each RCPT TO so rejected
+ * recipients of a group can be told apart from accepted ones, and logs
+ * the protocol trace when the engine's trace flag is set. AUTH lines are
+ * logged without their credentials.
+ */
+static int on_curl_debug(CURL *curl, curl_infotype type, char *data, size_t size, void *arg) {
+    struct transfer *xfer = arg;
+    int trace = xfer->engine->trace;
+
+    (void)curl;
+    switch (type) {
+    case CURLINFO_TEXT:
+        if (trace) {
+            logger_write(LOG_DEBUG, "* %.*s", (int)size, data);
+        }
+        break;
+    case CURLINFO_HEADER_IN:
+        if (trace) {
+            logger_write(LOG_DEBUG, "< %.*s", (int)size, data);
+        }
+        if (xfer->rcpt_pending >= 0 && size >= 3) {
+            xfer->rcpt_codes[xfer->rcpt_pending] = strtol(data, NULL, 10);
+            xfer->rcpt_pending = -1;
+        }
+        break;
+    case CURLINFO_HEADER_OUT:
+        if (trace) {
+            if (size >= 4 && strncasecmp(data, "AUTH", 4) == 0) {
+                logger_write(LOG_DEBUG, "> AUTH (redacted)");
+            } else {
+                logger_write(LOG_DEBUG, "> %.*s", (int)size, data);
+            }
+        }
+        /* curl sends the RCPT commands one at a time, in list order */
+        if (size >= 8 && strncasecmp(data, "RCPT TO:", 8) == 0 && xfer->rcpt_sent < xfer->count) {
+            xfer->rcpt_pending = xfer->rcpt_sent++;
+        }
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+/**
+ * Attachment reader callback: hands the chunk to the payload and lets curl
+ * read again.
+ */
+static void on_chunk(const struct attachment_chunk *chunk, void *arg) {
+    struct transfer *xfer = arg;
+
+    xfer->fetch = NULL;
+    if (chunk) {
+        payload_feed(&xfer->payload, chunk->filename, chunk->content_type, chunk->data,
+                     chunk->len);
+    } else {
+        payload_fail(&xfer->payload);
+    }
+    curl_easy_pause(xfer->session->curl, CURLPAUSE_CONT);
+}
+
+/**
+ * payload_fetch_fn: asks the engine's attachment reader for the next chunk
+ * while curl is paused.
+ */
+static int fetch_chunk(void *arg, int attachment_id, long offset, size_t len) {
+    struct transfer *xfer = arg;
+    struct attachment_reader *reader = xfer->engine->attachments;
+
+    if (!reader) {
+        log_error("Ticket %d has attachments but nothing to read them with", xfer->ticket->id);
+        return -1;
+    }
+    xfer->fetch = attachment_reader_fetch(reader, attachment_id, offset, len, on_chunk, xfer);
+    return xfer->fetch ? 0 : -1;
+}
+
+/**
+ * Withdraws the transfer's chunk request, e.g. when the upload was cut off.
+ */
+static void cancel_fetch(struct transfer *xfer) {
+    if (xfer->fetch) {
+        attachment_reader_cancel(xfer->engine->attachments, xfer->fetch);
+        xfer->fetch = NULL;
+    }
+}
+
+/**
+ * Status writer callback: one member's Message-ID is recorded. Once all
+ * are, the end of the message may go out.
+ */
+static void on_recorded(void *arg) {
+    struct transfer *xfer = arg;
+
+    if (--xfer->recording == 0 && payload_release(&xfer->payload)) {
+        curl_easy_pause(xfer->session->curl, CURLPAUSE_CONT);
+    }
+}
+
+/**
+ * payload_end_fn: the whole message has been uploaded. Before the server
+ * is told it is complete, its Message-ID is recorded for every member, so
+ * a ticket claimed again after a crash in between is known to have
+ * possibly been delivered. The record costs the message one database
+ * round-trip, shared with the other status updates of the moment.
+ */
+static int on_message_end(void *arg) {
+    struct transfer *xfer = arg;
+
+    /* Records made before the upload was restarted are still on their way */
+    if (xfer->recording > 0) {
+        return 0;
+    }
+    for (int i = 0; i < xfer->count; i++) {
+        if (status_writer_push_acked(xfer->engine->status, xfer->members[i]->id,
+                                     OUTCOME_SENDING, xfer->message_id, on_recorded, xfer) == 0) {
+            xfer->recording++;
+        }
+    }
+    return xfer->recording > 0 ? 0 : -1;
+}
+
+/**
+ * Configures the session's handle for the transfer's current phase and
+ * hands it to the multi handle.
+ */
+static int add_transfer(struct send_engine *engine, struct transfer *xfer) {
+    CURL *curl = xfer->session->curl;
+
+    if (xfer->phase == PHASE_NOOP) {
+        smtp_session_setup_noop(&xfer->relay->pool, xfer->session);
+    } else {
+        smtp_session_setup_send(&xfer->relay->pool, xfer->session);
+
+        /* Set the sender and recipient addresses. A group is delivered to
+         * the recipients that were accepted even if others are refused. */
+        curl_easy_setopt(curl, CURLOPT_MAIL_FROM, xfer->relay->pool.username);
+        curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, xfer->recipients);
+        curl_easy_setopt(curl, CURLOPT_MAIL_RCPT_ALLLOWFAILS, xfer->count > 1 ? 1L : 0L);
+        memset(xfer->rcpt_codes, 0, xfer->count * sizeof(*xfer->rcpt_codes));
+        xfer->rcpt_sent = 0;
+        xfer->rcpt_pending = -1;
+
+        /* Configure the email data upload */
+        cancel_fetch(xfer);
+        payload_rewind(&xfer->payload);
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, payload_read);
+        curl_easy_setopt(curl, CURLOPT_READDATA, &xfer->payload);
+        curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+        curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, on_curl_debug);
+        curl_easy_setopt(curl, CURLOPT_DEBUGDATA, xfer);
+    }
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, xfer);
+
+    CURLMcode mc = curl_multi_add_handle(engine->multi, curl);
+    if (mc != CURLM_OK) {
+        log_error("curl_multi_add_handle() failed: %s", curl_multi_strerror(mc));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Releases a transfer's resources and returns its session to the pool.
+ * The ticket is not freed.
+ */
+static void free_transfer(struct transfer *xfer, int ok) {
+    CURL *curl = xfer->session->curl;
+
+    /* Clean up per-message options; the session stays connected */
+    curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, NULL);
+    curl_easy_setopt(curl, CURLOPT_READDATA, NULL);
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, 0L); /* Or curl traces later NOOPs to stderr */
+    curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, NULL);
+    curl_easy_setopt(curl, CURLOPT_DEBUGDATA, NULL);
+    curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 0L);
+    smtp_pool_release(&xfer->relay->pool, xfer->session, ok);
+
+    cancel_fetch(xfer);
+    if (xfer->recording > 0) {
+        status_writer_forget(xfer->engine->status, xfer);
+    }
+    payload_free(&xfer->payload);
+    curl_slist_free_all(xfer->recipients);
+    free(xfer->members);
+    free(xfer->rcpt_codes);
+    free(xfer);
+}
+
+static const char *recipient_domain(const struct ticket *ticket) {
+    const char *at = strrchr(ticket->email, '@');
+    return at ? at + 1 : ticket->email;
+}
+
+/**
+ * Treats temporary SMTP rejections that mean "slow down" as an empty
+ * bucket: 421 for the whole account, 450-452 for the recipient's domain.
+ */
+static void note_throttling(struct send_engine *engine, const struct transfer *xfer,
+                            const struct ticket *ticket, long response_code) {
+    if (response_code == 421 && engine->account_limit) {
+        rate_limiter_drain(engine->account_limit, xfer->relay->pool.username);
+    } else if (response_code >= 450 && response_code <= 452 && engine->domain_limit) {
+        rate_limiter_drain(engine->domain_limit, recipient_domain(ticket));
+    }
+}
+
+/**
+ * Reports a finished delivery once per ticket in it and frees its
+ * transfer. When the transaction went through, members whose RCPT TO was
+ * refused fail on their own with that reply; when it did not, every
+ * member fails with the transfer's error.
+ */
+static void finish_transfer(struct send_engine *engine, struct transfer *xfer,
+                            CURLcode result, long response_code) {
+    struct ticket **members = xfer->members;
+    long *codes = xfer->rcpt_codes;
+    int count = xfer->count;
+    int relay_index = xfer->relay->index;
+
+    relay_record_result(xfer->relay, result == CURLE_OK, response_code);
+
+    /* Report after the session is back in the pool, so callbacks that
+     * submit more work can use it; the arrays are kept until then */
+    for (int i = 0; i < count; i++) {
+        if (result == CURLE_OK && codes[i] >= 300) {
+            log_warn("SMTP server refused recipient %s (%ld)",
+                    members[i]->email, codes[i]);
+            note_throttling(engine, xfer, members[i], codes[i]);
+        }
+        members[i]->same_message = NULL;
+    }
+    xfer->members = NULL;
+    xfer->rcpt_codes = NULL;
+    free_transfer(xfer, result == CURLE_OK);
+    engine->in_flight--;
+    metrics_gauge_add(METRIC_IN_FLIGHT, -1);
+
+    for (int i = 0; i < count; i++) {
+        struct ticket *ticket = members[i];
+        CURLcode member_result = result;
+        long member_code = response_code;
+
+        if (codes[i] >= 300) {
+            member_code = codes[i];
+            if (result == CURLE_OK) {
+                member_result = CURLE_REMOTE_ACCESS_DENIED;
+            }
+        }
+
+        /* Retries prefer a different relay */
+        ticket->failed_relay = member_result == CURLE_OK ? -1 : relay_index;
+        engine->done(engine, ticket, member_result, member_code, engine->done_arg);
+    }
+    free(members);
+    free(codes);
+}
+
+/**
+ * Fails every ticket of a group that could not be given a transfer.
+ */
+static void fail_group(struct send_engine *engine, struct ticket *ticket, CURLcode result) {
+    while (ticket) {
+        struct ticket *next = ticket->same_message;
+
+        ticket->same_message = NULL;
+        engine->done(engine, ticket, result, 0, engine->done_arg);
+        ticket = next;
+    }
+}
+
+/**
+ * Binds a ticket and any tickets grouped with it to a session of the
+ * chosen relay and starts the first transfer phase.
+ */
+static void start_transfer(struct send_engine *engine, struct relay *relay,
+                           struct ticket *ticket) {
+    struct smtp_session *session = smtp_pool_acquire(&relay->pool);
+    struct transfer *xfer = calloc(1, sizeof(*xfer));
+    const char *at;
+    int count = 0;
+
+    for (struct ticket *t = ticket; t; t = t->same_message) {
+        count++;
+    }
+    if (xfer) {
+        xfer->members = malloc(count * sizeof(*xfer->members));
+        xfer->rcpt_codes = calloc(count, sizeof(*xfer->rcpt_codes));
+    }
+    if (!xfer || !xfer->members || !xfer->rcpt_codes) {
+        if (xfer) {
+            free(xfer->members);
+            free(xfer->rcpt_codes);
+            free(xfer);
+        }
+        smtp_pool_release(&relay->pool, session, 1);
+        fail_group(engine, ticket, CURLE_OUT_OF_MEMORY);
+        return;
+    }
+    xfer->engine = engine;
+    xfer->relay = relay;
+    xfer->session = session;
+    xfer->ticket = ticket;
+    xfer->count = count;
+    xfer->rcpt_pending = -1;
+    engine->in_flight++;
+    metrics_gauge_add(METRIC_IN_FLIGHT, 1);
+
+    /* One RCPT TO per ticket; the message itself is uploaded once */
+    count = 0;
+    for (struct ticket *t = ticket; t; t = t->same_message) {
+        struct curl_slist *list = curl_slist_append(xfer->recipients, t->email);
+
+        xfer->members[count++] = t;
+        if (!list) {
+            while ((t = t->same_message) != NULL) {
+                xfer->members[count++] = t;
+            }
+            finish_transfer(engine, xfer, CURLE_OUT_OF_MEMORY, 0);
+            return;
+        }
+        xfer->recipients = list;
+    }
+
+    /* Named after the ticket heading it, every attempt at a message has
+     * the same Message-ID, so receivers can recognize a resend */
+    at = strrchr(relay->pool.username, '@');
+    snprintf(xfer->message_id, sizeof(xfer->message_id), "ticket-%d@%s", ticket->id,
+             at && at[1] ? at + 1 : "email-sender.invalid");
+    if (payload_init_message(&xfer->payload, engine->from_name, relay->pool.username,
+                             xfer->message_id, ticket, fetch_chunk, xfer) < 0) {
+        finish_transfer(engine, xfer, CURLE_OUT_OF_MEMORY, 0);
+        return;
+    }
+    if (engine->status) {
+        xfer->payload.hold = 1;
+        xfer->payload.at_end = on_message_end;
+    }
+
+    /* Connections that have been idle for a while get a NOOP first */
+    xfer->phase = smtp_session_needs_noop(&relay->pool, session) ? PHASE_NOOP : PHASE_SEND;
+    if (add_transfer(engine, xfer) < 0) {
+        finish_transfer(engine, xfer, CURLE_FAILED_INIT, 0);
+    }
+}
+
+/**
+ * Feeds curl's timings for the phase that just finished into the
+ * connect and transfer histograms.
+ */
+static void record_timings(struct transfer *xfer, long new_connections) {
+    CURL *curl = xfer->session->curl;
+    curl_off_t usec;
+
+    /* Reused connections report no connect time */
+    if (new_connections > 0 &&
+        curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &usec) == CURLE_OK && usec > 0) {
+        metrics_observe(METRIC_SMTP_CONNECT_SECONDS, (uint64_t)usec);
+    }
+    if (xfer->phase == PHASE_SEND &&
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &usec) == CURLE_OK) {
+        metrics_observe(METRIC_SMTP_TRANSFER_SECONDS, (uint64_t)usec);
+    }
+}
+
+/**
+ * Moves a transfer whose current phase completed to its next step: from
+ * the NOOP health check to the upload, from a stale connection to a retry
+ * on a fresh one, or to completion.
+ */
+static void on_transfer_done(struct send_engine *engine, struct transfer *xfer, CURLcode result) {
+    CURL *curl = xfer->session->curl;
+    long response_code = 0;
+    long new_connections = 0;
+
+    curl_multi_remove_handle(engine->multi, curl);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &new_connections);
+    record_timings(xfer, new_connections);
+
+    if (xfer->phase == PHASE_NOOP) {
+        /* A failed health check means the cached connection is gone */
+        if (result != CURLE_OK) {
+            log_warn("SMTP NOOP failed (%s), reconnecting", curl_easy_strerror(result));
+            curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
+        }
+        xfer->phase = PHASE_SEND;
+    } else if (result != CURLE_OK && new_connections == 0 && !xfer->retried &&
+               xfer->rcpt_sent == 0 && smtp_error_is_stale_connection(result)) {
+        /* A pooled connection may have been closed by the server while idle;
+         * retry once on a fresh connection before reporting a failure (but
+         * not once recipients were offered, which the server may have kept) */
+        log_warn("SMTP connection was closed by the server, reconnecting");
+        xfer->retried = 1;
+        curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
+    } else {
+        if (result != CURLE_OK) {
+            log_warn("SMTP transfer failed: %s", curl_easy_strerror(result));
+            note_throttling(engine, xfer, xfer->ticket, response_code);
+        }
+        finish_transfer(engine, xfer, result, response_code);
+        return;
+    }
+
+    if (add_transfer(engine, xfer) < 0) {
+        finish_transfer(engine, xfer, CURLE_FAILED_INIT, response_code);
+    }
+}
+
+/**
+ * Collects finished transfers from the multi handle.
+ */
+static void check_multi_info(struct send_engine *engine) {
+    CURLMsg *msg;
+    int pending;
+
+    while ((msg = curl_multi_info_read(engine->multi, &pending)) != NULL) {
+        if (msg->msg == CURLMSG_DONE) {
+            struct transfer *xfer;
+            CURLcode result = msg->data.result;
+
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&xfer);
+            on_transfer_done(engine, xfer, result);
+        }
+    }
+
+    /* Sessions freed above can pick up waiting tickets */
+    start_queued(engine);
+}
+
+/**
+ * Event loop callback for a curl socket.
+ */
+static void on_socket_ready(struct event_loop *loop, int fd, uint32_t events, void *arg) {
+    struct send_engine *engine = arg;
+    int flags = 0;
+    int running;
+
+    (void)loop;
+    if (events & EPOLLIN) {
+        flags |= CURL_CSELECT_IN;
+    }
+    if (events & EPOLLOUT) {
+        flags |= CURL_CSELECT_OUT;
+    }
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        flags |= CURL_CSELECT_ERR;
+    }
+    curl_multi_socket_action(engine->multi, fd, flags, &running);
+    check_multi_info(engine);
+}
+
+/**
+ * Event loop callback for curl's timeout.
+ */
+static void on_timeout(struct event_loop *loop, struct loop_timer *timer, void *arg) {
+    struct send_engine *engine = arg;
+    int running;
+
+    (void)loop;
+    (void)timer;
+    curl_multi_socket_action(engine->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    check_multi_info(engine);
+}
+
+/**
+ * CURLMOPT_SOCKETFUNCTION: mirrors the sockets curl wants watched into the
+ * event loop. The watcher is stored as curl's per-socket pointer.
+ */
+static int on_curl_socket(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp) {
+    struct send_engine *engine = userp;
+    struct io_watcher *w = socketp;
+    uint32_t events = 0;
+
+    (void)easy;
+    if (what == CURL_POLL_REMOVE) {
+        if (w) {
+            event_loop_del_fd(engine->loop, w);
+            curl_multi_assign(engine->multi, s, NULL);
+        }
+        return 0;
+    }
+
+    if (what & CURL_POLL_IN) {
+        events |= EPOLLIN;
+    }
+    if (what & CURL_POLL_OUT) {
+        events |= EPOLLOUT;
+    }
+
+    if (!w) {
+        w = event_loop_add_fd(engine->loop, s, events, on_socket_ready, engine);
+        if (!w) {
+            return -1;
+        }
+        curl_multi_assign(engine->multi, s, w);
+    } else if (event_loop_mod_fd(engine->loop, w, events) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * CURLMOPT_TIMERFUNCTION: (re)arms the engine's timer.
+ */
+static int on_curl_timer(CURLM *multi, long timeout_ms, void *userp) {
+    struct send_engine *engine = userp;
+
+    (void)multi;
+    if (timeout_ms < 0) {
+        event_loop_timer_disarm(engine->timer);
+        return 0;
+    }
+    return event_loop_timer_arm(engine->timer, timeout_ms, 0);
+}
+
+static void pop_queued(struct send_engine *engine) {
+    struct ticket *ticket = engine->queue_head;
+
+    engine->queue_head = ticket->next;
+    if (!engine->queue_head) {
+        engine->queue_tail = NULL;
+    }
+    ticket->next = NULL;
+    engine->queued--;
+}
+
+/**
+ * Relay filter for start_queued(): a free session and, when limited, a
+ * token left on the relay's account.
+ */
+static int relay_can_send(struct relay *relay, void *arg) {
+    struct send_engine *engine = arg;
+
+    return smtp_pool_has_idle(&relay->pool) &&
+           (!engine->account_limit ||
+            rate_limiter_wait_ms(engine->account_limit, relay->pool.username) == 0);
+}
+
+/**
+ * Nothing can start right now: wakes the engine when the first relay that
+ * is only throttled or timed out (rather than busy) becomes usable again.
+ * Busy relays need no timer, since finishing transfers restart the queue.
+ */
+static void schedule_wake(struct send_engine *engine) {
+    long wait_ms = relay_set_next_recovery_ms(engine->relays);
+
+    for (int i = 0; engine->account_limit && i < engine->relays->count; i++) {
+        struct relay *relay = &engine->relays->relays[i];
+        long ms;
+
+        if (!relay_is_up(relay) || !smtp_pool_has_idle(&relay->pool)) {
+            continue;
+        }
+        ms = rate_limiter_wait_ms(engine->account_limit, relay->pool.username);
+        if (ms > 0 && (wait_ms < 0 || ms < wait_ms)) {
+            wait_ms = ms;
+        }
+    }
+    if (wait_ms >= 0) {
+        event_loop_timer_arm(engine->wake_timer, wait_ms, 0);
+    }
+}
+
+/**
+ * Starts queued tickets on free sessions, as far as relay health and the
+ * rate limits allow.
+ */
+static void start_queued(struct send_engine *engine) {
+    while (engine->queue_head && !engine->draining) {
+        struct ticket *ticket = engine->queue_head;
+        const char *domain = recipient_domain(ticket);
+        struct relay *relay;
+        long wait_ms;
+        int same_domain = 0;
+
+        /* A domain over quota only holds up its own tickets (if the ticket
+         * can't be set aside, it is sent anyway). A group is held by the
+         * domain of its first recipient, which needs a token for each of
+         * its recipients there; other domains in the group are charged
+         * without waiting. */
+        if (engine->domain_limit) {
+            for (struct ticket *t = ticket; t; t = t->same_message) {
+                same_domain += strcasecmp(recipient_domain(t), domain) == 0;
+            }
+            wait_ms = rate_limiter_try_take(engine->domain_limit, domain, same_domain);
+            if (wait_ms > 0) {
+                if (retry_queue_add(&engine->throttled, ticket, wait_ms) == 0) {
+                    pop_queued(engine);
+                    continue;
+                }
+                rate_limiter_take(engine->domain_limit, domain, same_domain);
+            }
+        }
+
+        /* Every relay is busy, over its account quota or out of rotation.
+         * The account token is taken once picked: another thread sharing
+         * the account may have used it since the check. */
+        relay = relay_set_pick(engine->relays, ticket->failed_relay, relay_can_send, engine);
+        if (!relay || (engine->account_limit &&
+                       rate_limiter_try_take(engine->account_limit, relay->pool.username, 1) > 0)) {
+            if (engine->domain_limit) {
+                rate_limiter_refund(engine->domain_limit, domain, same_domain);
+            }
+            schedule_wake(engine);
+            return;
+        }
+
+        pop_queued(engine);
+        for (struct ticket *t = ticket; engine->domain_limit && t; t = t->same_message) {
+            if (strcasecmp(recipient_domain(t), domain) != 0) {
+                rate_limiter_take(engine->domain_limit, recipient_domain(t), 1);
+            }
+        }
+        start_transfer(engine, relay, ticket);
+    }
+}
+
+/**
+ * Retry queue callback: a throttled domain has a token again. The ticket
+ * goes back to the front, since it has already waited its turn.
+ */
+static void on_throttle_done(struct ticket *ticket, void *arg) {
+    struct send_engine *engine = arg;
+
+    ticket->next = engine->queue_head;
+    engine->queue_head = ticket;
+    if (!engine->queue_tail) {
+        engine->queue_tail = ticket;
+    }
+    engine->queued++;
+    start_queued(engine);
+}
+
+static void on_wake_timer(struct event_loop *loop, struct loop_timer *timer, void *arg) {
+    (void)loop;
+    (void)timer;
+    start_queued(arg);
+}
+
+int send_engine_init(struct send_engine *engine, struct event_loop *loop, struct relay_set *relays,
+                     const char *from_name, send_done_callback done, void *arg) {
+    memset(engine, 0, sizeof(*engine));
+    engine->loop = loop;
+    engine->relays = relays;
+    engine->from_name = from_name;
+    engine->done = done;
+    engine->done_arg = arg;
+
+    engine->timer = event_loop_timer_new(loop, on_timeout, engine);
+    engine->wake_timer = event_loop_timer_new(loop, on_wake_timer, engine);
+    if (!engine->timer || !engine->wake_timer ||
+        retry_queue_init(&engine->throttled, loop, on_throttle_done, engine) < 0) {
+        event_loop_timer_free(loop, engine->timer);
+        event_loop_timer_free(loop, engine->wake_timer);
+        return -1;
+    }
+    engine->multi = curl_multi_init();
+    if (!engine->multi) {
+        retry_queue_destroy(&engine->throttled);
+        event_loop_timer_free(loop, engine->timer);
+        event_loop_timer_free(loop, engine->wake_timer);
+        return -1;
+    }
+
+    curl_multi_setopt(engine->multi, CURLMOPT_SOCKETFUNCTION, on_curl_socket);
+    curl_multi_setopt(engine->multi, CURLMOPT_SOCKETDATA, engine);
+    curl_multi_setopt(engine->multi, CURLMOPT_TIMERFUNCTION, on_curl_timer);
+    curl_multi_setopt(engine->multi, CURLMOPT_TIMERDATA, engine);
+
+    /* Keep one cached connection per session. Several relays may be
+     * accounts on the same server, so the host limit is the total too. */
+    curl_multi_setopt(engine->multi, CURLMOPT_MAXCONNECTS, (long)relays->total_sessions);
+    curl_multi_setopt(engine->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)relays->total_sessions);
+    return 0;
+}
+
+void send_engine_destroy(struct send_engine *engine) {
+    /* Abort in-flight transfers */
+    for (int r = 0; r < engine->relays->count; r++) {
+        struct smtp_pool *pool = &engine->relays->relays[r].pool;
+
+        for (int i = 0; i < pool->size; i++) {
+            struct smtp_session *session = &pool->sessions[i];
+            struct transfer *xfer = NULL;
+
+            if (!session->busy) {
+                continue;
+            }
+            curl_easy_getinfo(session->curl, CURLINFO_PRIVATE, (char **)&xfer);
+            curl_multi_remove_handle(engine->multi, session->curl);
+            if (xfer) {
+                ticket_free(xfer->ticket);
+                free_transfer(xfer, 0);
+            }
+        }
+    }
+    metrics_gauge_add(METRIC_IN_FLIGHT, -engine->in_flight);
+    engine->in_flight = 0;
+
+    while (engine->queue_head) {
+        struct ticket *ticket = engine->queue_head;
+        engine->queue_head = ticket->next;
+        ticket_free(ticket);
+    }
+    engine->queue_tail = NULL;
+    engine->queued = 0;
+
+    retry_queue_destroy(&engine->throttled);
+    curl_multi_cleanup(engine->multi);
+    event_loop_timer_free(engine->loop, engine->timer);
+    event_loop_timer_free(engine->loop, engine->wake_timer);
+}
+
+void send_engine_set_rate_limits(struct send_engine *engine, struct rate_limiter *account,
+                                 struct rate_limiter *domain) {
+    engine->account_limit = account;
+    engine->domain_limit = domain;
+}
+
+void send_engine_set_attachment_reader(struct send_engine *engine,
+                                      struct attachment_reader *reader) {
+    engine->attachments = reader;
+}
+
+void send_engine_set_status_writer(struct send_engine *engine, struct status_writer *writer) {
+    engine->status = writer;
+}
+
+void send_engine_submit(struct send_engine *engine, struct ticket *ticket) {
+    ticket->next = NULL;
+    if (engine->queue_tail) {
+        engine->queue_tail->next = ticket;
+    } else {
+        engine->queue_head = ticket;
+    }
+    engine->queue_tail = ticket;
+    engine->queued++;
+
+    start_queued(engine);
+}
+
+void send_engine_resize(struct send_engine *engine) {
+    /* The host limit stays at the allocated sessions, so the transfers
+     * still running past a lowered limit do not hold up new ones */
+    curl_multi_setopt(engine->multi, CURLMOPT_MAXCONNECTS, (long)engine->relays->total_sessions);
+    start_queued(engine);
+}
+
+int send_engine_capacity(const struct send_engine *engine) {
+    return engine->relays->total_sessions - engine->in_flight - engine->queued;
+}
+
+void send_engine_drain(struct send_engine *engine) {
+    engine->draining = 1;
+    event_loop_timer_disarm(engine->wake_timer);
+}
@@ -0,0 +1,161 @@
+/**
+ * send_engine.h
+ *
+ * Concurrent SMTP delivery built on curl_multi. Tickets submitted to the
+ * engine are spread over the sessions of a set of relays, with up to one
+ * transfer in flight per session, subject to optional token bucket limits
+ * per sending account and per recipient domain. All curl sockets and
+ * timeouts are driven by the event loop, so sends progress alongside the
+ * libpq socket wait and a completion callback fires as each individual
+ * transfer finishes.
+ *
+ * A submitted ticket may head a group of tickets with the same message
+ * (see ticket_list_group()). The group is sent as one SMTP transaction
+ * with a RCPT TO per ticket, and the callback still fires once per ticket
+ * with that recipient's own result.
+ */
+
+#ifndef SEND_ENGINE_H
+#define SEND_ENGINE_H
+
+#include <curl/curl.h>
+
+#include "event_loop.h"
+#include "rate_limit.h"
+#include "relay.h"
+#include "retry_queue.h"
+#include "ticket.h"
+
+struct send_engine;
+struct attachment_reader;
+struct status_writer;
+
+/**
+ * Called once per submitted ticket when its transfer has finished.
+ * Ownership of the ticket passes back to the callback.
+ *
+ * @param engine        Engine that sent the ticket
+ * @param ticket        Ticket that finished
+ * @param result        CURLE_OK on success, CURLE_REMOTE_ACCESS_DENIED if only this
+ *                      recipient of a group was refused, otherwise the transfer error
+ * @param response_code Last SMTP response code received (0 if none)
+ * @param arg           Opaque pointer given to send_engine_init()
+ */
+typedef void (*send_done_callback)(struct send_engine *engine, struct ticket *ticket,
+                                   CURLcode result, long response_code, void *arg);
+
+struct send_engine {
+    struct event_loop *loop;
+    CURLM *multi;
+    struct loop_timer *timer;      /* Drives curl's internal timeouts */
+    struct relay_set *relays;      /* Where mail can be sent; each relay's account is its sender */
+    const char *from_name;         /* Display name in the From header */
+    struct ticket *queue_head;     /* Tickets waiting for a free session */
+    struct ticket *queue_tail;
+    int queued;
+    int in_flight;
+    struct rate_limiter *account_limit; /* Keyed by relay username (optional) */
+    struct rate_limiter *domain_limit;  /* Keyed by recipient domain (optional) */
+    struct retry_queue throttled;  /* Tickets waiting for their domain's bucket */
+    struct loop_timer *wake_timer; /* Resumes sending when a relay is usable again */
+    int draining;                  /* Finishing in-flight transfers, starting no more */
+    int trace;                     /* Log the SMTP conversation at debug level */
+    struct attachment_reader *attachments; /* Reads attachment chunks (optional) */
+    struct status_writer *status;  /* Records each Message-ID before its message ends (optional) */
+    send_done_callback done;
+    void *done_arg;
+};
+
+/**
+ * Initializes a send engine on top of an event loop and relay set.
+ *
+ * @param engine    Engine to initialize
+ * @param loop      Event loop driving the transfers
+ * @param relays    Relays to send through (their sessions bound concurrency)
+ * @param from_name Display name for the From header
+ * @param done      Completion callback
+ * @param arg       Opaque pointer passed to the callback
+ * @return          0 on success, -1 on failure
+ */
+int send_engine_init(struct send_engine *engine, struct event_loop *loop, struct relay_set *relays,
+                     const char *from_name, send_done_callback done, void *arg);
+
+/**
+ * Aborts outstanding transfers and releases the engine. Queued and
+ * in-flight tickets are freed without invoking the completion callback.
+ *
+ * @param engine Engine to destroy
+ */
+void send_engine_destroy(struct send_engine *engine);
+
+/**
+ * Applies rate limits to future transfers. A ticket whose recipient
+ * domain is out of tokens is set aside until its bucket refills while
+ * tickets for other domains keep going; when the account is out of
+ * tokens nothing starts until it refills.
+ *
+ * @param engine  Engine to limit
+ * @param account Per-account limiter, or NULL
+ * @param domain  Per-domain limiter, or NULL
+ */
+void send_engine_set_rate_limits(struct send_engine *engine, struct rate_limiter *account,
+                                 struct rate_limiter *domain);
+
+/**
+ * Applies a change in the relays' session limits (see
+ * relay_set_limit_sessions()): curl keeps no more idle connections cached
+ * than there are sessions in use, closing the oldest.
+ *
+ * @param engine Engine to update
+ */
+void send_engine_resize(struct send_engine *engine);
+
+/**
+ * Sets where attachment chunks are read from while messages are uploaded.
+ * Without a reader, tickets with attachments fail.
+ *
+ * @param engine Engine to configure
+ * @param reader Reader driven by the engine's event loop, or NULL
+ */
+void send_engine_set_attachment_reader(struct send_engine *engine,
+                                      struct attachment_reader *reader);
+
+/**
+ * Sets where each message's Message-ID is recorded (OUTCOME_SENDING, for
+ * every ticket it goes to) before the server is told the message is
+ * complete. The end of the message is held back until the record is
+ * acknowledged, so a ticket claimed again after a crash is known to have
+ * possibly been delivered. Without a writer nothing is recorded.
+ *
+ * @param engine Engine to configure
+ * @param writer Writer driven by the engine's event loop, or NULL
+ */
+void send_engine_set_status_writer(struct send_engine *engine, struct status_writer *writer);
+
+/**
+ * Queues a ticket for delivery; the engine takes ownership of it.
+ * The transfer starts immediately if a session is free.
+ *
+ * @param engine Engine to send with
+ * @param ticket Ticket to send
+ */
+void send_engine_submit(struct send_engine *engine, struct ticket *ticket);
+
+/**
+ * Number of additional tickets that can start sending right away.
+ *
+ * @param engine Engine to query
+ * @return       Free sessions minus tickets already waiting for one
+ */
+int send_engine_capacity(const struct send_engine *engine);
+
+/**
+ * Stops starting transfers, for shutdown. Those in flight carry on and
+ * still report through the callback; queued tickets stay queued until
+ * the engine is destroyed.
+ *
+ * @param engine Engine to drain
+ */
+void send_engine_drain(struct send_engine *engine);
+
+#endif /* SEND_ENGINE_H */
@@ -0,0 +1,275 @@
+/**
+ * settings.c
+ *
+ * Live settings declared in settings.h. Reclamation is quiescent-state
+ * based: each reader thread records the version that was current when it
+ * last went back to its event loop, so a replaced version is no longer in
+ * use once every reader has recorded a newer one. Only the publishing
+ * thread frees versions; readers never wait or take a lock.
+ */
+
+#include "settings.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+#define MAX_LINE 1024
+
+/* A published version, with the list of replaced ones awaiting reclamation */
+struct settings_version {
+    struct settings values;
+    struct settings_version *next;
+};
+
+enum setting_kind {
+    SETTING_INT,
+    SETTING_LEVEL                 /* Level name, stored as an int */
+};
+
+struct setting {
+    const char *name;             /* Also the environment variable */
+    size_t offset;                /* Of the int in struct settings */
+    enum setting_kind kind;
+    int default_value;
+    int min;
+    int max;
+};
+
+#define FIELD(f) offsetof(struct settings, f)
+
+static const struct setting table[] = {
+    { "CLAIM_BATCH_SIZE", FIELD(claim_batch_size), SETTING_INT, 32, 1, SETTINGS_CLAIM_BATCH_MAX },
+    { "MAX_RCPT_PER_MESSAGE", FIELD(max_rcpt_per_message), SETTING_INT, 50, 1, INT_MAX },
+    { "SMTP_POOL_SIZE", FIELD(smtp_pool_size), SETTING_INT, 4, 1, INT_MAX },
+    { "RATE_LIMIT_ACCOUNT", FIELD(rate_limit_account), SETTING_INT, 0, 0, INT_MAX },
+    { "RATE_LIMIT_ACCOUNT_BURST", FIELD(rate_limit_account_burst), SETTING_INT, 10, 1, INT_MAX },
+    { "RATE_LIMIT_DOMAIN", FIELD(rate_limit_domain), SETTING_INT, 0, 0, INT_MAX },
+    { "RATE_LIMIT_DOMAIN_BURST", FIELD(rate_limit_domain_burst), SETTING_INT, 5, 1, INT_MAX },
+    { "RETRY_MAX_ATTEMPTS", FIELD(retry_max_attempts), SETTING_INT, 5, 0, INT_MAX },
+    { "RETRY_BASE_SECONDS", FIELD(retry_base_seconds), SETTING_INT, 30, 0, INT_MAX },
+    { "RETRY_MAX_SECONDS", FIELD(retry_max_seconds), SETTING_INT, 3600, 0, INT_MAX },
+    { "PRIORITY_WEIGHT_HIGH", FIELD(priority_weights[PRIORITY_HIGH]), SETTING_INT, 16, 1, 1000 },
+    { "PRIORITY_WEIGHT_NORMAL", FIELD(priority_weights[PRIORITY_NORMAL]), SETTING_INT, 4, 1, 1000 },
+    { "PRIORITY_WEIGHT_BULK", FIELD(priority_weights[PRIORITY_BULK]), SETTING_INT, 1, 1, 1000 },
+    { "LOG_LEVEL", FIELD(log_level), SETTING_LEVEL, LOG_INFO, LOG_DEBUG, LOG_ERROR },
+    { "LOG_BODIES", FIELD(log_bodies), SETTING_INT, 0, 0, 1 },
+    { "LOG_SMTP_TRACE", FIELD(log_smtp_trace), SETTING_INT, 0, 0, 1 },
+};
+
+#define SETTING_COUNT ((int)(sizeof(table) / sizeof(table[0])))
+
+static _Atomic(struct settings_version *) current;
+static struct settings_version *retired; /* Newest first (publishing thread only) */
+static struct settings_reader *readers;  /* Likewise */
+static unsigned long last_version;
+
+static int *field(struct settings *s, const struct setting *setting) {
+    return (int *)((char *)s + setting->offset);
+}
+
+static const struct setting *find(const char *name) {
+    for (int i = 0; i < SETTING_COUNT; i++) {
+        if (strcmp(table[i].name, name) == 0) {
+            return &table[i];
+        }
+    }
+    return NULL;
+}
+
+static int parse(const struct setting *setting, const char *value, int *out, const char **error) {
+    char *end;
+    long n;
+
+    if (setting->kind == SETTING_LEVEL) {
+        if ((*out = logger_parse_level(value)) < 0) {
+            *error = "expected debug, info, warn or error";
+            return -1;
+        }
+        return 0;
+    }
+    errno = 0;
+    n = strtol(value, &end, 10);
+    while (*end == ' ' || *end == '\t') {
+        end++;
+    }
+    if (end == value || *end || errno == ERANGE) {
+        *error = "expected an integer";
+        return -1;
+    }
+    *out = n < setting->min ? setting->min : n > setting->max ? setting->max : (int)n;
+    return 0;
+}
+
+void settings_from_env(struct settings *s) {
+    memset(s, 0, sizeof(*s));
+    for (int i = 0; i < SETTING_COUNT; i++) {
+        const char *value = getenv(table[i].name);
+        const char *error;
+
+        *field(s, &table[i]) = table[i].default_value;
+        if (value && *value && parse(&table[i], value, field(s, &table[i]), &error) < 0) {
+            log_warn("Ignoring %s=%s: %s", table[i].name, value, error);
+            *field(s, &table[i]) = table[i].default_value;
+        }
+    }
+}
+
+int settings_set(struct settings *s, const char *name, const char *value, const char **error) {
+    const struct setting *setting = find(name);
+    int parsed;
+
+    if (!setting) {
+        *error = "unknown setting";
+        return -1;
+    }
+    if (parse(setting, value, &parsed, error) < 0) {
+        return -1;
+    }
+    *field(s, setting) = parsed;
+    return 0;
+}
+
+int settings_read_file(struct settings *s, const char *path) {
+    FILE *f = fopen(path, "r");
+    char line[MAX_LINE];
+    int line_no = 0;
+
+    if (!f) {
+        log_error("%s: %s", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *name = line + strspn(line, " \t");
+        char *value = strchr(name, '=');
+        const char *error;
+        size_t len;
+
+        line_no++;
+        name[strcspn(name, "\r\n")] = '\0';
+        if (*name == '\0' || *name == '#') {
+            continue;
+        }
+        if (!value) {
+            log_warn("%s:%d: expected NAME=value", path, line_no);
+            continue;
+        }
+        len = (size_t)(value - name);
+        while (len > 0 && (name[len - 1] == ' ' || name[len - 1] == '\t')) {
+            len--;
+        }
+        name[len] = '\0';
+        value += 1 + strspn(value + 1, " \t");
+        if (settings_set(s, name, value, &error) < 0) {
+            log_warn("%s:%d: ignoring %s: %s", path, line_no, name, error);
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+int settings_print(const struct settings *s, const char *name, FILE *out) {
+    int found = 0;
+
+    for (int i = 0; i < SETTING_COUNT; i++) {
+        int value = *(const int *)((const char *)s + table[i].offset);
+
+        if (name && strcmp(name, table[i].name) != 0) {
+            continue;
+        }
+        if (table[i].kind == SETTING_LEVEL) {
+            fprintf(out, "%s=%s\n", table[i].name, logger_level_name((enum log_level)value));
+        } else {
+            fprintf(out, "%s=%d\n", table[i].name, value);
+        }
+        found = 1;
+    }
+    return found || !name ? 0 : -1;
+}
+
+/**
+ * Frees the replaced versions no reader can still hold: those older than
+ * the version every reader has seen since.
+ */
+static void reclaim(void) {
+    unsigned long oldest = last_version;
+    struct settings_version **link = &retired;
+
+    for (struct settings_reader *r = readers; r; r = r->next) {
+        unsigned long seen = atomic_load(&r->seen);
+
+        if (seen < oldest) {
+            oldest = seen;
+        }
+    }
+    /* The list is newest first: once a version can be freed, so can
+     * every one after it */
+    while (*link && (*link)->values.version >= oldest) {
+        link = &(*link)->next;
+    }
+    while (*link) {
+        struct settings_version *next = (*link)->next;
+
+        free(*link);
+        *link = next;
+    }
+}
+
+int settings_publish(const struct settings *s) {
+    struct settings_version *version = malloc(sizeof(*version));
+    struct settings_version *old;
+
+    if (!version) {
+        return -1;
+    }
+    version->values = *s;
+    version->values.version = ++last_version;
+    version->next = NULL;
+    old = atomic_exchange(&current, version);
+    if (old) {
+        old->next = retired;
+        retired = old;
+    }
+    reclaim();
+    return 0;
+}
+
+const struct settings *settings_get(void) {
+    return &atomic_load(&current)->values;
+}
+
+void settings_reader_register(struct settings_reader *reader) {
+    atomic_init(&reader->seen, last_version);
+    reader->next = readers;
+    readers = reader;
+}
+
+void settings_reader_unregister(struct settings_reader *reader) {
+    for (struct settings_reader **link = &readers; *link; link = &(*link)->next) {
+        if (*link == reader) {
+            *link = reader->next;
+            break;
+        }
+    }
+    reclaim();
+}
+
+void settings_quiescent(struct settings_reader *reader) {
+    atomic_store(&reader->seen, atomic_load(&current)->values.version);
+}
+
+void settings_cleanup(void) {
+    struct settings_version *version = atomic_exchange(&current, NULL);
+
+    free(version);
+    while (retired) {
+        struct settings_version *next = retired->next;
+
+        free(retired);
+        retired = next;
+    }
+}
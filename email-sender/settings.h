@@ -0,0 +1,138 @@
+/**
+ * settings.h
+ *
+ * The tuning that can change while the sender runs: claim batch size,
+ * session pool size, rate limits, retry backoff, priority weights and
+ * logging. Values come from the environment, then from an optional config
+ * file of NAME=value lines using the same names, which is read again on
+ * SIGHUP; the admin socket can also set them one at a time.
+ *
+ * A complete set of values is published as one immutable version, RCU
+ * style: the pointer to the current version is swapped atomically, and
+ * readers on any thread load it without a lock, using it only until they
+ * next return to their event loop. A replaced version is freed once every
+ * registered reader thread has been back to its loop since.
+ */
+
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "ticket_db.h"
+
+#define SETTINGS_CLAIM_BATCH_MAX 4096 /* Ticket ring capacity, so the largest claim batch */
+
+struct settings {
+    int claim_batch_size;         /* Tickets claimed per round-trip and kept in the ring */
+    int max_rcpt_per_message;     /* Tickets with the same message sent in one transaction */
+    int smtp_pool_size;           /* Sessions used per relay per thread (up to SMTP_POOL_MAX) */
+    int rate_limit_account;       /* Messages per minute through an account (0 = unlimited) */
+    int rate_limit_account_burst;
+    int rate_limit_domain;        /* Messages per minute to a recipient domain (0 = unlimited) */
+    int rate_limit_domain_burst;
+    int retry_max_attempts;       /* Delivery attempts before a ticket is marked 'failed' */
+    int retry_base_seconds;       /* Backoff before the first retry, doubled per attempt */
+    int retry_max_seconds;        /* Upper bound on the backoff */
+    int priority_weights[PRIORITY_LANES]; /* Share of each claim lane while all have work */
+    int log_level;                /* enum log_level */
+    int log_bodies;               /* Include message bodies in debug records */
+    int log_smtp_trace;           /* Log the SMTP conversation at debug level */
+    unsigned long version;        /* Assigned when published, from 1 */
+};
+
+/* A thread that reads the published settings */
+struct settings_reader {
+    atomic_ulong seen;            /* Version current when it was last back in its loop */
+    struct settings_reader *next;
+};
+
+/**
+ * Fills in every setting from the environment, with the defaults and
+ * bounds of each. Values that cannot be parsed are logged and replaced by
+ * the default.
+ *
+ * @param s Settings to fill in
+ */
+void settings_from_env(struct settings *s);
+
+/**
+ * Applies a config file of NAME=value lines on top of s. Blank lines and
+ * lines starting with '#' are ignored; unknown names and bad values are
+ * logged and skipped.
+ *
+ * @param s    Settings to update
+ * @param path File to read
+ * @return     0 on success, -1 if the file could not be read
+ */
+int settings_read_file(struct settings *s, const char *path);
+
+/**
+ * Sets one value by name, clamped to the setting's bounds.
+ *
+ * @param s     Settings to update
+ * @param name  Setting name, as in the environment (e.g. "CLAIM_BATCH_SIZE")
+ * @param value New value
+ * @param error Receives a static description on failure
+ * @return      0 on success, -1 if the name is unknown or the value invalid
+ */
+int settings_set(struct settings *s, const char *name, const char *value, const char **error);
+
+/**
+ * Writes one value as NAME=value.
+ *
+ * @param s    Settings to read
+ * @param name Setting name, or NULL for every setting, one per line
+ * @param out  Stream to write to
+ * @return     0 on success, -1 if the name is unknown
+ */
+int settings_print(const struct settings *s, const char *name, FILE *out);
+
+/**
+ * Publishes a copy of s as the current version. Must only be called from
+ * one thread, the same that registers readers. Versions no reader can
+ * still be using are freed.
+ *
+ * @param s New settings
+ * @return  0 on success, -1 if out of memory (the current version stays)
+ */
+int settings_publish(const struct settings *s);
+
+/**
+ * Returns the current version. Lock-free; the pointer stays valid until
+ * the calling thread returns to its event loop (for a reader) or next
+ * publishes (for the publishing thread).
+ *
+ * @return Current settings (settings_publish() must have been called)
+ */
+const struct settings *settings_get(void);
+
+/**
+ * Adds a reader thread, before it starts.
+ *
+ * @param reader Reader to register
+ */
+void settings_reader_register(struct settings_reader *reader);
+
+/**
+ * Removes a reader thread, after it stopped.
+ *
+ * @param reader Reader to unregister
+ */
+void settings_reader_unregister(struct settings_reader *reader);
+
+/**
+ * Records that the thread holds no settings pointer, e.g. before it waits
+ * for events. Lock-free.
+ *
+ * @param reader Calling thread's reader
+ */
+void settings_quiescent(struct settings_reader *reader);
+
+/**
+ * Frees every version. No thread may read the settings afterwards.
+ */
+void settings_cleanup(void);
+
+#endif /* SETTINGS_H */
@@ -0,0 +1,208 @@
+/**
+ * smtp_pool.c
+ *
+ * Implementation of the persistent SMTP session pool declared in smtp_pool.h.
+ */
+
+#include "smtp_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+/**
+ * Discards server responses (e.g. to NOOP) that libcurl would otherwise
+ * write to stdout.
+ */
+static size_t discard_response(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    (void)ptr;
+    (void)userdata;
+    return size * nmemb;
+}
+
+/**
+ * Applies the connection-level options shared by every transfer on a
+ * session: server, credentials and TLS settings.
+ */
+static CURL *create_handle(struct smtp_pool *pool) {
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        return NULL;
+    }
+
+    curl_easy_setopt(curl, CURLOPT_URL, pool->url);
+    curl_easy_setopt(curl, CURLOPT_USERNAME, pool->username);
+    curl_easy_setopt(curl, CURLOPT_PASSWORD, pool->password);
+
+    /* Configure TLS/SSL security settings */
+    curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_ALL);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 2L);
+
+    /* Detect half-open connections while a session sits idle */
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+    /* Sessions live on sender threads, where signal based timeouts are unsafe */
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_response);
+
+    return curl;
+}
+
+int smtp_pool_init(struct smtp_pool *pool, int size, const char *server, const char *port,
+                   const char *username, const char *password, int noop_after,
+                   unsigned int max_sends) {
+    memset(pool, 0, sizeof(*pool));
+    snprintf(pool->url, sizeof(pool->url), "smtps://%s:%s", server, port);
+    snprintf(pool->host, sizeof(pool->host), "%s", server);
+    snprintf(pool->port, sizeof(pool->port), "%s", port);
+    pool->username = username;
+    pool->password = password;
+    pool->noop_after = noop_after;
+    pool->max_sends = max_sends;
+
+    pool->sessions = calloc(size, sizeof(*pool->sessions));
+    if (!pool->sessions) {
+        return -1;
+    }
+    pool->size = size;
+    pool->limit = size;
+
+    for (int i = 0; i < size; i++) {
+        pool->sessions[i].curl = create_handle(pool);
+        if (!pool->sessions[i].curl) {
+            log_error("Failed to create SMTP session %d", i);
+            smtp_pool_destroy(pool);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void smtp_pool_use_dns(struct smtp_pool *pool, struct dns_cache *cache) {
+    pool->dns_entry = dns_cache_add(cache, pool->host);
+    pool->dns = pool->dns_entry ? cache : NULL;
+}
+
+void smtp_pool_destroy(struct smtp_pool *pool) {
+    for (int i = 0; i < pool->size; i++) {
+        if (pool->sessions[i].curl) {
+            curl_easy_cleanup(pool->sessions[i].curl);
+        }
+        curl_slist_free_all(pool->sessions[i].resolve);
+    }
+    free(pool->sessions);
+    pool->sessions = NULL;
+    pool->size = 0;
+    pool->limit = 0;
+}
+
+void smtp_pool_set_limit(struct smtp_pool *pool, int limit) {
+    pool->limit = limit < 1 ? 1 : limit > pool->size ? pool->size : limit;
+}
+
+struct smtp_session *smtp_pool_acquire(struct smtp_pool *pool) {
+    struct smtp_session *best = NULL;
+
+    /* Prefer the most recently used session: the connection it last used
+     * is the most likely to still be open */
+    for (int i = 0; i < pool->limit; i++) {
+        struct smtp_session *s = &pool->sessions[i];
+        if (!s->busy && (!best || s->last_used > best->last_used)) {
+            best = s;
+        }
+    }
+    if (best) {
+        best->busy = 1;
+    }
+    return best;
+}
+
+int smtp_pool_has_idle(const struct smtp_pool *pool) {
+    for (int i = 0; i < pool->limit; i++) {
+        if (!pool->sessions[i].busy) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void smtp_pool_release(struct smtp_pool *pool, struct smtp_session *session, int ok) {
+    session->busy = 0;
+    if (!ok) {
+        /* libcurl drops a connection that failed; the next transfer reconnects */
+        session->last_used = 0;
+        session->sends = 0;
+        return;
+    }
+    session->last_used = time(NULL);
+    session->sends++;
+    if (pool->max_sends > 0 && session->sends >= pool->max_sends) {
+        session->sends = 0; /* The connection was closed via FORBID_REUSE */
+    }
+}
+
+int smtp_session_needs_noop(const struct smtp_pool *pool, const struct smtp_session *session) {
+    return session->last_used != 0 && pool->noop_after > 0 &&
+           time(NULL) - session->last_used >= pool->noop_after;
+}
+
+/**
+ * Points the handle at the server's cached addresses when they have
+ * changed since it was last set up. The handle is not in a transfer, so
+ * the list it held can be freed.
+ */
+static void update_resolve(const struct smtp_pool *pool, struct smtp_session *session) {
+    char line[sizeof(pool->dns_entry->addresses) + 300];
+    struct curl_slist *list = NULL;
+    unsigned long generation;
+
+    if (!pool->dns || atomic_load(&pool->dns_entry->generation) == session->resolve_generation) {
+        return;
+    }
+    generation = dns_entry_format(pool->dns, pool->dns_entry, pool->port, line, sizeof(line));
+    if (line[0] && !(list = curl_slist_append(NULL, line))) {
+        return; /* Tried again before the next transfer */
+    }
+    curl_easy_setopt(session->curl, CURLOPT_RESOLVE, list);
+    curl_slist_free_all(session->resolve);
+    session->resolve = list;
+    session->resolve_generation = generation;
+}
+
+void smtp_session_setup_noop(const struct smtp_pool *pool, struct smtp_session *session) {
+    update_resolve(pool, session);
+
+    /* With NOBODY set, a custom request is sent as a bare SMTP command */
+    curl_easy_setopt(session->curl, CURLOPT_UPLOAD, 0L);
+    curl_easy_setopt(session->curl, CURLOPT_MAIL_RCPT, NULL);
+    curl_easy_setopt(session->curl, CURLOPT_CUSTOMREQUEST, "NOOP");
+    curl_easy_setopt(session->curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(session->curl, CURLOPT_FORBID_REUSE, 0L);
+}
+
+void smtp_session_setup_send(const struct smtp_pool *pool, struct smtp_session *session) {
+    update_resolve(pool, session);
+
+    curl_easy_setopt(session->curl, CURLOPT_CUSTOMREQUEST, NULL);
+    curl_easy_setopt(session->curl, CURLOPT_NOBODY, 0L);
+    curl_easy_setopt(session->curl, CURLOPT_UPLOAD, 1L);
+
+    /* Ask curl to close the connection after the last permitted message */
+    curl_easy_setopt(session->curl, CURLOPT_FORBID_REUSE,
+                     (pool->max_sends > 0 && session->sends + 1 >= pool->max_sends) ? 1L : 0L);
+}
+
+int smtp_error_is_stale_connection(CURLcode code) {
+    switch (code) {
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_WEIRD_SERVER_REPLY:
+        return 1;
+    default:
+        return 0;
+    }
+}
@@ -0,0 +1,150 @@
+/**
+ * smtp_pool.h
+ *
+ * A pool of long-lived, authenticated SMTP sessions. Each session wraps a
+ * curl easy handle that is reused across messages. The handles are driven
+ * by the send engine's curl multi handle, whose connection cache keeps the
+ * underlying TCP/TLS connections (and the SMTP AUTH state) alive between
+ * tickets instead of reconnecting for every email. The pool size bounds
+ * both the number of transfers in flight and the number of connections.
+ * With a DNS cache, new connections use the addresses it holds instead of
+ * resolving the server's name.
+ */
+
+#ifndef SMTP_POOL_H
+#define SMTP_POOL_H
+
+#include <curl/curl.h>
+#include <time.h>
+
+#include "dns_cache.h"
+
+struct smtp_session {
+    CURL *curl;              /* Reused easy handle owning the connection */
+    time_t last_used;        /* When the session last completed a transfer (0 = never) */
+    unsigned int sends;      /* Messages sent over the current connection */
+    int busy;                /* Checked out by smtp_pool_acquire() */
+    struct curl_slist *resolve; /* CURLOPT_RESOLVE line last set on the handle */
+    unsigned long resolve_generation; /* DNS entry generation it was built from */
+};
+
+struct smtp_pool {
+    struct smtp_session *sessions;
+    int size;
+    int limit;               /* Sessions handed out, the first ones (up to size) */
+    char url[256];           /* smtps://server:port */
+    char host[256];
+    char port[16];
+    struct dns_cache *dns;   /* Where the server's addresses come from (optional) */
+    struct dns_entry *dns_entry;
+    const char *username;
+    const char *password;
+    int noop_after;          /* Idle seconds after which a NOOP health check is sent */
+    unsigned int max_sends;  /* Messages per connection before it is recycled (0 = unlimited) */
+};
+
+/**
+ * Creates the pool's sessions. Connections are opened lazily on first use.
+ *
+ * @param pool       Pool to initialize
+ * @param size       Number of sessions
+ * @param server     SMTPS server hostname
+ * @param port       SMTPS server port
+ * @param username   SMTP AUTH username
+ * @param password   SMTP AUTH password
+ * @param noop_after Idle seconds before a session is health checked
+ * @param max_sends  Messages per connection before recycling (0 = unlimited)
+ * @return           0 on success, -1 on failure
+ */
+int smtp_pool_init(struct smtp_pool *pool, int size, const char *server, const char *port,
+                   const char *username, const char *password, int noop_after,
+                   unsigned int max_sends);
+
+/**
+ * Has new connections use the server's addresses from a DNS cache, which
+ * starts resolving it in the background. Without a cache (or while it has
+ * no answer yet) curl resolves the name itself.
+ *
+ * @param pool  Pool to configure
+ * @param cache Cache shared by every pool
+ */
+void smtp_pool_use_dns(struct smtp_pool *pool, struct dns_cache *cache);
+
+/**
+ * Closes every session and frees the pool.
+ *
+ * @param pool Pool to destroy
+ */
+void smtp_pool_destroy(struct smtp_pool *pool);
+
+/**
+ * Changes how many of the pool's sessions are used. Sessions past the
+ * limit that are busy finish their transfer first.
+ *
+ * @param pool  Pool to resize
+ * @param limit Sessions to use, clamped to 1..size
+ */
+void smtp_pool_set_limit(struct smtp_pool *pool, int limit);
+
+/**
+ * Checks out the most recently used idle session.
+ *
+ * @param pool Pool to take a session from
+ * @return     Session, or NULL if every session is busy
+ */
+struct smtp_session *smtp_pool_acquire(struct smtp_pool *pool);
+
+/**
+ * Tells whether smtp_pool_acquire() would return a session.
+ *
+ * @param pool Pool to check
+ * @return     1 if a session is idle, 0 if all are busy
+ */
+int smtp_pool_has_idle(const struct smtp_pool *pool);
+
+/**
+ * Returns a session to the pool after a transfer.
+ *
+ * @param pool    Owning pool
+ * @param session Session returned by smtp_pool_acquire()
+ * @param ok      Non-zero if the transfer succeeded
+ */
+void smtp_pool_release(struct smtp_pool *pool, struct smtp_session *session, int ok);
+
+/**
+ * Tells whether a session has been idle long enough that its connection
+ * should be health checked with NOOP before the next message.
+ *
+ * @param pool    Owning pool
+ * @param session Session to check
+ * @return        1 if a NOOP should be sent first, 0 otherwise
+ */
+int smtp_session_needs_noop(const struct smtp_pool *pool, const struct smtp_session *session);
+
+/**
+ * Configures a session's handle to issue a bare SMTP NOOP.
+ *
+ * @param pool    Owning pool
+ * @param session Session to configure
+ */
+void smtp_session_setup_noop(const struct smtp_pool *pool, struct smtp_session *session);
+
+/**
+ * Configures a session's handle to upload a message. The caller still sets
+ * the envelope and read callback.
+ *
+ * @param pool    Owning pool
+ * @param session Session to configure
+ */
+void smtp_session_setup_send(const struct smtp_pool *pool, struct smtp_session *session);
+
+/**
+ * Tells whether a curl error means the (reused) connection was closed by
+ * the server, in which case the transfer is worth retrying on a fresh one.
+ *
+ * @param code Result of the failed transfer
+ * @return     1 if the connection was stale, 0 otherwise
+ */
+int smtp_error_is_stale_connection(CURLcode code);
+
+#endif /* SMTP_POOL_H */
@@ -0,0 +1,76 @@
+/**
+ * smtp_share.c
+ *
+ * Process-wide curl share handle declared in smtp_share.h.
+ */
+
+#include "smtp_share.h"
+
+#include <string.h>
+
+#include "logger.h"
+
+static void lock_share(CURL *curl, curl_lock_data data, curl_lock_access access, void *arg) {
+    struct smtp_share *share = arg;
+
+    (void)curl;
+    (void)access;
+    pthread_mutex_lock(&share->locks[data]);
+}
+
+static void unlock_share(CURL *curl, curl_lock_data data, void *arg) {
+    struct smtp_share *share = arg;
+
+    (void)curl;
+    pthread_mutex_unlock(&share->locks[data]);
+}
+
+int smtp_share_init(struct smtp_share *share) {
+    CURLSHcode rc;
+
+    memset(share, 0, sizeof(*share));
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&share->locks[i], NULL);
+    }
+    share->share = curl_share_init();
+    if (!share->share) {
+        smtp_share_destroy(share);
+        return -1;
+    }
+
+    /* Connections are not shared: libcurl does not support sharing its
+     * connection cache between threads, and each thread's multi handle
+     * already keeps its own sessions' connections alive */
+    curl_share_setopt(share->share, CURLSHOPT_LOCKFUNC, lock_share);
+    curl_share_setopt(share->share, CURLSHOPT_UNLOCKFUNC, unlock_share);
+    curl_share_setopt(share->share, CURLSHOPT_USERDATA, share);
+    rc = curl_share_setopt(share->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    if (rc == CURLSHE_OK) {
+        rc = curl_share_setopt(share->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    }
+    if (rc != CURLSHE_OK) {
+        log_error("Failed to set up curl share: %s", curl_share_strerror(rc));
+        smtp_share_destroy(share);
+        return -1;
+    }
+    return 0;
+}
+
+void smtp_share_destroy(struct smtp_share *share) {
+    if (share->share) {
+        CURLSHcode rc = curl_share_cleanup(share->share);
+
+        if (rc != CURLSHE_OK) {
+            log_error("Failed to release curl share: %s", curl_share_strerror(rc));
+            return; /* Still in use, so the locks must stay */
+        }
+        share->share = NULL;
+    }
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&share->locks[i]);
+    }
+}
+
+void smtp_share_attach(struct smtp_share *share, CURL *curl) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, share->share);
+}
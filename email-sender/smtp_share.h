@@ -0,0 +1,46 @@
+/**
+ * smtp_share.h
+ *
+ * A curl share handle used by every SMTP session of the process, so that
+ * sender threads reuse each other's TLS sessions and resolved names. A new
+ * connection to a relay some session has already talked to resumes its
+ * TLS session instead of doing a full handshake. The share is locked per
+ * kind of data, since sessions on different threads use it at once.
+ */
+
+#ifndef SMTP_SHARE_H
+#define SMTP_SHARE_H
+
+#include <curl/curl.h>
+#include <pthread.h>
+
+struct smtp_share {
+    CURLSH *share;
+    pthread_mutex_t locks[CURL_LOCK_DATA_LAST]; /* One per curl_lock_data */
+};
+
+/**
+ * Creates the share handle.
+ *
+ * @param share Share to initialize
+ * @return      0 on success, -1 on failure
+ */
+int smtp_share_init(struct smtp_share *share);
+
+/**
+ * Releases the share handle. Every easy handle using it must have been
+ * cleaned up first.
+ *
+ * @param share Share to destroy
+ */
+void smtp_share_destroy(struct smtp_share *share);
+
+/**
+ * Has an easy handle use the share.
+ *
+ * @param share Share to use
+ * @param curl  Handle not in a transfer
+ */
+void smtp_share_attach(struct smtp_share *share, CURL *curl);
+
+#endif /* SMTP_SHARE_H */
@@ -0,0 +1,356 @@
+/**
+ * status_writer.c
+ *
+ * Pipelined status writer declared in status_writer.h.
+ */
+
+#include "status_writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+struct status_update {
+    int ticket_id;
+    enum ticket_outcome outcome;
+    char *error;                  /* Owned copy, NULL for OUTCOME_COMPLETED */
+    uint64_t sent_usec;           /* When it was sent, for the latency histogram */
+    status_ack_fn done;           /* Run on acknowledgement (NULL = none, or run) */
+    void *done_arg;
+    struct status_update *next;
+};
+
+static void append(struct status_update **head, struct status_update **tail,
+                   struct status_update *u) {
+    u->next = NULL;
+    if (*tail) {
+        (*tail)->next = u;
+    } else {
+        *head = u;
+    }
+    *tail = u;
+}
+
+static struct status_update *pop(struct status_update **head, struct status_update **tail) {
+    struct status_update *u = *head;
+
+    if (u) {
+        *head = u->next;
+        if (!*head) {
+            *tail = NULL;
+        }
+        u->next = NULL;
+    }
+    return u;
+}
+
+static void free_update(struct status_update *u) {
+    free(u->error);
+    free(u);
+}
+
+/**
+ * Runs an update's acknowledgement callback, once.
+ */
+static void acknowledge(struct status_update *u) {
+    status_ack_fn done = u->done;
+
+    u->done = NULL;
+    if (done) {
+        done(u->done_arg);
+    }
+}
+
+static void acknowledge_list(struct status_update *u) {
+    for (; u; u = u->next) {
+        acknowledge(u);
+    }
+}
+
+static void free_list(struct status_update *u) {
+    while (u) {
+        struct status_update *next = u->next;
+        free_update(u);
+        u = next;
+    }
+}
+
+static void on_socket_ready(struct event_loop *loop, int fd, uint32_t events, void *arg);
+
+/**
+ * The status connection is gone: close it and reconnect in the
+ * background. Updates sent but not acknowledged go back to the front of
+ * the queue, so they are sent again in their original order. Applying one
+ * twice is harmless, except that a retry may be counted twice. Nobody
+ * waits for their acknowledgement through the outage: their callbacks run
+ * now.
+ */
+static void fail(struct status_writer *writer, const char *what) {
+    log_error("Status writer failed to %s: %s", what, PQerrorMessage(writer->conn));
+
+    if (writer->sent_tail) {
+        writer->sent_tail->next = writer->queued_head;
+        if (!writer->queued_head) {
+            writer->queued_tail = writer->sent_tail;
+        }
+        writer->queued_head = writer->sent_head;
+        writer->queued += writer->sent;
+    }
+    writer->sent_head = writer->sent_tail = NULL;
+    writer->sent = 0;
+    writer->syncs = 0;
+    writer->want_write = 0;
+
+    event_loop_del_fd(writer->loop, writer->watcher);
+    writer->watcher = NULL;
+    PQfinish(writer->conn);
+    writer->conn = NULL;
+    db_connector_start(&writer->connector);
+    acknowledge_list(writer->queued_head);
+}
+
+static void schedule_flush(struct status_writer *writer) {
+    if (writer->conn && !writer->flush_armed && event_loop_timer_arm(writer->flush_timer, 0, 0) == 0) {
+        writer->flush_armed = 1;
+    }
+}
+
+/**
+ * Pushes buffered output to the server, watching for writability while
+ * libpq still holds data the socket could not take.
+ */
+static void flush_output(struct status_writer *writer) {
+    int r = PQflush(writer->conn);
+    int want_write = (r == 1);
+
+    if (r < 0) {
+        fail(writer, "send updates");
+        return;
+    }
+    if (want_write != writer->want_write) {
+        writer->want_write = want_write;
+        event_loop_mod_fd(writer->loop, writer->watcher, EPOLLIN | (want_write ? EPOLLOUT : 0));
+    }
+}
+
+/**
+ * Sends every queued update followed by a single pipeline sync.
+ */
+static void send_queued(struct status_writer *writer) {
+    struct status_update *u;
+
+    if (!writer->queued_head) {
+        return;
+    }
+
+    while ((u = pop(&writer->queued_head, &writer->queued_tail)) != NULL) {
+        writer->queued--;
+        if (ticket_db_send_outcome(writer->conn, u->ticket_id, u->outcome, u->error) < 0) {
+            /* Back to the front; fail() puts the sent ones before it */
+            u->next = writer->queued_head;
+            writer->queued_head = u;
+            if (!writer->queued_tail) {
+                writer->queued_tail = u;
+            }
+            writer->queued++;
+            fail(writer, "queue update");
+            return;
+        }
+        u->sent_usec = metrics_now_usec();
+        append(&writer->sent_head, &writer->sent_tail, u);
+        writer->sent++;
+    }
+
+    if (!PQpipelineSync(writer->conn)) {
+        fail(writer, "sync pipeline");
+        return;
+    }
+    writer->syncs++;
+    flush_output(writer);
+}
+
+/**
+ * Matches results (which arrive in the order updates were sent) against
+ * the in-flight list.
+ */
+static void read_results(struct status_writer *writer) {
+    if (!PQconsumeInput(writer->conn)) {
+        fail(writer, "read results");
+        return;
+    }
+
+    while (!PQisBusy(writer->conn) && (writer->sent_head || writer->syncs > 0)) {
+        PGresult *res = PQgetResult(writer->conn);
+
+        if (!res) {
+            continue; /* End of one query's results */
+        }
+
+        ExecStatusType status = PQresultStatus(res);
+        if (PQstatus(writer->conn) == CONNECTION_BAD) {
+            /* The error is the connection's, not the update's */
+            PQclear(res);
+            fail(writer, "read results");
+            return;
+        }
+        if (status == PGRES_PIPELINE_SYNC) {
+            writer->syncs--;
+        } else {
+            struct status_update *u = pop(&writer->sent_head, &writer->sent_tail);
+
+            writer->sent--;
+            if (!u) {
+                log_error("Status writer received an unexpected result");
+            } else if (status == PGRES_PIPELINE_ABORTED) {
+                /* An earlier update in the same sync failed; try this one again */
+                append(&writer->queued_head, &writer->queued_tail, u);
+                writer->queued++;
+                schedule_flush(writer);
+            } else {
+                metrics_observe(METRIC_DB_UPDATE_SECONDS, metrics_now_usec() - u->sent_usec);
+                if (status != PGRES_COMMAND_OK) {
+                    log_error("Failed to update status of ticket %d: %s",
+                            u->ticket_id, PQresultErrorMessage(res));
+                }
+                acknowledge(u);
+                free_update(u);
+            }
+        }
+        PQclear(res);
+    }
+}
+
+static void on_socket_ready(struct event_loop *loop, int fd, uint32_t events, void *arg) {
+    struct status_writer *writer = arg;
+
+    (void)loop;
+    (void)fd;
+    if (events & EPOLLOUT) {
+        flush_output(writer);
+    }
+    if (writer->conn && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        read_results(writer);
+    }
+}
+
+static void on_flush_timer(struct event_loop *loop, struct loop_timer *timer, void *arg) {
+    struct status_writer *writer = arg;
+
+    (void)loop;
+    (void)timer;
+    writer->flush_armed = 0;
+    if (writer->conn) {
+        send_queued(writer);
+    }
+}
+
+/**
+ * Switches a prepared connection to pipeline mode and starts watching it.
+ * The connection is left open on failure.
+ */
+static int attach(struct status_writer *writer, PGconn *conn) {
+    if (PQsetnonblocking(conn, 1) != 0 || !PQenterPipelineMode(conn)) {
+        log_error("Failed to enter pipeline mode: %s", PQerrorMessage(conn));
+        return -1;
+    }
+    writer->watcher = event_loop_add_fd(writer->loop, PQsocket(conn), EPOLLIN, on_socket_ready,
+                                        writer);
+    if (!writer->watcher) {
+        return -1;
+    }
+    writer->conn = conn;
+    return 0;
+}
+
+/**
+ * Connector callback: a replacement connection is up. Everything queued
+ * meanwhile goes out on it.
+ */
+static int on_reconnected(PGconn *conn, void *arg) {
+    struct status_writer *writer = arg;
+
+    if (ticket_db_prepare(conn) < 0 || attach(writer, conn) < 0) {
+        return -1;
+    }
+    log_info("Status writer reconnected, resending %d update(s)", writer->queued);
+    if (writer->queued > 0) {
+        schedule_flush(writer);
+    }
+    return 0;
+}
+
+int status_writer_init(struct status_writer *writer, struct event_loop *loop, PGconn *conn,
+                       const char *conninfo) {
+    memset(writer, 0, sizeof(*writer));
+    writer->loop = loop;
+
+    writer->flush_timer = event_loop_timer_new(loop, on_flush_timer, writer);
+    if (!writer->flush_timer ||
+        db_connector_init(&writer->connector, loop, conninfo, on_reconnected, writer) < 0 ||
+        attach(writer, conn) < 0) {
+        db_connector_destroy(&writer->connector);
+        event_loop_timer_free(loop, writer->flush_timer);
+        PQfinish(conn);
+        return -1;
+    }
+    return 0;
+}
+
+void status_writer_destroy(struct status_writer *writer) {
+    if (writer->queued + writer->sent > 0) {
+        log_error("Status writer dropping %d unacknowledged update(s)",
+                writer->queued + writer->sent);
+    }
+    free_list(writer->queued_head);
+    free_list(writer->sent_head);
+    db_connector_destroy(&writer->connector);
+    event_loop_timer_free(writer->loop, writer->flush_timer);
+    event_loop_del_fd(writer->loop, writer->watcher);
+    PQfinish(writer->conn);
+}
+
+void status_writer_push(struct status_writer *writer, int ticket_id, enum ticket_outcome outcome,
+                        const char *error) {
+    status_writer_push_acked(writer, ticket_id, outcome, error, NULL, NULL);
+}
+
+int status_writer_push_acked(struct status_writer *writer, int ticket_id,
+                             enum ticket_outcome outcome, const char *error,
+                             status_ack_fn done, void *arg) {
+    struct status_update *u = malloc(sizeof(*u));
+
+    if (!u) {
+        log_error("Out of memory queueing status of ticket %d", ticket_id);
+        return -1;
+    }
+    u->ticket_id = ticket_id;
+    u->outcome = outcome;
+    u->error = error ? strdup(error) : NULL;
+    /* While the database is unreachable there is no point in waiting */
+    u->done = writer->conn ? done : NULL;
+    u->done_arg = arg;
+    append(&writer->queued_head, &writer->queued_tail, u);
+    writer->queued++;
+    schedule_flush(writer);
+    return u->done ? 0 : -1;
+}
+
+void status_writer_forget(struct status_writer *writer, void *arg) {
+    for (struct status_update *u = writer->queued_head; u; u = u->next) {
+        if (u->done_arg == arg) {
+            u->done = NULL;
+        }
+    }
+    for (struct status_update *u = writer->sent_head; u; u = u->next) {
+        if (u->done_arg == arg) {
+            u->done = NULL;
+        }
+    }
+}
+
+int status_writer_pending(const struct status_writer *writer) {
+    return writer->queued + writer->sent;
+}
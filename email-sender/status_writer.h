@@ -0,0 +1,120 @@
+/**
+ * status_writer.h
+ *
+ * Batched, asynchronous ticket status updates. Outcomes pushed while the
+ * event loop dispatches a round of completed transfers are sent together
+ * on a dedicated connection in libpq pipeline mode and flushed with one
+ * sync, so a whole batch costs a single network round-trip and the loop
+ * never waits for the database to acknowledge them. If the connection is
+ * lost the writer reconnects in the background and sends again everything
+ * not yet acknowledged.
+ *
+ * An update can carry a callback run once it has been acknowledged, for
+ * callers that must not go on until it is durable (see OUTCOME_SENDING).
+ */
+
+#ifndef STATUS_WRITER_H
+#define STATUS_WRITER_H
+
+#include <postgresql/libpq-fe.h>
+
+#include "db_connect.h"
+#include "event_loop.h"
+#include "ticket_db.h"
+
+#ifndef LIBPQ_HAS_PIPELINING
+#error "libpq 14 or newer is required for pipeline mode"
+#endif
+
+struct status_update;
+
+/* Runs when an update pushed with status_writer_push_acked() has been
+ * acknowledged, or once its connection is lost (it is still sent again
+ * later, but nothing waits for that) */
+typedef void (*status_ack_fn)(void *arg);
+
+struct status_writer {
+    struct event_loop *loop;
+    PGconn *conn;                       /* Dedicated connection in pipeline mode, NULL while lost */
+    struct db_connector connector;      /* Replaces a lost connection */
+    struct io_watcher *watcher;
+    struct loop_timer *flush_timer;     /* Fires once per loop iteration with updates pending */
+    struct status_update *queued_head;  /* Pushed, not yet sent */
+    struct status_update *queued_tail;
+    struct status_update *sent_head;    /* Sent, awaiting their results (in order) */
+    struct status_update *sent_tail;
+    int queued;
+    int sent;
+    int syncs;                          /* Pipeline syncs awaiting PGRES_PIPELINE_SYNC */
+    int flush_armed;
+    int want_write;                     /* Output is buffered until the socket is writable */
+};
+
+/**
+ * Sets up a writer on an open connection and switches it to pipeline
+ * mode. The writer takes ownership of the connection.
+ *
+ * @param writer   Writer to initialize
+ * @param loop     Event loop driving the connection
+ * @param conn     Dedicated connection, already prepared with ticket_db_prepare()
+ * @param conninfo Connection string for reconnecting (not copied)
+ * @return         0 on success, -1 on failure (the connection is closed)
+ */
+int status_writer_init(struct status_writer *writer, struct event_loop *loop, PGconn *conn,
+                       const char *conninfo);
+
+/**
+ * Closes the writer's connection. Updates not yet acknowledged are lost.
+ *
+ * @param writer Writer to destroy
+ */
+void status_writer_destroy(struct status_writer *writer);
+
+/**
+ * Queues a ticket's outcome. It is sent with everything else pushed
+ * during the current loop iteration.
+ *
+ * @param writer    Writer to queue on
+ * @param ticket_id Ticket that finished
+ * @param outcome   What happened to it
+ * @param error     Error text to record (copied), or NULL
+ */
+void status_writer_push(struct status_writer *writer, int ticket_id, enum ticket_outcome outcome,
+                        const char *error);
+
+/**
+ * Queues a ticket's outcome like status_writer_push(), with a callback
+ * to run once it is acknowledged. The callback never runs from within
+ * this call, and not at all if the writer has no connection to wait on.
+ *
+ * @param writer    Writer to queue on
+ * @param ticket_id Ticket the update is for
+ * @param outcome   What happened to it
+ * @param error     Error text to record (copied), or NULL
+ * @param done      Acknowledgement callback
+ * @param arg       Opaque pointer passed to done
+ * @return          0 if done will run, -1 if not (the update may still be
+ *                  queued)
+ */
+int status_writer_push_acked(struct status_writer *writer, int ticket_id,
+                             enum ticket_outcome outcome, const char *error,
+                             status_ack_fn done, void *arg);
+
+/**
+ * Drops the callbacks of every pending update pushed with arg; the
+ * updates themselves are still sent.
+ *
+ * @param writer Writer the updates were pushed on
+ * @param arg    Opaque pointer given to status_writer_push_acked()
+ */
+void status_writer_forget(struct status_writer *writer, void *arg);
+
+/**
+ * Number of updates not yet acknowledged by the server.
+ *
+ * @param writer Writer to query
+ * @return       Queued plus in-flight updates
+ */
+int status_writer_pending(const struct status_writer *writer);
+
+#endif /* STATUS_WRITER_H */
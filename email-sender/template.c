@@ -0,0 +1,507 @@
+/**
+ * template.c
+ *
+ * Template parsing, parameter binding and the template cache declared in
+ * template.h.
+ */
+
+#include "template.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int name_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_' || c == '-' || c == '.';
+}
+
+static int var_index(struct template *t, const char *name, size_t len) {
+    for (int i = 0; i < t->var_count; i++) {
+        if (t->vars[i].len == len && memcmp(t->vars[i].name, name, len) == 0) {
+            return i;
+        }
+    }
+    t->vars[t->var_count].name = name;
+    t->vars[t->var_count].len = len;
+    return t->var_count++;
+}
+
+/**
+ * Counts the "{{" in text, which bounds its placeholders.
+ */
+static int count_openings(const char *text) {
+    int n = 0;
+
+    for (const char *p = text; (p = strstr(p, "{{")) != NULL; p += 2) {
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Splits text into literal runs and placeholders. Anything between braces
+ * that is not a plain name ({{ x }}, letters, digits, '_', '-' and '.') is
+ * kept as literal text.
+ *
+ * @return Number of parts written
+ */
+static int parse(struct template *t, const char *text, struct template_part *parts) {
+    const char *literal = text;
+    const char *p = text;
+    int n = 0;
+
+    while ((p = strstr(p, "{{")) != NULL) {
+        const char *name = p + 2;
+        const char *end = strstr(name, "}}");
+        size_t len;
+        size_t i;
+
+        if (!end) {
+            break;
+        }
+        while (*name == ' ') {
+            name++;
+        }
+        len = name < end ? (size_t)(end - name) : 0;
+        while (len > 0 && name[len - 1] == ' ') {
+            len--;
+        }
+        for (i = 0; i < len && name_char(name[i]); i++) {
+        }
+        if (len == 0 || i < len) {
+            p += 2;
+            continue;
+        }
+
+        if (p > literal) {
+            parts[n].text = literal;
+            parts[n].len = (size_t)(p - literal);
+            parts[n].var = -1;
+            n++;
+        }
+        parts[n].text = NULL;
+        parts[n].len = 0;
+        parts[n].var = var_index(t, name, len);
+        n++;
+        literal = p = end + 2;
+    }
+    if (*literal) {
+        parts[n].text = literal;
+        parts[n].len = strlen(literal);
+        parts[n].var = -1;
+        n++;
+    }
+    return n;
+}
+
+struct template *template_compile(int id, const char *subject, const char *body) {
+    size_t subject_len = strlen(subject);
+    size_t body_len = strlen(body);
+    int subject_max = 2 * count_openings(subject) + 1;
+    int body_max = 2 * count_openings(body) + 1;
+    struct template *t = calloc(1, sizeof(*t));
+
+    if (!t) {
+        return NULL;
+    }
+    t->id = id;
+    atomic_init(&t->refs, 1);
+    t->text = malloc(subject_len + body_len + 2);
+    t->subject = malloc((size_t)(subject_max + body_max) * sizeof(*t->subject));
+    t->vars = malloc((size_t)(subject_max + body_max) / 2 * sizeof(*t->vars));
+    if (!t->text || !t->subject || !t->vars) {
+        template_release(t);
+        return NULL;
+    }
+
+    /* The parts point into one copy of both strings */
+    memcpy(t->text, subject, subject_len + 1);
+    memcpy(t->text + subject_len + 1, body, body_len + 1);
+    t->subject_parts = parse(t, t->text, t->subject);
+    t->body = t->subject + t->subject_parts;
+    t->body_parts = parse(t, t->text + subject_len + 1, t->body);
+    return t;
+}
+
+void template_release(struct template *t) {
+    if (t && atomic_fetch_sub(&t->refs, 1) == 1) {
+        free(t->text);
+        free(t->subject);
+        free(t->vars);
+        free(t);
+    }
+}
+
+static void skip_space(const char **p) {
+    while (**p == ' ' || **p == '\t' || **p == '\n' || **p == '\r') {
+        (*p)++;
+    }
+}
+
+static int hex_value(const char *p) {
+    int value = 0;
+
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+
+        value <<= 4;
+        if (c >= '0' && c <= '9') {
+            value |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            value |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            value |= c - 'A' + 10;
+        } else {
+            return -1;
+        }
+    }
+    return value;
+}
+
+static size_t put_utf8(char *out, uint32_t code) {
+    if (code < 0x80) {
+        out[0] = (char)code;
+        return 1;
+    }
+    if (code < 0x800) {
+        out[0] = (char)(0xc0 | (code >> 6));
+        out[1] = (char)(0x80 | (code & 0x3f));
+        return 2;
+    }
+    if (code < 0x10000) {
+        out[0] = (char)(0xe0 | (code >> 12));
+        out[1] = (char)(0x80 | ((code >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (code & 0x3f));
+        return 3;
+    }
+    out[0] = (char)(0xf0 | (code >> 18));
+    out[1] = (char)(0x80 | ((code >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((code >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (code & 0x3f));
+    return 4;
+}
+
+/**
+ * Reads a JSON string starting at its opening quote, unescaped into out
+ * (never longer than its escaped form).
+ *
+ * @return Length written, or -1 if the string is malformed
+ */
+static long read_string(const char **p, char *out) {
+    const char *s = *p + 1;
+    size_t len = 0;
+
+    while (*s != '"') {
+        if (*s == '\0') {
+            return -1;
+        }
+        if (*s != '\\') {
+            out[len++] = *s++;
+            continue;
+        }
+        s++;
+        switch (*s) {
+        case '"': case '\\': case '/': out[len++] = *s; break;
+        case 'b': out[len++] = '\b'; break;
+        case 'f': out[len++] = '\f'; break;
+        case 'n': out[len++] = '\n'; break;
+        case 'r': out[len++] = '\r'; break;
+        case 't': out[len++] = '\t'; break;
+        case 'u': {
+            int high = hex_value(s + 1);
+            uint32_t code = (uint32_t)high;
+
+            if (high < 0) {
+                return -1;
+            }
+            s += 4;
+            /* A pair of UTF-16 surrogates encodes one code point */
+            if (high >= 0xd800 && high < 0xdc00 && s[1] == '\\' && s[2] == 'u') {
+                int low = hex_value(s + 3);
+
+                if (low >= 0xdc00 && low < 0xe000) {
+                    code = 0x10000 + (((uint32_t)high - 0xd800) << 10) + ((uint32_t)low - 0xdc00);
+                    s += 6;
+                }
+            }
+            len += put_utf8(out + len, code);
+            break;
+        }
+        default:
+            return -1;
+        }
+        s++;
+    }
+    *p = s + 1;
+    return (long)len;
+}
+
+/**
+ * Reads a number, true, false or null as its literal text (null as
+ * nothing).
+ *
+ * @return Length written, or -1 for anything else (objects, arrays)
+ */
+static long read_scalar(const char **p, char *out) {
+    const char *s = *p;
+    size_t len;
+
+    if (strncmp(s, "null", 4) == 0) {
+        *p = s + 4;
+        return 0;
+    }
+    if (strncmp(s, "true", 4) == 0 || strncmp(s, "false", 5) == 0) {
+        len = s[0] == 't' ? 4 : 5;
+    } else {
+        for (len = 0; (s[len] >= '0' && s[len] <= '9') || s[len] == '-' || s[len] == '+' ||
+                      s[len] == '.' || s[len] == 'e' || s[len] == 'E'; len++) {
+        }
+        if (len == 0) {
+            return -1;
+        }
+    }
+    memcpy(out, s, len);
+    *p = s + len;
+    return (long)len;
+}
+
+/**
+ * Parses a flat JSON object, storing the value of each key that names one
+ * of the template's vars. Keys and values are unescaped into storage.
+ */
+static const char *parse_params(const struct template *t, const char *params,
+                                struct template_value *values, char *storage) {
+    const char *p = params;
+
+    skip_space(&p);
+    if (*p != '{') {
+        return "template params are not a JSON object";
+    }
+    p++;
+    skip_space(&p);
+    if (*p == '}') {
+        return NULL;
+    }
+    for (;;) {
+        const char *key = storage;
+        long key_len;
+        long value_len;
+
+        if (*p != '"' || (key_len = read_string(&p, storage)) < 0) {
+            return "malformed template params";
+        }
+        storage += key_len;
+        skip_space(&p);
+        if (*p != ':') {
+            return "malformed template params";
+        }
+        p++;
+        skip_space(&p);
+        if (*p == '"') {
+            if ((value_len = read_string(&p, storage)) < 0) {
+                return "malformed template params";
+            }
+        } else if ((value_len = read_scalar(&p, storage)) < 0) {
+            return "template params must be strings, numbers or booleans";
+        }
+        for (int i = 0; i < t->var_count; i++) {
+            if (t->vars[i].len == (size_t)key_len && memcmp(t->vars[i].name, key, key_len) == 0) {
+                values[i].data = storage;
+                values[i].len = (size_t)value_len;
+                break;
+            }
+        }
+        storage += value_len;
+
+        skip_space(&p);
+        if (*p == '}') {
+            return NULL;
+        }
+        if (*p != ',') {
+            return "malformed template params";
+        }
+        p++;
+        skip_space(&p);
+    }
+}
+
+struct template_args *template_bind(const struct template *t, const char *params,
+                                    const char **error) {
+    size_t params_len;
+    size_t subject_len = 0;
+    struct template_args *args;
+    char *subject;
+
+    if (!params || !*params) {
+        params = "{}";
+    }
+    params_len = strlen(params);
+
+    /* One allocation holds the values and the strings they point to */
+    args = calloc(1, sizeof(*args) + (size_t)t->var_count * sizeof(*args->values) + params_len);
+    if (!args) {
+        *error = "out of memory binding template params";
+        return NULL;
+    }
+    args->values = (struct template_value *)(args + 1);
+    *error = parse_params(t, params, args->values, (char *)(args->values + t->var_count));
+    for (int i = 0; !*error && i < t->var_count; i++) {
+        if (!args->values[i].data) {
+            *error = "template parameter missing from params";
+        }
+    }
+    if (*error) {
+        free(args);
+        return NULL;
+    }
+
+    for (int i = 0; i < t->subject_parts; i++) {
+        const struct template_part *part = &t->subject[i];
+
+        subject_len += part->text ? part->len : args->values[part->var].len;
+    }
+    args->subject = subject = malloc(subject_len + 1);
+    if (!subject) {
+        *error = "out of memory binding template params";
+        free(args);
+        return NULL;
+    }
+    for (int i = 0; i < t->subject_parts; i++) {
+        const struct template_part *part = &t->subject[i];
+        const char *data = part->text ? part->text : args->values[part->var].data;
+        size_t len = part->text ? part->len : args->values[part->var].len;
+
+        memcpy(subject, data, len);
+        subject += len;
+    }
+    *subject = '\0';
+
+    /* A line break in a value must not end the Subject header */
+    for (subject = args->subject; *subject; subject++) {
+        if (*subject == '\r' || *subject == '\n') {
+            *subject = ' ';
+        }
+    }
+    return args;
+}
+
+void template_args_free(struct template_args *args) {
+    if (args) {
+        free(args->subject);
+        free(args);
+    }
+}
+
+static struct template **bucket(struct template_cache *cache, int id) {
+    return &cache->buckets[(uint32_t)id * 2654435761u & cache->mask];
+}
+
+static void lru_unlink(struct template_cache *cache, struct template *t) {
+    if (t->lru_prev) {
+        t->lru_prev->lru_next = t->lru_next;
+    } else {
+        cache->lru_head = t->lru_next;
+    }
+    if (t->lru_next) {
+        t->lru_next->lru_prev = t->lru_prev;
+    } else {
+        cache->lru_tail = t->lru_prev;
+    }
+    t->lru_prev = t->lru_next = NULL;
+}
+
+static void lru_push_front(struct template_cache *cache, struct template *t) {
+    t->lru_prev = NULL;
+    t->lru_next = cache->lru_head;
+    if (cache->lru_head) {
+        cache->lru_head->lru_prev = t;
+    } else {
+        cache->lru_tail = t;
+    }
+    cache->lru_head = t;
+}
+
+/**
+ * Unlinks a cached template and drops the cache's reference.
+ */
+static void remove_entry(struct template_cache *cache, struct template *t) {
+    struct template **link = bucket(cache, t->id);
+
+    while (*link != t) {
+        link = &(*link)->hash_next;
+    }
+    *link = t->hash_next;
+    lru_unlink(cache, t);
+    cache->count--;
+    template_release(t);
+}
+
+static struct template *find(struct template_cache *cache, int id) {
+    struct template *t = *bucket(cache, id);
+
+    while (t && t->id != id) {
+        t = t->hash_next;
+    }
+    return t;
+}
+
+int template_cache_init(struct template_cache *cache, int capacity) {
+    size_t buckets = 1;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->capacity = capacity > 0 ? capacity : 1;
+    while (buckets < (size_t)cache->capacity) {
+        buckets <<= 1;
+    }
+    cache->buckets = calloc(buckets, sizeof(*cache->buckets));
+    cache->mask = buckets - 1;
+    return cache->buckets ? 0 : -1;
+}
+
+void template_cache_destroy(struct template_cache *cache) {
+    if (cache->buckets) {
+        template_cache_clear(cache);
+        free(cache->buckets);
+        cache->buckets = NULL;
+    }
+}
+
+struct template *template_cache_get(struct template_cache *cache, int id) {
+    struct template *t = find(cache, id);
+
+    if (t) {
+        lru_unlink(cache, t);
+        lru_push_front(cache, t);
+        atomic_fetch_add(&t->refs, 1);
+    }
+    return t;
+}
+
+void template_cache_put(struct template_cache *cache, struct template *t) {
+    struct template **link;
+
+    template_cache_evict(cache, t->id);
+    if (cache->count >= cache->capacity) {
+        remove_entry(cache, cache->lru_tail);
+    }
+    link = bucket(cache, t->id);
+    t->hash_next = *link;
+    *link = t;
+    lru_push_front(cache, t);
+    cache->count++;
+}
+
+void template_cache_evict(struct template_cache *cache, int id) {
+    struct template *t = find(cache, id);
+
+    if (t) {
+        remove_entry(cache, t);
+    }
+}
+
+void template_cache_clear(struct template_cache *cache) {
+    while (cache->lru_head) {
+        remove_entry(cache, cache->lru_head);
+    }
+}
@@ -0,0 +1,160 @@
+/**
+ * template.h
+ *
+ * Message templates for tickets that carry parameters rather than a
+ * rendered body. A template's subject and body are parsed once into
+ * literal runs and {{name}} placeholders; a ticket's JSON params are then
+ * bound to the placeholders, and the body is streamed by the payload a
+ * segment at a time without ever being assembled.
+ *
+ * Compiled templates are kept in a least-recently-used cache owned by the
+ * claiming thread. Tickets hold a reference to their template, so one
+ * evicted (or changed in the database) while tickets still use it stays
+ * valid until the last of them is freed.
+ */
+
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/* A literal run of text, or a placeholder */
+struct template_part {
+    const char *text;             /* Literal text, or NULL for a placeholder */
+    size_t len;
+    int var;                      /* Placeholder's index in the template's vars */
+};
+
+struct template_var {
+    const char *name;             /* Not NUL-terminated */
+    size_t len;
+};
+
+struct template {
+    int id;
+    atomic_int refs;              /* The cache's reference plus one per ticket */
+    struct template_part *subject;
+    struct template_part *body;
+    int subject_parts;
+    int body_parts;
+    struct template_var *vars;    /* Distinct placeholder names */
+    int var_count;
+    char *text;                   /* Copy of the subject and body the parts point into */
+
+    /* Cache links, only touched by the claiming thread */
+    struct template *hash_next;
+    struct template *lru_prev;
+    struct template *lru_next;
+};
+
+struct template_value {
+    const char *data;             /* Not NUL-terminated */
+    size_t len;
+};
+
+/* A ticket's params bound to its template's placeholders */
+struct template_args {
+    char *subject;                /* Rendered subject line */
+    struct template_value *values; /* One per template var, in the same order */
+};
+
+struct template_cache {
+    struct template **buckets;
+    size_t mask;                  /* Bucket count - 1 */
+    struct template *lru_head;    /* Most recently used */
+    struct template *lru_tail;
+    int count;
+    int capacity;
+};
+
+/**
+ * Parses a template's subject and body.
+ *
+ * @param id      Template id
+ * @param subject Subject line, may contain placeholders
+ * @param body    Body text, may contain placeholders
+ * @return        New template with one reference, or NULL if out of memory
+ */
+struct template *template_compile(int id, const char *subject, const char *body);
+
+/**
+ * Drops a reference, freeing the template with the last one. Safe from
+ * any thread.
+ *
+ * @param t Template to release (may be NULL)
+ */
+void template_release(struct template *t);
+
+/**
+ * Binds a ticket's params to a template, rendering the subject.
+ *
+ * @param t      Compiled template
+ * @param params JSON object of placeholder values (strings, numbers or
+ *               booleans; null renders as nothing)
+ * @param error  Receives a static reason on failure
+ * @return       Bound arguments (free with template_args_free()), or NULL
+ *               if params is malformed or lacks a placeholder's value
+ */
+struct template_args *template_bind(const struct template *t, const char *params,
+                                    const char **error);
+
+/**
+ * Frees bound arguments.
+ *
+ * @param args Arguments to free (may be NULL)
+ */
+void template_args_free(struct template_args *args);
+
+/**
+ * Sets up an empty cache.
+ *
+ * @param cache    Cache to initialize
+ * @param capacity Most templates kept at once
+ * @return         0 on success, -1 if out of memory
+ */
+int template_cache_init(struct template_cache *cache, int capacity);
+
+/**
+ * Releases every cached template and frees the cache.
+ *
+ * @param cache Cache to destroy
+ */
+void template_cache_destroy(struct template_cache *cache);
+
+/**
+ * Looks a template up, marking it recently used.
+ *
+ * @param cache Cache to search
+ * @param id    Template id
+ * @return      The template with a reference taken for the caller, or NULL
+ */
+struct template *template_cache_get(struct template_cache *cache, int id);
+
+/**
+ * Adds a compiled template, taking over the caller's reference. Replaces
+ * a cached template with the same id and evicts the least recently used
+ * one once the cache is full.
+ *
+ * @param cache Cache to add to
+ * @param t     Template to add
+ */
+void template_cache_put(struct template_cache *cache, struct template *t);
+
+/**
+ * Drops a template from the cache, e.g. after it changed in the database.
+ *
+ * @param cache Cache to remove from
+ * @param id    Template id
+ */
+void template_cache_evict(struct template_cache *cache, int id);
+
+/**
+ * Drops every template, e.g. after change notifications may have been
+ * missed.
+ *
+ * @param cache Cache to empty
+ */
+void template_cache_clear(struct template_cache *cache);
+
+#endif /* TEMPLATE_H */
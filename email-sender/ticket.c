@@ -0,0 +1,235 @@
+/**
+ * ticket.c
+ *
+ * Ticket allocation helpers declared in ticket.h.
+ */
+
+#include "ticket.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+static uint32_t hash_message(const struct ticket *ticket) {
+    uint32_t h = 2166136261u ^ (uint32_t)ticket->template_id;
+
+    /* FNV-1a over subject, body, params and attachments, with the
+     * terminators as separators (the HTML part is only compared) */
+    for (const char *p = ticket->subject; ; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+        if (!*p) {
+            break;
+        }
+    }
+    for (const char *p = ticket->body; ; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+        if (!*p) {
+            break;
+        }
+    }
+    for (const char *p = ticket->params; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    for (const char *p = ticket->attachment_ids; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Tells whether two tickets render to the same message. The params of
+ * templated tickets come from jsonb, whose text form is canonical enough
+ * for equal values to compare equal.
+ */
+static int same_message(const struct ticket *a, const struct ticket *b) {
+    return a->template_id == b->template_id && a->template == b->template &&
+           strcmp(a->subject, b->subject) == 0 && strcmp(a->body, b->body) == 0 &&
+           strcmp(a->params, b->params) == 0 && strcmp(a->html_body, b->html_body) == 0 &&
+           strcmp(a->attachment_ids, b->attachment_ids) == 0;
+}
+
+struct ticket *ticket_list_from_result(PGresult *res, int *count) {
+    struct ticket *head = NULL;
+    struct ticket **tail = &head;
+    struct ticket_batch *batch;
+    int rows = PQntuples(res);
+
+    *count = 0;
+    batch = rows > 0 ? calloc(1, sizeof(*batch)) : NULL;
+    if (!batch) {
+        if (rows > 0) {
+            log_error("Out of memory building %d ticket(s)", rows);
+        }
+        PQclear(res);
+        return NULL;
+    }
+    batch->res = res;
+
+    for (int row = 0; row < rows; row++) {
+        struct ticket *ticket = calloc(1, sizeof(*ticket));
+        if (!ticket) {
+            log_error("Out of memory building ticket %s", PQgetvalue(res, row, 0));
+            break;
+        }
+
+        /* Point straight into the result instead of copying the strings */
+        ticket->id = atoi(PQgetvalue(res, row, 0));
+        ticket->email = PQgetvalue(res, row, 1);
+        ticket->subject = PQgetvalue(res, row, 2);
+        ticket->body = PQgetvalue(res, row, 3);
+        ticket->retry_count = atoi(PQgetvalue(res, row, 4));
+        ticket->template_id = atoi(PQgetvalue(res, row, 5));
+        ticket->params = PQgetvalue(res, row, 6);
+        ticket->html_body = PQgetvalue(res, row, 7);
+        ticket->attachment_ids = PQgetvalue(res, row, 8);
+        ticket->failed_relay = -1;
+        ticket->batch = batch;
+        batch->refs++;
+
+        *tail = ticket;
+        tail = &ticket->next;
+        (*count)++;
+    }
+
+    if (batch->refs == 0) {
+        PQclear(res);
+        free(batch);
+    }
+    return head;
+}
+
+/**
+ * Parses a decimal length terminated by ':' and advances past it.
+ */
+static long parse_field(const char **p) {
+    char *end;
+    long value = strtol(*p, &end, 10);
+
+    if (end == *p || *end != ':' || value < 0) {
+        return -1;
+    }
+    *p = end + 1;
+    return value;
+}
+
+struct ticket *ticket_from_notification(const char *payload) {
+    const char *p = payload;
+    long id = parse_field(&p);
+    long email_len = id >= 0 ? parse_field(&p) : -1;
+    long subject_len = email_len >= 0 ? parse_field(&p) : -1;
+    long body_len = subject_len >= 0 ? parse_field(&p) : -1;
+    struct ticket *ticket;
+    char *text;
+
+    /* A bare id (or anything else) has no ticket to build */
+    if (body_len < 0 || (size_t)(email_len + subject_len + body_len) != strlen(p)) {
+        return NULL;
+    }
+
+    /* One allocation holds the ticket and its NUL-terminated fields */
+    ticket = calloc(1, sizeof(*ticket) + email_len + subject_len + body_len + 3);
+    if (!ticket) {
+        log_error("Out of memory building ticket %ld from its notification", id);
+        return NULL;
+    }
+    text = (char *)(ticket + 1);
+    ticket->id = (int)id;
+    ticket->email = memcpy(text, p, email_len);
+    text[email_len] = '\0';
+    text += email_len + 1;
+    ticket->subject = memcpy(text, p + email_len, subject_len);
+    text[subject_len] = '\0';
+    text += subject_len + 1;
+    ticket->body = memcpy(text, p + email_len + subject_len, body_len);
+    text[body_len] = '\0';
+    ticket->params = ticket->html_body = ticket->attachment_ids = text + body_len; /* Empty */
+    ticket->failed_relay = -1;
+    return ticket;
+}
+
+int ticket_bind_template(struct ticket *ticket, const char **error) {
+    ticket->args = template_bind(ticket->template, ticket->params, error);
+    if (!ticket->args) {
+        return -1;
+    }
+    ticket->subject = ticket->args->subject;
+    return 0;
+}
+
+struct ticket *ticket_list_group(struct ticket *list, int max_group, int *groups) {
+    struct lead {
+        struct ticket *ticket;
+        struct ticket **tail;     /* End of its same_message chain */
+        uint32_t hash;
+        int size;
+    };
+    struct ticket *head = NULL;
+    struct ticket **tail = &head;
+    struct lead *leads = NULL;
+    int count = 0;
+    int n = 0;
+
+    for (struct ticket *t = list; t; t = t->next) {
+        n++;
+    }
+    if (max_group > 1 && n > 1) {
+        leads = malloc(n * sizeof(*leads));
+    }
+
+    while (list) {
+        struct ticket *ticket = list;
+        struct lead *lead = NULL;
+
+        list = ticket->next;
+        ticket->next = NULL;
+        ticket->same_message = NULL;
+
+        /* Without the scratch space every ticket stays on its own */
+        if (leads) {
+            uint32_t hash = hash_message(ticket);
+
+            for (int i = 0; i < count; i++) {
+                if (leads[i].hash == hash && leads[i].size < max_group &&
+                    same_message(leads[i].ticket, ticket)) {
+                    lead = &leads[i];
+                    break;
+                }
+            }
+            if (lead) {
+                *lead->tail = ticket;
+                lead->tail = &ticket->same_message;
+                lead->size++;
+                continue;
+            }
+            leads[count].ticket = ticket;
+            leads[count].tail = &ticket->same_message;
+            leads[count].hash = hash;
+            leads[count].size = 1;
+        }
+        count++;
+        *tail = ticket;
+        tail = &ticket->next;
+    }
+
+    free(leads);
+    *groups = count;
+    return head;
+}
+
+void ticket_free(struct ticket *ticket) {
+    while (ticket) {
+        struct ticket *next = ticket->same_message;
+
+        template_args_free(ticket->args);
+        template_release(ticket->template);
+        if (ticket->batch && atomic_fetch_sub(&ticket->batch->refs, 1) == 1) {
+            PQclear(ticket->batch->res);
+            free(ticket->batch);
+        }
+        free(ticket);
+        ticket = next;
+    }
+}
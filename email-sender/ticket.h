@@ -0,0 +1,97 @@
+/**
+ * ticket.h
+ *
+ * In-memory representation of a ticket on its way through the sender.
+ * Tickets claimed together share the query result holding their data, so
+ * strings are never copied out of the PGresult.
+ */
+
+#ifndef TICKET_H
+#define TICKET_H
+
+#include <postgresql/libpq-fe.h>
+#include <stdatomic.h>
+
+#include "template.h"
+
+/* A query result shared by the tickets built from its rows, which may be
+ * sent (and freed) by different threads */
+struct ticket_batch {
+    PGresult *res;
+    atomic_int refs;         /* Tickets still referencing the result */
+};
+
+struct ticket {
+    int id;
+    const char *email;       /* Recipient address */
+    const char *subject;     /* Subject line (rendered from the template, if any) */
+    const char *body;        /* Plain text body (empty with a template) */
+    const char *html_body;   /* HTML alternative to the body (empty = none) */
+    const char *attachment_ids; /* Array literal of attachments, e.g. "{4,7}" (empty = none) */
+    int template_id;         /* Template the message is rendered from (0 = none) */
+    const char *params;      /* JSON values for the template's placeholders */
+    struct template *template;    /* Resolved by the claiming thread (reference held) */
+    struct template_args *args;   /* params bound to the template */
+    int retry_count;         /* Failed delivery attempts so far */
+    int failed_relay;        /* Relay the last attempt failed on (-1 = none) */
+    int unconfirmed;         /* An earlier attempt handed the message over, result unknown */
+    struct ticket_batch *batch;
+    struct ticket *next;     /* Queue link */
+    struct ticket *same_message; /* Further tickets sent in the same transaction */
+};
+
+/**
+ * Builds one ticket per row of a query result returning
+ * (id, email, subject, body, retry_count, template_id, params,
+ * html_body, attachment_ids). Takes ownership of the result, which is
+ * cleared once the last ticket is freed (or immediately if it is empty).
+ *
+ * @param res   Query result
+ * @param count Receives the number of tickets created
+ * @return      Linked list of tickets, or NULL if there are none
+ */
+struct ticket *ticket_list_from_result(PGresult *res, int *count);
+
+/**
+ * Builds a ticket from a new_ticket notification that carries it, i.e.
+ * "id:email_len:subject_len:body_len:" followed by the fields. The strings
+ * are copied into the ticket's own allocation, so the notification can be
+ * freed. Notifications carrying just an id yield NULL.
+ *
+ * @param payload Notification payload
+ * @return        New ticket (retry_count 0), or NULL if the payload has no ticket
+ */
+struct ticket *ticket_from_notification(const char *payload);
+
+/**
+ * Binds a ticket's params to the template attached to it, which also
+ * renders the subject.
+ *
+ * @param ticket Ticket whose template has been resolved
+ * @param error  Receives a static reason on failure
+ * @return       0 on success, -1 if the params do not fit the template
+ */
+int ticket_bind_template(struct ticket *ticket, const char **error);
+
+/**
+ * Groups tickets whose whole message (subject, body, HTML alternative and
+ * attachments, or template and params) is identical, so each group can
+ * be delivered as one message with several recipients. The tickets of a
+ * group hang off its first ticket through same_message, in list order.
+ *
+ * @param list      Linked list of tickets (consumed)
+ * @param max_group Most tickets in one group (1 disables grouping)
+ * @param groups    Receives the number of groups
+ * @return          Linked list of the first ticket of each group
+ */
+struct ticket *ticket_list_group(struct ticket *list, int max_group, int *groups);
+
+/**
+ * Frees a ticket, clearing the shared query result with the last one.
+ * Any tickets grouped with it through same_message are freed too.
+ *
+ * @param ticket Ticket to free
+ */
+void ticket_free(struct ticket *ticket);
+
+#endif /* TICKET_H */
@@ -0,0 +1,564 @@
+/**
+ * ticket_db.c
+ *
+ * Implementation of the tickets table operations declared in ticket_db.h.
+ *
+ * Every statement is prepared once per connection by ticket_db_prepare()
+ * and executed with binary parameters, so the hot path neither formats
+ * SQL text nor makes the server parse and plan it again.
+ */
+
+#include "ticket_db.h"
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+/* Type OIDs from pg_type.h, which is not part of the client headers */
+#define BOOLOID 16
+#define INT4OID 23
+#define TEXTOID 25
+
+#define MAX_PARAMS 6
+
+/* Prepared statement names */
+#define STMT_CLAIM     "ticket_claim"
+#define STMT_CLAIM_IDS "ticket_claim_ids"
+#define STMT_COMPLETE  "ticket_complete"
+#define STMT_INVALID   "ticket_invalid"
+#define STMT_RETRY     "ticket_retry"
+#define STMT_FAILED    "ticket_failed"
+#define STMT_SENDING   "ticket_sending"
+#define STMT_UNCONFIRMED "ticket_unconfirmed"
+#define STMT_RENEW     "ticket_renew_leases"
+#define STMT_RECLAIM   "ticket_reclaim_expired"
+#define STMT_RELEASE   "ticket_release_leases"
+#define STMT_COUNT     "ticket_count_received"
+#define STMT_ARCHIVE   "ticket_archive_completed"
+#define STMT_DELETE    "ticket_delete_completed"
+#define STMT_PARTITIONS "ticket_drop_partitions"
+#define STMT_TEMPLATES "ticket_load_templates"
+#define STMT_CHUNK     "ticket_attachment_chunk"
+
+/* Locks the oldest unclaimed rows of one lane, skipping any another
+ * sender holds */
+#define CLAIM_LANE(lane, limit) \
+    "lane_" lane " AS (SELECT id FROM tickets WHERE status = 'received' " \
+    "AND priority = '" lane "' AND id > $3 ORDER BY id LIMIT " limit " FOR UPDATE SKIP LOCKED)"
+
+/* Finished tickets sent (or, if they failed, created) more than $1 days
+ * ago, after id $2, oldest first, at most $3 of them */
+#define RETIRE_CHUNK \
+    "DELETE FROM tickets WHERE (id, created_at) IN (" \
+    "SELECT id, created_at FROM tickets WHERE status IN ('completed', 'failed') AND id > $2 " \
+    "AND coalesce(sent_at, created_at) < NOW() - $1 * INTERVAL '1 day' " \
+    "ORDER BY id LIMIT $3 FOR UPDATE SKIP LOCKED) "
+
+static const struct prepared_statement {
+    const char *name;
+    const char *sql;
+    int nparams;
+    Oid types[MAX_PARAMS];
+} statements[] = {
+    /* Lock up to a limit of the oldest unclaimed rows of each lane and take
+     * a lease on them in the same statement. $1 = owner, $2 = lease
+     * seconds, $3 = lowest id - 1, $4..$6 = limits of the lanes in order */
+    { STMT_CLAIM,
+      "WITH " CLAIM_LANE("high", "$4") ", " CLAIM_LANE("normal", "$5") ", "
+      CLAIM_LANE("bulk", "$6") " "
+      "UPDATE tickets SET status = 'processing', owner = $1, "
+      "lease_expires_at = NOW() + $2 * INTERVAL '1 second' "
+      "WHERE id IN (SELECT id FROM lane_high UNION ALL SELECT id FROM lane_normal "
+      "UNION ALL SELECT id FROM lane_bulk) "
+      "RETURNING id, email, subject, body, retry_count, template_id, params, html_body, "
+      "attachment_ids, priority, message_id",
+      6, { TEXTOID, INT4OID, INT4OID, INT4OID, INT4OID, INT4OID } },
+
+    /* The same for tickets whose contents came with their notification.
+     * $1 = owner, $2 = lease seconds, $3 = id array literal */
+    { STMT_CLAIM_IDS,
+      "UPDATE tickets SET status = 'processing', owner = $1, "
+      "lease_expires_at = NOW() + $2 * INTERVAL '1 second' "
+      "WHERE id IN (SELECT id FROM tickets WHERE id = ANY($3::int[]) AND status = 'received' "
+      "FOR UPDATE SKIP LOCKED) "
+      "RETURNING id, retry_count, message_id",
+      3, { TEXTOID, INT4OID, TEXTOID } },
+
+    /* Update ticket status to 'completed' and record sent timestamp */
+    { STMT_COMPLETE,
+      "UPDATE tickets SET sent_at = NOW(), status = 'completed', "
+      "lease_expires_at = NULL WHERE id = $1",
+      1, { INT4OID } },
+
+    /* Never sent: record the validation error. $1 = id, $2 = reason */
+    { STMT_INVALID,
+      "UPDATE tickets SET status = 'failed', last_error = $2, "
+      "lease_expires_at = NULL WHERE id = $1",
+      2, { INT4OID, TEXTOID } },
+
+    /* Count the attempt; the lease is kept while the retry waits. The
+     * message was not delivered, so its Message-ID no longer stands for a
+     * possible delivery. */
+    { STMT_RETRY,
+      "UPDATE tickets SET retry_count = retry_count + 1, last_error = $2, "
+      "message_id = NULL WHERE id = $1",
+      2, { INT4OID, TEXTOID } },
+
+    /* Out of attempts */
+    { STMT_FAILED,
+      "UPDATE tickets SET status = 'failed', retry_count = retry_count + 1, "
+      "last_error = $2, lease_expires_at = NULL, message_id = NULL WHERE id = $1",
+      2, { INT4OID, TEXTOID } },
+
+    /* The message is about to be handed over. $1 = id, $2 = Message-ID */
+    { STMT_SENDING,
+      "UPDATE tickets SET message_id = $2 WHERE id = $1",
+      2, { INT4OID, TEXTOID } },
+
+    /* Handed over by an attempt whose result was lost: taken as sent
+     * rather than sent twice. $1 = id, $2 = note */
+    { STMT_UNCONFIRMED,
+      "UPDATE tickets SET sent_at = NOW(), status = 'completed', last_error = $2, "
+      "lease_expires_at = NULL WHERE id = $1",
+      2, { INT4OID, TEXTOID } },
+
+    /* $1 = owner, $2 = lease seconds */
+    { STMT_RENEW,
+      "UPDATE tickets SET lease_expires_at = NOW() + $2 * INTERVAL '1 second' "
+      "WHERE owner = $1 AND status = 'processing' AND lease_expires_at IS NOT NULL",
+      2, { TEXTOID, INT4OID } },
+
+    { STMT_RECLAIM,
+      "UPDATE tickets SET status = 'received', owner = NULL, lease_expires_at = NULL "
+      "WHERE status = 'processing' AND lease_expires_at < NOW()",
+      0, { 0 } },
+
+    /* $1 = owner */
+    { STMT_RELEASE,
+      "UPDATE tickets SET status = 'received', owner = NULL, lease_expires_at = NULL "
+      "WHERE owner = $1 AND status = 'processing' AND sent_at IS NULL",
+      1, { TEXTOID } },
+
+    { STMT_COUNT,
+      "SELECT count(*) FROM tickets WHERE status = 'received'",
+      0, { 0 } },
+
+    /* Both return (rows, highest id) for the chunk */
+    { STMT_ARCHIVE,
+      "WITH moved AS (" RETIRE_CHUNK
+      "RETURNING id, email, subject, body, created_at, sent_at, retry_count, "
+      "template_id, params, priority, html_body, attachment_ids, message_id, "
+      "status, last_error), "
+      "archived AS (INSERT INTO tickets_archive "
+      "(id, email, subject, body, created_at, sent_at, retry_count, template_id, params, "
+      "priority, html_body, attachment_ids, message_id, status, last_error) "
+      "SELECT * FROM moved RETURNING id) "
+      "SELECT count(*), coalesce(max(id), 0) FROM archived",
+      3, { INT4OID, INT4OID, INT4OID } },
+
+    { STMT_DELETE,
+      "WITH moved AS (" RETIRE_CHUNK "RETURNING id) "
+      "SELECT count(*), coalesce(max(id), 0) FROM moved",
+      3, { INT4OID, INT4OID, INT4OID } },
+
+    /* $1 = days to keep, $2 = keep tickets not yet archived */
+    { STMT_PARTITIONS,
+      "SELECT clean_old_tickets($1, $2)",
+      2, { INT4OID, BOOLOID } },
+
+    /* $1 = id array literal */
+    { STMT_TEMPLATES,
+      "SELECT id, subject, body FROM templates WHERE id = ANY($1::int[])",
+      1, { TEXTOID } },
+
+    /* $3 bytes from offset $2 (as text, it may exceed int4) of attachment
+     * $1, stored either as bytea or as a large object */
+    { STMT_CHUNK,
+      "SELECT filename, content_type, CASE WHEN data IS NOT NULL "
+      "THEN substring(data FROM ($2::bigint + 1)::int FOR $3) "
+      "ELSE lo_get(lo, $2::bigint, $3) END "
+      "FROM attachments WHERE id = $1",
+      3, { INT4OID, TEXTOID, INT4OID } },
+};
+
+/* Binary parameters for one statement execution */
+struct params {
+    int count;
+    const char *values[MAX_PARAMS];
+    int lengths[MAX_PARAMS];
+    int formats[MAX_PARAMS];
+    uint32_t ints[MAX_PARAMS];    /* Storage for int4 values in network order */
+};
+
+/* Values of the ticket_priority type, in lane order */
+static const char *const lane_names[PRIORITY_LANES] = { "high", "normal", "bulk" };
+
+static int lane_of(const char *priority) {
+    for (int lane = 0; lane < PRIORITY_LANES - 1; lane++) {
+        if (strcmp(priority, lane_names[lane]) == 0) {
+            return lane;
+        }
+    }
+    return PRIORITY_LANES - 1;
+}
+
+static void param_int(struct params *p, int value) {
+    int i = p->count++;
+
+    p->ints[i] = htonl((uint32_t)value);
+    p->values[i] = (const char *)&p->ints[i];
+    p->lengths[i] = sizeof(uint32_t);
+    p->formats[i] = 1;
+}
+
+static void param_text(struct params *p, const char *value) {
+    int i = p->count++;
+
+    /* The binary form of text is just its bytes */
+    p->values[i] = value;
+    p->lengths[i] = (int)strlen(value);
+    p->formats[i] = 1;
+}
+
+static void param_bool(struct params *p, int value) {
+    int i = p->count++;
+
+    /* The binary form of bool is one byte, 0 or 1 */
+    p->values[i] = value ? "\x01" : "\x00";
+    p->lengths[i] = 1;
+    p->formats[i] = 1;
+}
+
+static PGresult *exec_prepared(PGconn *conn, const char *stmt, const struct params *p) {
+    return PQexecPrepared(conn, stmt, p->count, p->values, p->lengths, p->formats, 0);
+}
+
+/**
+ * Runs a prepared command that returns no rows.
+ *
+ * @return Number of rows affected, or -1 on failure
+ */
+static int exec_command(PGconn *conn, const char *stmt, const struct params *p, const char *what) {
+    PGresult *res = exec_prepared(conn, stmt, p);
+    int affected = -1;
+
+    if (PQresultStatus(res) == PGRES_COMMAND_OK) {
+        affected = atoi(PQcmdTuples(res));
+    } else {
+        log_error("Failed to %s: %s", what, PQerrorMessage(conn));
+    }
+    PQclear(res);
+    return affected;
+}
+
+int ticket_db_prepare(PGconn *conn) {
+    for (size_t i = 0; i < sizeof(statements) / sizeof(statements[0]); i++) {
+        const struct prepared_statement *s = &statements[i];
+        PGresult *res = PQprepare(conn, s->name, s->sql, s->nparams, s->types);
+
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            log_error("Failed to prepare %s: %s", s->name, PQerrorMessage(conn));
+            PQclear(res);
+            return -1;
+        }
+        PQclear(res);
+    }
+    return 0;
+}
+
+struct ticket *ticket_db_claim(PGconn *conn, const char *owner, int lease_seconds,
+                               int after_id, const int *limits, int *claimed, int *count) {
+    struct params p = { 0 };
+    struct ticket *lanes[PRIORITY_LANES] = { NULL };
+    struct ticket **tails[PRIORITY_LANES];
+    struct ticket *list;
+    struct ticket *head = NULL;
+    struct ticket **tail = &head;
+    PGresult *res;
+    int row = 0;
+
+    param_text(&p, owner);
+    param_int(&p, lease_seconds);
+    param_int(&p, after_id);
+    for (int lane = 0; lane < PRIORITY_LANES; lane++) {
+        param_int(&p, limits[lane]);
+        tails[lane] = &lanes[lane];
+        claimed[lane] = 0;
+    }
+
+    res = exec_prepared(conn, STMT_CLAIM, &p);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        log_error("Failed to claim tickets: %s", PQerrorMessage(conn));
+        PQclear(res);
+        *count = -1;
+        return NULL;
+    }
+    for (int i = 0; i < PQntuples(res); i++) {
+        claimed[lane_of(PQgetvalue(res, i, 9))]++;
+    }
+
+    /* The rows come back in no particular order; put the most urgent lane
+     * first so its tickets reach the ring first. Tickets are built in row
+     * order, which keeps each one's row known. */
+    list = ticket_list_from_result(res, count);
+    while (list) {
+        struct ticket *ticket = list;
+        int lane = lane_of(PQgetvalue(ticket->batch->res, row, 9));
+
+        ticket->unconfirmed = !PQgetisnull(ticket->batch->res, row++, 10);
+        list = ticket->next;
+        ticket->next = NULL;
+        *tails[lane] = ticket;
+        tails[lane] = &ticket->next;
+    }
+    for (int lane = 0; lane < PRIORITY_LANES; lane++) {
+        *tail = lanes[lane];
+        if (lanes[lane]) {
+            tail = tails[lane];
+        }
+    }
+    return head;
+}
+
+struct ticket *ticket_db_claim_notified(PGconn *conn, const char *owner, int lease_seconds,
+                                        struct ticket *notified, int *count) {
+    struct params p = { 0 };
+    struct ticket *head = NULL;
+    struct ticket **tail = &head;
+    PGresult *res = NULL;
+    char *ids;
+    size_t len = 0;
+    int n = 0;
+
+    *count = -1;
+    for (struct ticket *t = notified; t; t = t->next) {
+        n++;
+    }
+
+    /* "{1,2,3}": at most 11 characters per int plus the separators */
+    ids = malloc((size_t)n * 12 + 3);
+    if (ids) {
+        ids[len++] = '{';
+        for (struct ticket *t = notified; t; t = t->next) {
+            len += sprintf(ids + len, "%s%d", t == notified ? "" : ",", t->id);
+        }
+        ids[len++] = '}';
+        ids[len] = '\0';
+
+        param_text(&p, owner);
+        param_int(&p, lease_seconds);
+        param_text(&p, ids);
+        res = exec_prepared(conn, STMT_CLAIM_IDS, &p);
+        free(ids);
+    }
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        log_error("Failed to claim notified tickets: %s", PQerrorMessage(conn));
+        PQclear(res);
+        while (notified) {
+            struct ticket *next = notified->next;
+            ticket_free(notified);
+            notified = next;
+        }
+        return NULL;
+    }
+
+    /* Keep the claimed tickets, a batch's worth of rows at most */
+    *count = 0;
+    while (notified) {
+        struct ticket *ticket = notified;
+        int row;
+
+        notified = ticket->next;
+        ticket->next = NULL;
+        for (row = 0; row < PQntuples(res); row++) {
+            if (atoi(PQgetvalue(res, row, 0)) == ticket->id) {
+                break;
+            }
+        }
+        if (row == PQntuples(res)) {
+            ticket_free(ticket); /* Another sender has it */
+            continue;
+        }
+        ticket->retry_count = atoi(PQgetvalue(res, row, 1));
+        ticket->unconfirmed = !PQgetisnull(res, row, 2);
+        *tail = ticket;
+        tail = &ticket->next;
+        (*count)++;
+    }
+    PQclear(res);
+    return head;
+}
+
+int ticket_db_send_outcome(PGconn *conn, int ticket_id, enum ticket_outcome outcome,
+                           const char *error) {
+    struct params p = { 0 };
+    const char *stmt;
+
+    switch (outcome) {
+    case OUTCOME_COMPLETED:
+        stmt = STMT_COMPLETE;
+        break;
+    case OUTCOME_INVALID:
+        stmt = STMT_INVALID;
+        break;
+    case OUTCOME_RETRY:
+        stmt = STMT_RETRY;
+        break;
+    case OUTCOME_SENDING:
+        stmt = STMT_SENDING;
+        break;
+    case OUTCOME_UNCONFIRMED:
+        stmt = STMT_UNCONFIRMED;
+        break;
+    default:
+        stmt = STMT_FAILED;
+        break;
+    }
+
+    param_int(&p, ticket_id);
+    if (outcome != OUTCOME_COMPLETED) {
+        param_text(&p, error ? error : "");
+    }
+    if (!PQsendQueryPrepared(conn, stmt, p.count, p.values, p.lengths, p.formats, 0)) {
+        log_error("Failed to queue status update for ticket %d: %s",
+                ticket_id, PQerrorMessage(conn));
+        return -1;
+    }
+    return 0;
+}
+
+int ticket_db_send_attachment_chunk(PGconn *conn, int attachment_id, long offset, int len) {
+    struct params p = { 0 };
+    char offset_text[24];
+
+    snprintf(offset_text, sizeof(offset_text), "%ld", offset);
+    param_int(&p, attachment_id);
+    param_text(&p, offset_text);
+    param_int(&p, len);
+
+    /* Binary results, so the bytes come back as they are */
+    if (!PQsendQueryPrepared(conn, STMT_CHUNK, p.count, p.values, p.lengths, p.formats, 1)) {
+        log_error("Failed to request attachment %d: %s", attachment_id, PQerrorMessage(conn));
+        return -1;
+    }
+    return 0;
+}
+
+int ticket_db_renew_leases(PGconn *conn, const char *owner, int lease_seconds) {
+    struct params p = { 0 };
+
+    param_text(&p, owner);
+    param_int(&p, lease_seconds);
+    return exec_command(conn, STMT_RENEW, &p, "renew leases");
+}
+
+int ticket_db_reclaim_expired(PGconn *conn) {
+    struct params p = { 0 };
+
+    return exec_command(conn, STMT_RECLAIM, &p, "reclaim expired leases");
+}
+
+int ticket_db_release_leases(PGconn *conn, const char *owner) {
+    struct params p = { 0 };
+
+    param_text(&p, owner);
+    return exec_command(conn, STMT_RELEASE, &p, "release leases");
+}
+
+int ticket_db_retire_completed(PGconn *conn, int archive, int keep_days, int after_id, int limit,
+                               int *last_id) {
+    struct params p = { 0 };
+    PGresult *res;
+    int retired = -1;
+
+    param_int(&p, keep_days);
+    param_int(&p, after_id);
+    param_int(&p, limit);
+    res = exec_prepared(conn, archive ? STMT_ARCHIVE : STMT_DELETE, &p);
+    if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1) {
+        retired = atoi(PQgetvalue(res, 0, 0));
+        *last_id = atoi(PQgetvalue(res, 0, 1));
+    } else {
+        log_error("Failed to retire completed tickets: %s", PQerrorMessage(conn));
+    }
+    PQclear(res);
+    return retired;
+}
+
+int ticket_db_drop_expired_partitions(PGconn *conn, int archive, int keep_days) {
+    struct params p = { 0 };
+    PGresult *res;
+    int dropped = -1;
+
+    param_int(&p, keep_days);
+    param_bool(&p, archive);
+    res = exec_prepared(conn, STMT_PARTITIONS, &p);
+    if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1) {
+        dropped = atoi(PQgetvalue(res, 0, 0));
+    } else {
+        log_error("Failed to drop expired partitions: %s", PQerrorMessage(conn));
+    }
+    PQclear(res);
+    return dropped;
+}
+
+long ticket_db_count_received(PGconn *conn) {
+    struct params p = { 0 };
+    PGresult *res = exec_prepared(conn, STMT_COUNT, &p);
+    long count = -1;
+
+    if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1) {
+        count = atol(PQgetvalue(res, 0, 0));
+    } else {
+        log_error("Failed to count queued tickets: %s", PQerrorMessage(conn));
+    }
+    PQclear(res);
+    return count;
+}
+
+int ticket_db_load_templates(PGconn *conn, struct template_cache *cache, const int *ids,
+                             int count) {
+    struct params p = { 0 };
+    PGresult *res = NULL;
+    char *literal;
+    size_t len = 0;
+    int loaded = 0;
+
+    /* "{1,2,3}": at most 11 characters per int plus the separators */
+    literal = malloc((size_t)count * 12 + 3);
+    if (literal) {
+        literal[len++] = '{';
+        for (int i = 0; i < count; i++) {
+            len += sprintf(literal + len, "%s%d", i == 0 ? "" : ",", ids[i]);
+        }
+        literal[len++] = '}';
+        literal[len] = '\0';
+
+        param_text(&p, literal);
+        res = exec_prepared(conn, STMT_TEMPLATES, &p);
+        free(literal);
+    }
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        log_error("Failed to load templates: %s", PQerrorMessage(conn));
+        PQclear(res);
+        return -1;
+    }
+    for (int row = 0; row < PQntuples(res); row++) {
+        struct template *t = template_compile(atoi(PQgetvalue(res, row, 0)),
+                                              PQgetvalue(res, row, 1), PQgetvalue(res, row, 2));
+        if (!t) {
+            log_error("Out of memory compiling template %s", PQgetvalue(res, row, 0));
+            continue;
+        }
+        template_cache_put(cache, t);
+        loaded++;
+    }
+    PQclear(res);
+    return loaded;
+}
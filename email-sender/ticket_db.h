@@ -0,0 +1,203 @@
+/**
+ * ticket_db.h
+ *
+ * Database operations on the tickets table: claiming work and recording
+ * the outcome of each delivery. All of them run as prepared statements,
+ * so ticket_db_prepare() must be called once on every new connection.
+ */
+
+#ifndef TICKET_DB_H
+#define TICKET_DB_H
+
+#include <postgresql/libpq-fe.h>
+
+#include "template.h"
+#include "ticket.h"
+
+/**
+ * Prepares the statements used by the functions below on a connection.
+ *
+ * @param conn Newly opened PostgreSQL connection
+ * @return     0 on success, -1 on failure
+ */
+int ticket_db_prepare(PGconn *conn);
+
+/* Claim lanes, most urgent first: the values of the ticket_priority type */
+enum ticket_priority {
+    PRIORITY_HIGH,           /* Transactional mail, e.g. password resets */
+    PRIORITY_NORMAL,         /* The column's default */
+    PRIORITY_BULK,           /* Newsletters and other mass mailings */
+    PRIORITY_LANES
+};
+
+/**
+ * Atomically claims 'received' tickets, the oldest of each lane up to that
+ * lane's limit, moving them to 'processing' under a lease held by owner
+ * and returning their contents in a single round-trip. Rows locked by
+ * another sender are skipped rather than waited on, so several senders
+ * can drain the same table without sending twice. Tickets an earlier
+ * attempt recorded a Message-ID for come back flagged unconfirmed.
+ *
+ * @param conn          Active PostgreSQL connection
+ * @param owner         Worker ID recorded as the lease holder
+ * @param lease_seconds Lease duration
+ * @param after_id      Only tickets with a higher id are claimed (0 for any)
+ * @param limits        Most tickets to claim from each lane (PRIORITY_LANES of them)
+ * @param claimed       Receives the number claimed from each lane
+ * @param count         Receives the number of tickets claimed, or -1 on failure
+ * @return              Linked list of claimed tickets, most urgent lane first
+ *                      (NULL if none)
+ */
+struct ticket *ticket_db_claim(PGconn *conn, const char *owner, int lease_seconds,
+                               int after_id, const int *limits, int *claimed, int *count);
+
+/**
+ * Claims tickets already known from their notifications (see
+ * ticket_from_notification()) by id, like ticket_db_claim() but returning
+ * only what the notification lacked. Tickets another sender claimed first
+ * are freed.
+ *
+ * @param conn          Active PostgreSQL connection
+ * @param owner         Worker ID recorded as the lease holder
+ * @param lease_seconds Lease duration
+ * @param notified      Linked list of tickets to claim (consumed)
+ * @param count         Receives the number of tickets claimed, or -1 on failure
+ * @return              Linked list of the claimed tickets, in their original order
+ */
+struct ticket *ticket_db_claim_notified(PGconn *conn, const char *owner, int lease_seconds,
+                                        struct ticket *notified, int *count);
+
+/**
+ * Fetches templates by id, compiles them and adds them to a cache. Ids
+ * with no template are skipped.
+ *
+ * @param conn  Active PostgreSQL connection
+ * @param cache Cache receiving the templates
+ * @param ids   Template ids to load
+ * @param count Number of ids
+ * @return      Number of templates loaded, or -1 on failure
+ */
+int ticket_db_load_templates(PGconn *conn, struct template_cache *cache, const int *ids,
+                             int count);
+
+/* Result of one attempt at handling a claimed ticket */
+enum ticket_outcome {
+    OUTCOME_COMPLETED,       /* Accepted by the SMTP server */
+    OUTCOME_INVALID,         /* Not sent: the address or template params failed validation */
+    OUTCOME_RETRY,           /* Delivery failed; this sender will try again later */
+    OUTCOME_FAILED,          /* Delivery failed and no attempts are left */
+    OUTCOME_SENDING,         /* About to be handed to the SMTP server: records the Message-ID */
+    OUTCOME_UNCONFIRMED      /* Handed over before, result lost: taken as sent, not resent */
+};
+
+/**
+ * Queues the status update for a ticket's outcome without waiting for the
+ * result. Intended for a connection in pipeline mode: the caller sends a
+ * sync after a batch and reads one result per update.
+ *
+ *  - OUTCOME_COMPLETED marks the ticket sent and ends its lease.
+ *  - OUTCOME_INVALID moves the ticket to 'failed' with the validation
+ *    error as last_error.
+ *  - OUTCOME_RETRY increments retry_count and records last_error. The
+ *    ticket stays 'processing' and leased while its retry is pending.
+ *  - OUTCOME_FAILED does the same but moves the ticket to 'failed'.
+ *    Both clear the Message-ID an attempt recorded.
+ *  - OUTCOME_SENDING records the Message-ID of the attempt about to
+ *    complete, given as error. A ticket claimed with one recorded is
+ *    flagged unconfirmed: its message may have been delivered.
+ *  - OUTCOME_UNCONFIRMED marks such a ticket sent, with error as
+ *    last_error.
+ *
+ * @param conn      PostgreSQL connection (prepared with ticket_db_prepare())
+ * @param ticket_id Ticket to update
+ * @param outcome   What happened to the ticket
+ * @param error     Error text (the Message-ID for OUTCOME_SENDING), for every
+ *                  outcome but OUTCOME_COMPLETED
+ * @return          0 if the query was queued, -1 on failure
+ */
+int ticket_db_send_outcome(PGconn *conn, int ticket_id, enum ticket_outcome outcome,
+                           const char *error);
+
+/**
+ * Asks for a chunk of an attachment without waiting for it, on a
+ * connection in non-blocking mode. The single result row, in binary
+ * format, holds (filename, content_type, bytes); there is no row if the
+ * attachment does not exist, and fewer bytes than asked for at its end.
+ *
+ * @param conn          PostgreSQL connection (prepared with ticket_db_prepare())
+ * @param attachment_id Attachment to read
+ * @param offset        Position of the first byte to read
+ * @param len           Most bytes to read
+ * @return              0 if the query was sent, -1 on failure
+ */
+int ticket_db_send_attachment_chunk(PGconn *conn, int attachment_id, long offset, int len);
+
+/**
+ * Extends the lease on every ticket owner is still processing.
+ *
+ * @param conn          Active PostgreSQL connection
+ * @param owner         Worker ID holding the leases
+ * @param lease_seconds New lease duration from now
+ * @return              Number of leases renewed, or -1 on failure
+ */
+int ticket_db_renew_leases(PGconn *conn, const char *owner, int lease_seconds);
+
+/**
+ * Returns tickets whose lease has expired (their sender crashed or gave
+ * up on them) to 'received' so they are claimed again.
+ *
+ * @param conn Active PostgreSQL connection
+ * @return     Number of tickets reclaimed, or -1 on failure
+ */
+int ticket_db_reclaim_expired(PGconn *conn);
+
+/**
+ * Returns every unsent ticket leased by owner to 'received'. Used at
+ * startup to take back work from this worker's previous run without
+ * waiting for its leases to expire.
+ *
+ * @param conn  Active PostgreSQL connection
+ * @param owner Worker ID whose leases are released
+ * @return      Number of tickets released, or -1 on failure
+ */
+int ticket_db_release_leases(PGconn *conn, const char *owner);
+
+/**
+ * Removes one chunk of finished tickets: completed ones sent more than
+ * keep_days ago and failed ones created that long ago, in id order
+ * starting after after_id, either moving them to tickets_archive or
+ * deleting them. Rows locked elsewhere are skipped.
+ *
+ * @param conn      Active PostgreSQL connection
+ * @param archive   Non-zero to copy the tickets to tickets_archive first
+ * @param keep_days Age in days below which finished tickets are kept
+ * @param after_id  Only tickets with a higher id are considered
+ * @param limit     Most tickets to remove
+ * @param last_id   Receives the highest id removed (0 if none)
+ * @return          Number of tickets removed, or -1 on failure
+ */
+int ticket_db_retire_completed(PGconn *conn, int archive, int keep_days, int after_id, int limit,
+                               int *last_id);
+
+/**
+ * Runs clean_old_tickets(): drops the monthly partitions that ended more
+ * than keep_days ago and hold no unfinished tickets, and creates the ones
+ * for the coming months.
+ *
+ * @param conn      Active PostgreSQL connection
+ * @param archive   Non-zero to keep partitions holding any ticket, until
+ *                  ticket_db_retire_completed() archived them all
+ * @param keep_days Age in days of the newest tickets a dropped partition may hold
+ * @return          Number of partitions dropped, or -1 on failure
+ */
+int ticket_db_drop_expired_partitions(PGconn *conn, int archive, int keep_days);
+
+/**
+ * Counts the tickets waiting to be claimed.
+ *
+ * @param conn Active PostgreSQL connection
+ * @return     Number of 'received' tickets, or -1 on failure
+ */
+long ticket_db_count_received(PGconn *conn);
+
+#endif /* TICKET_DB_H */
@@ -0,0 +1,106 @@
+/**
+ * ticket_ring.c
+ *
+ * Lock-free bounded queue declared in ticket_ring.h. Slot i starts with
+ * sequence i. A producer may fill the slot at position pos once its
+ * sequence equals pos and then publishes it as pos + 1; a consumer may
+ * empty it once the sequence is pos + 1 and then hands it back to the
+ * producers of the next lap as pos + capacity.
+ */
+
+#include "ticket_ring.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct ticket_ring_slot {
+    atomic_size_t sequence;
+    struct ticket *ticket;
+};
+
+int ticket_ring_init(struct ticket_ring *ring, size_t capacity) {
+    size_t size = 2;
+
+    while (size < capacity) {
+        size *= 2;
+    }
+    ring->slots = calloc(size, sizeof(*ring->slots));
+    if (!ring->slots) {
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&ring->slots[i].sequence, i);
+    }
+    ring->mask = size - 1;
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->head, 0);
+    return 0;
+}
+
+void ticket_ring_destroy(struct ticket_ring *ring) {
+    struct ticket *ticket;
+
+    while ((ticket = ticket_ring_pop(ring)) != NULL) {
+        ticket_free(ticket);
+    }
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+int ticket_ring_push(struct ticket_ring *ring, struct ticket *ticket) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    for (;;) {
+        struct ticket_ring_slot *slot = &ring->slots[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            /* The slot is free for this lap: claim the position */
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                slot->ticket = ticket;
+                atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1; /* Still holds the previous lap's ticket: full */
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+}
+
+struct ticket *ticket_ring_pop(struct ticket_ring *ring) {
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    for (;;) {
+        struct ticket_ring_slot *slot = &ring->slots[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                struct ticket *ticket = slot->ticket;
+
+                atomic_store_explicit(&slot->sequence, pos + ring->mask + 1,
+                                      memory_order_release);
+                return ticket;
+            }
+        } else if (diff < 0) {
+            return NULL; /* Not yet published: empty */
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+}
+
+size_t ticket_ring_count(struct ticket_ring *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    return tail > head ? tail - head : 0;
+}
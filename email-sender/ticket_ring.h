@@ -0,0 +1,70 @@
+/**
+ * ticket_ring.h
+ *
+ * Bounded lock-free multi-producer, multi-consumer queue of tickets that
+ * hands claimed work from the claiming thread to the sender threads. It
+ * is an array of slots, each tagged with a sequence number that tells
+ * producers and consumers whose turn the slot is, so pushes and pops only
+ * contend on a compare-and-swap of the head or tail index and never block.
+ */
+
+#ifndef TICKET_RING_H
+#define TICKET_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "ticket.h"
+
+struct ticket_ring_slot;
+
+struct ticket_ring {
+    struct ticket_ring_slot *slots;
+    size_t mask;                   /* Capacity - 1; the capacity is a power of two */
+    /* Producers and consumers each get their own cache line */
+    _Alignas(64) atomic_size_t tail;  /* Next position to push */
+    _Alignas(64) atomic_size_t head;  /* Next position to pop */
+};
+
+/**
+ * Initializes an empty ring.
+ *
+ * @param ring     Ring to initialize
+ * @param capacity Minimum number of tickets it must hold (rounded up to a power of two)
+ * @return         0 on success, -1 if out of memory
+ */
+int ticket_ring_init(struct ticket_ring *ring, size_t capacity);
+
+/**
+ * Frees the ring and every ticket still in it. No thread may be using it.
+ *
+ * @param ring Ring to destroy
+ */
+void ticket_ring_destroy(struct ticket_ring *ring);
+
+/**
+ * Appends a ticket (with any tickets grouped with it). Safe from any thread.
+ *
+ * @param ring   Ring to push onto
+ * @param ticket Ticket to hand over
+ * @return       0 on success, -1 if the ring is full (the ticket is not taken)
+ */
+int ticket_ring_push(struct ticket_ring *ring, struct ticket *ticket);
+
+/**
+ * Removes the oldest ticket. Safe from any thread.
+ *
+ * @param ring Ring to pop from
+ * @return     The ticket (now owned by the caller), or NULL if the ring is empty
+ */
+struct ticket *ticket_ring_pop(struct ticket_ring *ring);
+
+/**
+ * Number of tickets in the ring. Only a snapshot while other threads use it.
+ *
+ * @param ring Ring to query
+ * @return     Tickets pushed and not yet popped
+ */
+size_t ticket_ring_count(struct ticket_ring *ring);
+
+#endif /* TICKET_RING_H */
@@ -1,43 +1,232 @@
 -- Create enum type for ticket status
-CREATE TYPE ticket_status AS ENUM ('received', 'processing', 'completed');
+CREATE TYPE ticket_status AS ENUM ('received', 'processing', 'completed', 'failed');
 
--- Create the tickets table
-CREATE TABLE tickets (
+-- Create enum type for the claim lanes, most urgent first. The email
+-- sender shares each claim between the lanes by weight, so transactional
+-- mail is not held up by a bulk backlog and bulk mail still moves.
+CREATE TYPE ticket_priority AS ENUM ('high', 'normal', 'bulk');
+
+-- Create the templates table. A templated ticket names one and carries
+-- its values as JSON params instead of a rendered subject and body;
+-- {{name}} in the subject or body is replaced by the value of "name".
+-- The email sender caches compiled templates, and changes reach it
+-- through the template_changed notification below.
+CREATE TABLE templates (
     id SERIAL PRIMARY KEY,
-    email VARCHAR(255) NOT NULL CHECK (email ~* '^[A-Za-z0-9._%+-]+@[A-Za-z0-9.-]+\.[A-Za-z]{2,}'),
-    status ticket_status NOT NULL DEFAULT 'received',
+    name TEXT NOT NULL UNIQUE,
     subject VARCHAR(255) NOT NULL CHECK (length(subject) > 0),
     body TEXT NOT NULL,
-    created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
-    sent_at TIMESTAMP,
-    retry_count INTEGER DEFAULT 0,
-    last_error TEXT
+    updated_at TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP
 );
 
--- Create index for status for faster lookups
-CREATE INDEX idx_tickets_status ON tickets(status);
+-- Create the attachments table. Each attachment is stored either inline
+-- as bytea or as a large object (lo), and tickets list theirs by id in
+-- attachment_ids. The email sender reads them a chunk at a time while the
+-- message is being sent, so their size is not limited by its memory.
+CREATE TABLE attachments (
+    id SERIAL PRIMARY KEY,
+    filename TEXT NOT NULL,
+    content_type TEXT NOT NULL DEFAULT 'application/octet-stream',
+    data BYTEA,
+    lo OID,
+    created_at TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP,
+    CHECK ((data IS NULL) <> (lo IS NULL))
+);
+
+-- Keep bytea data uncompressed out of line, so reading a chunk of it only
+-- fetches that chunk instead of decompressing the whole value
+ALTER TABLE attachments ALTER COLUMN data SET STORAGE EXTERNAL;
+
+-- Create the tickets table, partitioned by month of creation so old
+-- tickets are dropped a partition at a time instead of row by row. The
+-- primary key has to include the partition key; ids still come from one
+-- sequence and are unique.
+CREATE TABLE tickets (
+    id SERIAL,
+    email VARCHAR(255) NOT NULL CHECK (email ~* '^[A-Za-z0-9._%+-]+@[A-Za-z0-9.-]+\.[A-Za-z]{2,}'),
+    status ticket_status NOT NULL DEFAULT 'received',
+    priority ticket_priority NOT NULL DEFAULT 'normal',
+    subject VARCHAR(255) CHECK (length(subject) > 0), -- NULL with a template
+    body TEXT,                                        -- NULL with a template
+    template_id INTEGER REFERENCES templates(id),
+    params JSONB CHECK (jsonb_typeof(params) = 'object'), -- Values for the template
+    html_body TEXT,                -- HTML alternative to the plain text body
+    attachment_ids INTEGER[],      -- Rows of attachments, in order
+    created_at TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP,
+    sent_at TIMESTAMP,
+    retry_count INTEGER DEFAULT 0, -- Failed delivery attempts
+    last_error TEXT,               -- Why the last attempt or validation failed
+    owner TEXT,                    -- Worker ID of the email-sender holding the lease
+    lease_expires_at TIMESTAMP,    -- Lease deadline while status is 'processing'
+    message_id TEXT,               -- Message-ID of the attempt handed to the SMTP server
+    CHECK (template_id IS NOT NULL OR (subject IS NOT NULL AND body IS NOT NULL)),
+    PRIMARY KEY (id, created_at)
+) PARTITION BY RANGE (created_at);
+
+-- Create the monthly partitions from the current month to months_ahead
+-- months later (existing ones are left alone). Tickets of a new month
+-- already caught by tickets_default would make PARTITION OF fail, so each
+-- partition is created on its own, takes those tickets over, then is
+-- attached. A month that still fails is logged and retried on the next
+-- call rather than stopping the rest.
+CREATE OR REPLACE FUNCTION create_ticket_partitions(months_ahead INTEGER DEFAULT 3)
+RETURNS VOID AS $$
+DECLARE
+    month_start DATE;
+    part TEXT;
+BEGIN
+    FOR i IN 0..months_ahead LOOP
+        month_start := date_trunc('month', CURRENT_DATE)::DATE + make_interval(months => i);
+        part := 'tickets_' || to_char(month_start, 'YYYY_MM');
+        CONTINUE WHEN to_regclass(part) IS NOT NULL;
+        BEGIN
+            -- Indexes and foreign keys are added by ATTACH PARTITION
+            EXECUTE format('CREATE TABLE %I (LIKE tickets INCLUDING ALL EXCLUDING INDEXES)', part);
+            IF to_regclass('tickets_default') IS NOT NULL THEN
+                EXECUTE format('WITH moved AS (DELETE FROM tickets_default ' ||
+                               'WHERE created_at >= %L AND created_at < %L RETURNING *) ' ||
+                               'INSERT INTO %I SELECT * FROM moved',
+                               month_start, month_start + INTERVAL '1 month', part);
+            END IF;
+            EXECUTE format('ALTER TABLE tickets ATTACH PARTITION %I FOR VALUES FROM (%L) TO (%L)',
+                           part, month_start, month_start + INTERVAL '1 month');
+        EXCEPTION WHEN others THEN
+            RAISE WARNING 'Could not create partition %: %', part, SQLERRM;
+        END;
+    END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+SELECT create_ticket_partitions();
+
+-- Catch tickets outside every monthly partition rather than reject them
+CREATE TABLE tickets_default PARTITION OF tickets DEFAULT;
+
+-- Create index for the tickets still to be sent, oldest first within each
+-- lane. Only unfinished tickets are indexed, so claiming stays as fast
+-- however much history is kept.
+CREATE INDEX idx_tickets_pending ON tickets(priority, id) WHERE status IN ('received', 'processing');
 
--- Create notification function
+-- Create index for finding leases abandoned by crashed senders
+CREATE INDEX idx_tickets_lease ON tickets(lease_expires_at) WHERE status = 'processing';
+
+-- Create notification function. It runs once per INSERT statement, so bulk
+-- loads cost one notification rather than one per row: "first-last" for
+-- the range of ids inserted, or the id alone for a single ticket. The
+-- sender claims in batches either way.
+--
+-- With email_sender.notify_payload on, a single ticket is notified whole as
+-- "id:email_len:subject_len:body_len:" followed by the three fields
+-- (lengths in bytes), so the sender can claim it by id without the body
+-- being sent again. Tickets too large for a notification (8000 bytes),
+-- templated tickets, bulk tickets and tickets with an HTML body or
+-- attachments only send their id and are claimed in full.
 CREATE OR REPLACE FUNCTION notify_ticket_insertion()
 RETURNS TRIGGER AS $$
+DECLARE
+    inserted BIGINT;
+    first_id INTEGER;
+    last_id INTEGER;
+    payload TEXT;
 BEGIN
-    PERFORM pg_notify('new_ticket', NEW.id::TEXT);
-    RETURN NEW;
+    SELECT count(*), min(id), max(id) INTO inserted, first_id, last_id FROM new_tickets;
+    IF inserted = 0 THEN
+        RETURN NULL;
+    END IF;
+
+    IF inserted = 1 THEN
+        IF coalesce(current_setting('email_sender.notify_payload', true), 'off') = 'on' THEN
+            SELECT id || ':' || octet_length(email) || ':' || octet_length(subject)
+                   || ':' || octet_length(body) || ':' || email || subject || body
+              INTO payload FROM new_tickets
+             WHERE html_body IS NULL AND attachment_ids IS NULL AND priority <> 'bulk';
+            IF payload IS NOT NULL AND octet_length(payload) < 8000 THEN
+                PERFORM pg_notify('new_ticket', payload);
+                RETURN NULL;
+            END IF;
+        END IF;
+        PERFORM pg_notify('new_ticket', first_id::TEXT);
+    ELSE
+        PERFORM pg_notify('new_ticket', first_id || '-' || last_id);
+    END IF;
+    RETURN NULL;
 END;
 $$ LANGUAGE plpgsql;
 
 -- Create trigger for the tickets table
 CREATE TRIGGER ticket_inserted
 AFTER INSERT ON tickets
-FOR EACH ROW
+REFERENCING NEW TABLE AS new_tickets
+FOR EACH STATEMENT
 EXECUTE FUNCTION notify_ticket_insertion();
 
--- Add a function to clean old completed tickets after 30 days
-CREATE OR REPLACE FUNCTION clean_old_tickets()
-RETURNS VOID AS $$
+-- Tell email senders to drop their cached copy of a changed template
+CREATE OR REPLACE FUNCTION notify_template_change()
+RETURNS TRIGGER AS $$
+BEGIN
+    PERFORM pg_notify('template_changed', OLD.id::TEXT);
+    RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER template_changed
+AFTER UPDATE OR DELETE ON templates
+FOR EACH ROW
+EXECUTE FUNCTION notify_template_change();
+
+-- Completed and failed tickets moved out of the live table by the email
+-- sender's retention job (RETENTION_ARCHIVE), with the bodies compressed
+CREATE TABLE tickets_archive (
+    id INTEGER PRIMARY KEY,
+    email VARCHAR(255) NOT NULL,
+    subject VARCHAR(255),
+    body TEXT COMPRESSION lz4,
+    created_at TIMESTAMP NOT NULL,
+    sent_at TIMESTAMP,
+    retry_count INTEGER,
+    template_id INTEGER,
+    params JSONB,
+    priority ticket_priority,
+    html_body TEXT COMPRESSION lz4,
+    attachment_ids INTEGER[],
+    message_id TEXT,
+    status ticket_status,
+    last_error TEXT,
+    archived_at TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP
+);
+
+-- Add a function to drop old tickets: every monthly partition that ended
+-- more than keep_days ago, unless it still holds tickets waiting to be
+-- sent, or with keep_unarchived, any ticket not yet moved to
+-- tickets_archive (the others are all completed or failed). Also creates the partitions for the coming months. The
+-- email sender runs it at the start of each retention run. Returns the
+-- number of partitions dropped.
+CREATE OR REPLACE FUNCTION clean_old_tickets(keep_days INTEGER DEFAULT 30,
+                                             keep_unarchived BOOLEAN DEFAULT false)
+RETURNS INTEGER AS $$
+DECLARE
+    part RECORD;
+    pending BOOLEAN;
+    dropped INTEGER := 0;
 BEGIN
-    DELETE FROM tickets
-    WHERE status = 'completed'
-    AND sent_at < (CURRENT_TIMESTAMP - INTERVAL '30 days');
+    PERFORM create_ticket_partitions();
+
+    FOR part IN
+        SELECT c.relname
+        FROM pg_inherits i JOIN pg_class c ON c.oid = i.inhrelid
+        WHERE i.inhparent = 'tickets'::regclass
+        AND c.relname ~ '^tickets_[0-9]{4}_[0-9]{2}$'
+        AND to_date(substring(c.relname FROM 9), 'YYYY_MM') + INTERVAL '1 month'
+            < CURRENT_TIMESTAMP - keep_days * INTERVAL '1 day'
+    LOOP
+        EXECUTE format('SELECT EXISTS (SELECT 1 FROM %I WHERE status IN (''received'', ''processing'')' ||
+                       ' OR $1)', part.relname)
+            INTO pending USING keep_unarchived;
+        IF NOT pending THEN
+            EXECUTE format('DROP TABLE %I', part.relname);
+            dropped := dropped + 1;
+        END IF;
+    END LOOP;
+    RETURN dropped;
 END;
 $$ LANGUAGE plpgsql;
@@ -3,5 +3,11 @@ set -e
 
 psql -v ON_ERROR_STOP=1 --username "$POSTGRES_USER" --dbname "$POSTGRES_DB" << EOF
 GRANT ALL PRIVILEGES ON TABLE tickets TO $POSTGRES_USER;
+GRANT ALL PRIVILEGES ON TABLE tickets_archive TO $POSTGRES_USER;
+GRANT ALL PRIVILEGES ON TABLE templates TO $POSTGRES_USER;
+GRANT ALL PRIVILEGES ON TABLE attachments TO $POSTGRES_USER;
+GRANT USAGE, SELECT ON SEQUENCE attachments_id_seq TO $POSTGRES_USER;
+GRANT USAGE, SELECT ON SEQUENCE templates_id_seq TO $POSTGRES_USER;
 GRANT USAGE, SELECT ON SEQUENCE tickets_id_seq TO $POSTGRES_USER;
+ALTER DATABASE "$POSTGRES_DB" SET email_sender.notify_payload = '${NOTIFY_PAYLOAD:-off}';
 EOF